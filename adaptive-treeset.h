@@ -0,0 +1,701 @@
+#ifndef ADAPTIVE_TREESET_HH
+#define ADAPTIVE_TREESET_HH
+
+#include "treeset.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <iostream>
+#include <new>
+#include <utility>
+#include <vector>
+
+/*!
+treeset_inline_array holds up to N values inside the object itself, with no
+heap storage. AdaptiveTreeSet keeps tiny sets in one, in sorted order.
+*/
+template <typename T, std::size_t N>
+class treeset_inline_array {
+  alignas(T) unsigned char _storage[N * sizeof(T)];
+  std::size_t _size = 0;
+
+  T *slot(std::size_t i) {
+    return std::launder(reinterpret_cast<T *>(_storage)) + i;
+  };
+
+  const T *slot(std::size_t i) const {
+    return std::launder(reinterpret_cast<const T *>(_storage)) + i;
+  };
+
+public:
+  treeset_inline_array() { };
+
+  treeset_inline_array(const treeset_inline_array &other) {
+    for (; _size < other._size; _size++)
+      new (slot(_size)) T(other[_size]);
+  };
+
+  treeset_inline_array &operator=(const treeset_inline_array &other) {
+    if (this != &other) {
+      clear();
+      for (; _size < other._size; _size++)
+        new (slot(_size)) T(other[_size]);
+    }
+    return *this;
+  };
+
+  ~treeset_inline_array() { clear(); };
+
+  std::size_t size() const { return _size; };
+
+  const T *begin() const { return slot(0); };
+  const T *end() const { return slot(_size); };
+
+  const T &operator[](std::size_t i) const { return *slot(i); };
+
+  //! Inserts value before position pos. There must be room for it.
+  void insert(std::size_t pos, const T &value) {
+    if (pos == _size) {
+      new (slot(_size)) T(value);
+    } else {
+      new (slot(_size)) T(std::move(*slot(_size - 1)));
+      std::move_backward(slot(pos), slot(_size - 1), slot(_size));
+      *slot(pos) = value;
+    }
+    _size++;
+  };
+
+  //! Removes the value at position pos.
+  void erase(std::size_t pos) {
+    std::move(slot(pos + 1), slot(_size), slot(pos));
+    slot(--_size)->~T();
+  };
+
+  void clear() {
+    while (_size > 0)
+      slot(--_size)->~T();
+  };
+};
+
+/***************** Begin AdaptiveTreeSet declaration  ****************/
+
+template <typename T, typename Compare = std::less<T>>
+class AdaptiveTreeSetIter; //! Forward declaration of AdaptiveTreeSetIter
+
+/*!
+AdaptiveTreeSet has the interface of TreeSet, but picks its representation
+from the set's size and how it is being used:
+
+  INLINE  a sorted array inside the set object, while the set is tiny
+  TREE    a TreeSet, once the set outgrows the array and while it changes
+  FROZEN  the TreeSet plus a flat copy of its values in breadth-first
+          (Eytzinger) order, once it has been read n/4 times since its last
+          change; lookups then walk the flat array, where the top levels of
+          every search share cache lines and the next levels can be prefetched
+
+A set moves from INLINE to TREE when an add overflows the array, and back when
+deletes shrink it to half the array. The first change to a FROZEN set drops the
+flat copy, leaving the tree it was made from; an add of a value already in the
+set, or a del of one that is not, is no change and keeps the copy. Freezing copies each value once,
+which is paid for many times over by the n/4 lookups that trigger it (each a
+walk of a pointer tree), and thawing is just freeing the copy.
+Because even reads may reorganize it, an AdaptiveTreeSet must not be read by
+several threads at once; use a const TreeSet for that. Iterators are
+invalidated by changes to the set, as with TreeSet. Freezing leaves existing
+iterators valid, but they walk the tree and never compare equal to iterators
+made after the set froze.
+*/
+template <typename T, typename Compare = std::less<T>>
+class AdaptiveTreeSet {
+  static_assert(!bitmap_key_set<T, Compare>,
+                "sets of small keys are already stored as bitmaps");
+
+public:
+  //! The ways the set can be stored
+  enum representation { INLINE, TREE, FROZEN };
+
+private:
+  //! Values kept inline: as many as fit in 128 bytes, and at least one
+  static constexpr std::size_t INLINE_CAPACITY =
+    std::max<std::size_t>(1, 128 / sizeof(T));
+
+  //! A tree freezes once it has been read size / FREEZE_DIVISOR times
+  static constexpr long FREEZE_DIVISOR = 4;
+
+  //! The values, while the set is INLINE
+  treeset_inline_array<T, INLINE_CAPACITY> _inline;
+
+  //! The values, while the set is a TREE or FROZEN
+  TreeSet<T, Compare> _tree;
+
+  //! While FROZEN, the tree's values in breadth-first order
+  mutable std::vector<T> _flat;
+
+  mutable representation _rep = INLINE;
+
+  //! Reads since the last change, counted while the set is a TREE
+  mutable long _reads_since_write = 0;
+
+  //! Comparator used for the items in the set
+  Compare _cmp;
+
+  //! Counts a read, and freezes the set once it has been read enough.
+  void note_read() const;
+
+  /*! Notes a change to the set, dropping the flat copy if it is frozen.
+    Called only once an add or del is known to change the set.
+  */
+  void note_write();
+
+  //! Makes the flat copy of the tree's values, and marks the set FROZEN.
+  void freeze() const;
+
+  /*! Sets rank[k] to the in-order rank of breadth-first index k, for the
+    subtree at k of a complete tree of rank.size() nodes.
+  */
+  static void flat_ranks(std::size_t k, std::vector<std::size_t> &rank,
+                         std::size_t &next);
+
+  //! Index of the first inline value not less than (or greater than) value
+  std::size_t inline_bound(const T &value, bool upper) const;
+
+  //! Flat index of the first value not less than (or greater than) value
+  std::size_t flat_bound(const T &value, bool upper) const;
+
+  //! Moves the inline values into the tree, then adds value there.
+  void grow_to_tree(const T &value);
+
+  //! Moves the tree's values into the inline array.
+  void shrink_to_inline();
+
+  //! Makes this (empty) set hold the sorted values.
+  void assign_sorted(const std::vector<T> &values);
+
+public:
+  //! Provide "standard" name for iterator type
+  using iterator = AdaptiveTreeSetIter<T, Compare>;
+
+  //! Constructor initializes an empty set.
+  AdaptiveTreeSet() { };
+
+  //! Initializer-list constructor
+  AdaptiveTreeSet(const std::initializer_list<T> &list) {
+    for (const T &value : list)
+      add(value);
+  };
+
+  //! Returns how the set is stored right now.
+  representation current_representation() const { return _rep; };
+
+  //! Return an iterator to the first value in the set
+  iterator begin() const;
+
+  //! Return an iterator "past the end" of the set.
+  iterator end() const { return iterator{}; };
+
+  //! Return an iterator to the first value that is not less than value.
+  iterator lower_bound(const T &value) const;
+
+  //! Return an iterator to the first value that is greater than value.
+  iterator upper_bound(const T &value) const;
+
+  //! Returns true if the rhs set contains the same values as this set.
+  bool operator==(const AdaptiveTreeSet<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const AdaptiveTreeSet<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+
+  //! Computes the set-union of this set and the provided set s.
+  AdaptiveTreeSet<T, Compare> plus(const AdaptiveTreeSet<T, Compare> &s) const;
+
+  //! Computes the set-intersection of this set & provided set s.
+  AdaptiveTreeSet<T, Compare> intersect(
+    const AdaptiveTreeSet<T, Compare> &s) const;
+
+  //! Computes the set-difference of this set & provided set s.
+  AdaptiveTreeSet<T, Compare> minus(const AdaptiveTreeSet<T, Compare> &s) const;
+
+  //! Returns the number of elements in the set.
+  int size() const {
+    return _rep == INLINE ? (int) _inline.size() : _tree.size();
+  };
+
+  //! Attempts to add a value to the set.
+  bool add(const T &value);
+
+  //! Attempts to remove value from the set.
+  bool del(const T &value);
+
+  //! Returns whether the value appears in the set or not.
+  bool contains(const T &value) const;
+};
+
+/*! AdaptiveTreeSetIter walks whichever representation its set had when the
+  iterator was made: the inline array, the tree, or the flat copy (stepping
+  to each value's in-order successor by index arithmetic).
+*/
+template <typename T, typename Compare>
+class AdaptiveTreeSetIter {
+  enum kind { END, ARRAY, TREE, FLAT };
+
+  kind _kind = END;
+
+  //! Position in the inline array
+  const T *_array = nullptr;
+  const T *_array_end = nullptr;
+
+  //! Position in the tree
+  TreeSetIter<T, Compare> _tree_it;
+
+  //! Position in the flat copy
+  const std::vector<T> *_flat = nullptr;
+  std::size_t _k = 0;
+
+  //! As a friend, AdaptiveTreeSet can make iterators of each kind
+  friend class AdaptiveTreeSet<T, Compare>;
+
+  static AdaptiveTreeSetIter at_array(const T *p, const T *end) {
+    AdaptiveTreeSetIter it;
+    if (p != end) {
+      it._kind = ARRAY;
+      it._array = p;
+      it._array_end = end;
+    }
+    return it;
+  };
+
+  static AdaptiveTreeSetIter at_tree(const TreeSetIter<T, Compare> &tree_it) {
+    AdaptiveTreeSetIter it;
+    if (tree_it != TreeSetIter<T, Compare>{}) {
+      it._kind = TREE;
+      it._tree_it = tree_it;
+    }
+    return it;
+  };
+
+  static AdaptiveTreeSetIter at_flat(const std::vector<T> *flat,
+                                     std::size_t k) {
+    AdaptiveTreeSetIter it;
+    if (k < flat->size()) {
+      it._kind = FLAT;
+      it._flat = flat;
+      it._k = k;
+    }
+    return it;
+  };
+
+public:
+  //! Default constructor makes an "end" iterator
+  AdaptiveTreeSetIter() { };
+
+  //! Pre-increment operator returns a ref to the iterator that was incremented.
+  AdaptiveTreeSetIter<T, Compare>& operator++();
+
+  //! Post-increment operator returns a copy of the iterator before incremented.
+  AdaptiveTreeSetIter<T, Compare> operator++(int) {
+    AdaptiveTreeSetIter<T, Compare> it = *this;
+    ++(*this);
+    return it;
+  };
+
+  //! Dereference returns the value the iterator is at
+  const T& operator*() const {
+    if (_kind == ARRAY)
+      return *_array;
+    if (_kind == TREE)
+      return *_tree_it;
+    return (*_flat)[_k];
+  };
+
+  //! Compares the positions of the iterators
+  bool operator==(const AdaptiveTreeSetIter<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const AdaptiveTreeSetIter<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+};
+
+/*! Outputs the contents of the set in the same format as TreeSet: "[1,2,3]" */
+template <typename T, typename Compare>
+std::ostream& operator<<(std::ostream &os,
+                         const AdaptiveTreeSet<T, Compare> &s) {
+  os << "[";
+
+  for (auto it = s.begin(); it != s.end(); ) {
+    os << *it;
+    if (++it != s.end())
+      os << ",";
+  }
+
+  os << "]";
+  return os;
+}
+
+/***************** End AdaptiveTreeSet declaration  ****************/
+
+
+
+
+
+/***************** Begin AdaptiveTreeSetIter definition ****************/
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSetIter<T, Compare>& AdaptiveTreeSetIter<T, Compare>::operator++() {
+  if (_kind == ARRAY) {
+    if (++_array == _array_end)
+      _kind = END;
+  } else if (_kind == TREE) {
+    if (++_tree_it == TreeSetIter<T, Compare>{})
+      _kind = END;
+  } else if (_kind == FLAT) {
+    // Children of k are 2k + 1 (left) and 2k + 2 (right)
+    std::size_t n = _flat->size();
+    if (2 * _k + 2 < n) {
+      // The successor is the leftmost node of the right subtree
+      _k = 2 * _k + 2;
+      while (2 * _k + 1 < n)
+        _k = 2 * _k + 1;
+    } else {
+      // Otherwise it is the parent of the nearest left child on the way up
+      while (_k != 0 && _k % 2 == 0)
+        _k = (_k - 1) / 2;
+      if (_k == 0)
+        _kind = END;
+      else
+        _k = (_k - 1) / 2;
+    }
+  }
+
+  return *this;
+}
+
+template <typename T, typename Compare> inline
+bool AdaptiveTreeSetIter<T, Compare>::operator==(
+  const AdaptiveTreeSetIter<T, Compare> &rhs) const {
+  if (_kind != rhs._kind)
+    return false;
+
+  switch (_kind) {
+  case ARRAY:
+    return _array == rhs._array;
+  case TREE:
+    return _tree_it == rhs._tree_it;
+  case FLAT:
+    return _flat == rhs._flat && _k == rhs._k;
+  default:
+    return true;
+  }
+}
+
+/***************** End AdaptiveTreeSetIter definition  ****************/
+
+
+
+
+
+/***************** Begin AdaptiveTreeSet definition ****************/
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::note_read() const {
+  if (_rep == TREE &&
+      ++_reads_since_write * FREEZE_DIVISOR >= _tree.size())
+    freeze();
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::note_write() {
+  _reads_since_write = 0;
+
+  if (_rep == FROZEN) {
+    std::vector<T>().swap(_flat);
+    _rep = TREE;
+  }
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::flat_ranks(std::size_t k,
+                                             std::vector<std::size_t> &rank,
+                                             std::size_t &next) {
+  if (k >= rank.size())
+    return;
+
+  flat_ranks(2 * k + 1, rank, next);
+  rank[k] = next++;
+  flat_ranks(2 * k + 2, rank, next);
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::freeze() const {
+  std::vector<T> sorted;
+  sorted.reserve(_tree.size());
+  for (auto it = _tree.begin(); it != _tree.end(); ++it)
+    sorted.push_back(*it);
+
+  std::vector<std::size_t> rank(sorted.size());
+  std::size_t next = 0;
+  flat_ranks(0, rank, next);
+
+  _flat.clear();
+  _flat.reserve(sorted.size());
+  for (std::size_t r : rank)
+    _flat.push_back(sorted[r]);
+
+  _rep = FROZEN;
+}
+
+template <typename T, typename Compare> inline
+std::size_t AdaptiveTreeSet<T, Compare>::inline_bound(const T &value,
+                                                      bool upper) const {
+  const T *p = upper
+    ? std::upper_bound(_inline.begin(), _inline.end(), value, _cmp)
+    : std::lower_bound(_inline.begin(), _inline.end(), value, _cmp);
+  return p - _inline.begin();
+}
+
+template <typename T, typename Compare> inline
+std::size_t AdaptiveTreeSet<T, Compare>::flat_bound(const T &value,
+                                                    bool upper) const {
+  std::size_t n = _flat.size(), best = n;
+
+  for (std::size_t k = 0; k < n; ) {
+    // k's four grandchildren, 4k + 3 to 4k + 6, are contiguous
+    if (4 * k + 3 < n)
+      __builtin_prefetch(&_flat[4 * k + 3]);
+
+    bool go_left = upper ? _cmp(value, _flat[k]) : !_cmp(_flat[k], value);
+    if (go_left) {
+      best = k;
+      k = 2 * k + 1;
+    } else {
+      k = 2 * k + 2;
+    }
+  }
+
+  return best;
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::grow_to_tree(const T &value) {
+  // The tree keeps its node pool while the set is inline, so a set that keeps
+  // growing and shrinking across the threshold reuses the same nodes
+  _tree.clear();
+  for (const T &v : _inline)
+    _tree.add(v);
+  _tree.add(value);
+
+  _inline.clear();
+  _rep = TREE;
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::shrink_to_inline() {
+  for (auto it = _tree.begin(); it != _tree.end(); ++it)
+    _inline.insert(_inline.size(), *it);
+
+  _tree.clear();
+  _rep = INLINE;
+}
+
+template <typename T, typename Compare> inline
+void AdaptiveTreeSet<T, Compare>::assign_sorted(const std::vector<T> &values) {
+  if (values.size() <= INLINE_CAPACITY) {
+    for (const T &v : values)
+      _inline.insert(_inline.size(), v);
+  } else {
+    _tree = TreeSet<T, Compare>().plus(TreeSetView<T, Compare>(values));
+    _rep = TREE;
+  }
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare>::iterator AdaptiveTreeSet<T, Compare>::begin()
+  const {
+  note_read();
+
+  if (_rep == INLINE)
+    return iterator::at_array(_inline.begin(), _inline.end());
+  if (_rep == TREE)
+    return iterator::at_tree(_tree.begin());
+
+  std::size_t k = 0;
+  while (2 * k + 1 < _flat.size())
+    k = 2 * k + 1;
+  return iterator::at_flat(&_flat, k);
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare>::iterator AdaptiveTreeSet<T, Compare>::lower_bound(
+  const T &value) const {
+  note_read();
+
+  if (_rep == INLINE) {
+    return iterator::at_array(_inline.begin() + inline_bound(value, false),
+                              _inline.end());
+  }
+  if (_rep == TREE)
+    return iterator::at_tree(_tree.lower_bound(value));
+  return iterator::at_flat(&_flat, flat_bound(value, false));
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare>::iterator AdaptiveTreeSet<T, Compare>::upper_bound(
+  const T &value) const {
+  note_read();
+
+  if (_rep == INLINE) {
+    return iterator::at_array(_inline.begin() + inline_bound(value, true),
+                              _inline.end());
+  }
+  if (_rep == TREE)
+    return iterator::at_tree(_tree.upper_bound(value));
+  return iterator::at_flat(&_flat, flat_bound(value, true));
+}
+
+template <typename T, typename Compare> inline
+bool AdaptiveTreeSet<T, Compare>::operator==(
+  const AdaptiveTreeSet<T, Compare> &rhs) const {
+  if (size() != rhs.size())
+    return false;
+
+  if (_rep != INLINE && rhs._rep != INLINE)
+    return _tree == rhs._tree;
+
+  for (auto a = begin(), b = rhs.begin(); a != end(); ++a, ++b) {
+    if (_cmp(*a, *b) || _cmp(*b, *a))
+      return false;
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare> AdaptiveTreeSet<T, Compare>::plus(
+  const AdaptiveTreeSet<T, Compare> &s) const {
+  AdaptiveTreeSet<T, Compare> result;
+  if (_rep != INLINE && s._rep != INLINE) {
+    result._tree = _tree.plus(s._tree);
+    result._rep = TREE;
+    return result;
+  }
+
+  std::vector<T> values;
+  auto a = begin(), b = s.begin();
+  while (a != end() || b != s.end()) {
+    if (b == s.end() || (a != end() && _cmp(*a, *b))) {
+      values.push_back(*a++);
+    } else {
+      if (a != end() && !_cmp(*b, *a)) // in both sets
+        ++a;
+      values.push_back(*b++);
+    }
+  }
+
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare> AdaptiveTreeSet<T, Compare>::intersect(
+  const AdaptiveTreeSet<T, Compare> &s) const {
+  std::vector<T> values;
+  auto a = begin(), b = s.begin();
+  while (a != end() && b != s.end()) {
+    if (_cmp(*a, *b)) {
+      ++a;
+    } else if (_cmp(*b, *a)) {
+      ++b;
+    } else {
+      values.push_back(*a++);
+      ++b;
+    }
+  }
+
+  AdaptiveTreeSet<T, Compare> result;
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+AdaptiveTreeSet<T, Compare> AdaptiveTreeSet<T, Compare>::minus(
+  const AdaptiveTreeSet<T, Compare> &s) const {
+  std::vector<T> values;
+  auto b = s.begin();
+  for (auto a = begin(); a != end(); ++a) {
+    while (b != s.end() && _cmp(*b, *a))
+      ++b;
+    if (b == s.end() || _cmp(*a, *b))
+      values.push_back(*a);
+  }
+
+  AdaptiveTreeSet<T, Compare> result;
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+bool AdaptiveTreeSet<T, Compare>::contains(const T &value) const {
+  note_read();
+
+  if (_rep == INLINE) {
+    std::size_t i = inline_bound(value, false);
+    return i < _inline.size() && !_cmp(value, _inline[i]);
+  }
+  if (_rep == TREE)
+    return _tree.contains(value);
+
+  std::size_t k = flat_bound(value, false);
+  return k < _flat.size() && !_cmp(value, _flat[k]);
+}
+
+template <typename T, typename Compare> inline
+bool AdaptiveTreeSet<T, Compare>::add(const T &value) {
+  if (_rep != INLINE) {
+    if (!_tree.add(value))
+      return false;
+
+    note_write();
+    return true;
+  }
+
+  std::size_t i = inline_bound(value, false);
+  if (i < _inline.size() && !_cmp(value, _inline[i]))
+    return false;
+
+  note_write();
+  if (_inline.size() < INLINE_CAPACITY)
+    _inline.insert(i, value);
+  else
+    grow_to_tree(value);
+  return true;
+}
+
+template <typename T, typename Compare> inline
+bool AdaptiveTreeSet<T, Compare>::del(const T &value) {
+  if (_rep == INLINE) {
+    std::size_t i = inline_bound(value, false);
+    if (i == _inline.size() || _cmp(value, _inline[i]))
+      return false;
+
+    note_write();
+    _inline.erase(i);
+    return true;
+  }
+
+  if (!_tree.del(value))
+    return false;
+
+  note_write();
+
+  // Shrinking at half the capacity keeps a set near the threshold from
+  // converting back and forth on every add and del
+  if ((std::size_t) _tree.size() <= INLINE_CAPACITY / 2)
+    shrink_to_inline();
+  return true;
+}
+
+/***************** End AdaptiveTreeSet definition ****************/
+
+#endif
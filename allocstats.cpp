@@ -0,0 +1,85 @@
+#include "allocstats.h"
+
+#include <cstdlib>
+#include <new>
+
+
+static thread_local AllocStats stats = {0, 0, 0};
+
+
+AllocStats alloc_stats() {
+    return stats;
+}
+
+
+/*! Allocates size bytes, counting the allocation. */
+static void *counted_alloc(size_t size) {
+    stats.allocs++;
+    stats.bytes += (long) size;
+
+    // malloc(0) may return nullptr, but operator new must not
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == nullptr)
+        throw std::bad_alloc();
+
+    return p;
+}
+
+
+/*! Frees memory from counted_alloc(), counting the free. */
+static void counted_free(void *p) {
+    if (p == nullptr)
+        return;
+
+    stats.frees++;
+    free(p);
+}
+
+
+void *operator new(size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new[](size_t size) {
+    return counted_alloc(size);
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept {
+    try {
+        return counted_alloc(size);
+    } catch (const std::bad_alloc &) {
+        return nullptr;
+    }
+}
+
+void operator delete(void *p) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept {
+    counted_free(p);
+}
@@ -0,0 +1,45 @@
+#ifndef ALLOCSTATS_HH
+#define ALLOCSTATS_HH
+
+
+#include <cstddef>
+
+
+/*!
+ * Linking allocstats.cpp into a program replaces the global operator new and
+ * operator delete with versions that count every heap allocation the program
+ * makes.  The counts are kept per thread, so other threads cannot disturb a
+ * measurement.  Aligned (over-aligned type) allocations are not counted.
+ */
+struct AllocStats {
+    long allocs;                            // # of calls to operator new
+    long frees;                             // # of calls to operator delete
+    long bytes;                             // total bytes requested
+
+    AllocStats operator-(const AllocStats &rhs) const {
+        return AllocStats{allocs - rhs.allocs, frees - rhs.frees,
+                          bytes - rhs.bytes};
+    }
+};
+
+
+AllocStats alloc_stats();                   // counts so far on this thread
+
+
+/*!
+ * Measures the allocations made on this thread between construction and the
+ * call to delta().
+ */
+class AllocCounter {
+    AllocStats start;
+
+public:
+    AllocCounter() : start(alloc_stats()) { }
+
+    AllocStats delta() const { return alloc_stats() - start; }
+    long allocs() const { return delta().allocs; }
+    long bytes() const { return delta().bytes; }
+};
+
+
+#endif // ALLOCSTATS_HH
@@ -0,0 +1,1358 @@
+#include "treeset.h"
+#include "allocstats.h"
+#include "adaptive-treeset.h"
+#include "buffered-treeset.h"
+#include "hashcons-treeset.h"
+#include "perfcounters.h"
+#include "soa-treeset.h"
+#include "treeset-chunked.h"
+#include "treeset-simjoin.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+
+/*===========================================================================
+ * COMMON HELPER FUNCTIONS
+ *
+ * These are used by various benchmarks.
+ */
+
+
+using bench_clock = chrono::steady_clock;
+
+
+/*! Returns the number of seconds elapsed since start. */
+double seconds_since(bench_clock::time_point start) {
+    return chrono::duration<double>(bench_clock::now() - start).count();
+}
+
+
+/*!
+ * Make a vector of n distinct integers in a random (but repeatable) order.
+ * The values are spread out so that about half of random probes will miss.
+ */
+vector<int> make_random_keys(int n, unsigned seed) {
+    vector<int> v;
+    for (int i = 0; i < n; i++)
+        v.push_back(2 * i);
+
+    shuffle(v.begin(), v.end(), mt19937{seed});
+    return v;
+}
+
+
+/*!
+ * Keeps the compiler from optimizing away a computed value that is otherwise
+ * unused by the benchmark.
+ */
+template <typename T>
+void do_not_optimize(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+
+/*!
+ * Runs one measured phase of a benchmark, reading the hardware performance
+ * counters around it, and prints a row with the time and each counter divided
+ * by the number of operations in the phase.  Counters that could not be
+ * opened are shown as "n/a".
+ */
+template <typename Fn>
+void measure_phase(PerfCounters &counters, const char *phase, long ops, Fn fn) {
+    counters.start();
+    auto start = bench_clock::now();
+    fn();
+    double elapsed = seconds_since(start);
+    counters.stop();
+
+    cout << setw(12) << phase << setw(10) << fixed << setprecision(1)
+         << elapsed / ops * 1e9;
+
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++) {
+        auto c = (PerfCounters::counter) i;
+        cout << setw(11);
+        if (counters.available(c))
+            cout << setprecision(2) << (double) counters.value(c) / ops;
+        else
+            cout << "n/a";
+    }
+
+    cout << '\n';
+}
+
+
+/*! Prints the column headings for rows written by measure_phase(). */
+void print_phase_header(const PerfCounters &counters) {
+    if (!counters.any_available()) {
+        cout << "(hardware counters unavailable here; perf_event_open failed"
+                " or is not permitted)\n";
+    }
+
+    cout << setw(12) << "phase" << setw(10) << "ns";
+    for (int i = 0; i < PerfCounters::NUM_COUNTERS; i++)
+        cout << setw(11) << PerfCounters::name((PerfCounters::counter) i);
+    cout << "   (per op)\n";
+}
+
+
+/*===========================================================================
+ * READ SCALING
+ *
+ * Many threads perform lookups on one shared const TreeSet.  Since read paths
+ * walk raw node pointers and never write to the shared_ptr reference counts,
+ * aggregate throughput should grow linearly with the number of threads (up to
+ * the number of cores).
+ */
+
+
+void bench_read_scaling() {
+    const int num_keys = 1 << 18;
+    const int lookups_per_thread = 1 << 18;
+
+    TreeSet<int> s;
+    for (int k : make_random_keys(num_keys, 1))
+        s.add(k);
+
+    const TreeSet<int> &shared = s;
+
+    cout << "Read scaling: contains() on a " << num_keys << "-key TreeSet<int>"
+         << " (" << thread::hardware_concurrency() << " hardware threads)\n";
+    cout << setw(8) << "threads" << setw(14) << "Mops/s"
+         << setw(12) << "speedup" << '\n';
+
+    double base_rate = 0;
+    for (int threads = 1; threads <= 64; threads *= 2) {
+        atomic<bool> go{false};
+        atomic<int> ready{0};
+        vector<thread> workers;
+
+        for (int t = 0; t < threads; t++) {
+            workers.emplace_back([&, t]() {
+                mt19937 rng(100 + t);
+                uniform_int_distribution<int> dist(0, 2 * num_keys);
+
+                ready++;
+                while (!go.load(memory_order_acquire))
+                    this_thread::yield();
+
+                int found = 0;
+                for (int i = 0; i < lookups_per_thread; i++)
+                    found += shared.contains(dist(rng));
+
+                do_not_optimize(found);
+            });
+        }
+
+        while (ready.load() < threads)
+            this_thread::yield();
+
+        auto start = bench_clock::now();
+        go.store(true, memory_order_release);
+        for (thread &w : workers)
+            w.join();
+        double elapsed = seconds_since(start);
+
+        double rate = (double) threads * lookups_per_thread / elapsed / 1e6;
+        if (threads == 1)
+            base_rate = rate;
+
+        cout << setw(8) << threads << setw(14) << fixed << setprecision(2)
+             << rate << setw(11) << rate / base_rate << "x\n";
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * LAZY DELETION
+ *
+ * A churn workload that repeatedly deletes a random member and adds a new
+ * value, comparing eager deletion against lazy deletion at several compaction
+ * thresholds.  Lazy-mode timings include the amortized compaction passes.
+ */
+
+
+/*!
+ * Runs the churn workload against s, which must already contain the values in
+ * members, and returns the number of seconds taken.
+ */
+double run_churn(TreeSet<int> &s, vector<int> members, int ops, unsigned seed) {
+    mt19937 rng(seed);
+    uniform_int_distribution<int> value_dist;
+
+    auto start = bench_clock::now();
+
+    for (int i = 0; i < ops; i++) {
+        size_t victim = rng() % members.size();
+        s.del(members[victim]);
+
+        int value = value_dist(rng);
+        while (!s.add(value))
+            value = value_dist(rng);
+
+        members[victim] = value;
+    }
+
+    return seconds_since(start);
+}
+
+
+void bench_lazy_delete() {
+    const int num_keys = 1 << 16;
+    const int ops = 1 << 16;
+
+    mt19937 rng(2);
+    uniform_int_distribution<int> value_dist;
+    vector<int> members;
+    TreeSet<int> initial;
+    while (initial.size() < num_keys) {
+        int value = value_dist(rng);
+        if (initial.add(value))
+            members.push_back(value);
+    }
+
+    cout << "Churn: del+add pairs on a " << num_keys << "-key TreeSet<int>\n";
+    cout << setw(22) << "mode" << setw(14) << "ns/pair" << '\n';
+
+    {
+        TreeSet<int> s{initial};
+        double elapsed = run_churn(s, members, ops, 3);
+        cout << setw(22) << "eager" << setw(14) << fixed << setprecision(1)
+             << elapsed / ops * 1e9 << '\n';
+    }
+
+    for (double fraction : {0.1, 0.25, 0.5}) {
+        TreeSet<int> s{initial};
+        s.set_lazy_delete(true, fraction);
+        double elapsed = run_churn(s, members, ops, 3);
+
+        ostringstream mode;
+        mode << "lazy (compact @ " << fraction << ")";
+        cout << setw(22) << mode.str() << setw(14) << fixed << setprecision(1)
+             << elapsed / ops * 1e9 << '\n';
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * WRITE BUFFER
+ *
+ * Sustained random inserts into a plain TreeSet versus a BufferedTreeSet at
+ * several buffer capacities, followed by random lookups to show what the
+ * buffer costs on the read side.
+ */
+
+
+/*!
+ * Inserts keys into s and then probes it with lookups, printing ns/insert and
+ * ns/lookup for the given configuration name.
+ */
+template <typename Set>
+void run_write_buffer(const char *name, Set &s, const vector<int> &keys,
+                      const vector<int> &probes) {
+    auto start = bench_clock::now();
+    for (int k : keys)
+        s.add(k);
+    double insert_time = seconds_since(start);
+
+    // Leave a partly filled buffer behind so lookups have to consult it.
+    for (int i = 0; i < 100; i++)
+        s.add(2 * (int) keys.size() + 2 * i);
+
+    start = bench_clock::now();
+    int found = 0;
+    for (int k : probes)
+        found += s.contains(k);
+    double lookup_time = seconds_since(start);
+
+    do_not_optimize(found);
+
+    cout << setw(18) << name << setw(14) << fixed << setprecision(1)
+         << insert_time / keys.size() * 1e9 << setw(14)
+         << lookup_time / probes.size() * 1e9 << '\n';
+}
+
+
+void bench_write_buffer() {
+    const int num_keys = 1 << 18;
+
+    vector<int> keys = make_random_keys(num_keys, 4);
+    vector<int> probes = make_random_keys(num_keys, 5);
+    for (int &p : probes)
+        p += p % 4;                     // Half of the probes miss
+
+    cout << "Write buffer: " << num_keys << " random inserts, then "
+         << num_keys << " lookups\n";
+    cout << setw(18) << "configuration" << setw(14) << "ns/insert"
+         << setw(14) << "ns/lookup" << '\n';
+
+    {
+        TreeSet<int> s;
+        run_write_buffer("unbuffered", s, keys, probes);
+    }
+
+    for (size_t capacity : {64, 256, 1024, 4096}) {
+        BufferedTreeSet<int> s(capacity);
+        string name = "buffer " + to_string(capacity);
+        run_write_buffer(name.c_str(), s, keys, probes);
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * WRITE BATCHES
+ *
+ * Mixed batches of adds and deletes applied to a large TreeSet one at a time
+ * versus all at once through a WriteBatch.
+ */
+
+
+void bench_write_batch() {
+    const int num_keys = 1 << 18;
+    const int total_ops = 1 << 18;
+
+    TreeSet<int> initial;
+    for (int k : make_random_keys(num_keys, 6))
+        initial.add(k);
+
+    cout << "Write batches: " << total_ops << " mixed ops on a " << num_keys
+         << "-key TreeSet<int>\n";
+    cout << setw(12) << "batch size" << setw(16) << "one-at-a-time"
+         << setw(14) << "WriteBatch" << "   (ns/op)\n";
+
+    for (int batch_size : {16, 256, 4096}) {
+        mt19937 rng(7);
+        uniform_int_distribution<int> value_dist(0, 4 * num_keys);
+        vector<pair<int, bool>> ops;
+        for (int i = 0; i < total_ops; i++)
+            ops.emplace_back(value_dist(rng), rng() % 2 == 0);
+
+        TreeSet<int> sequential{initial};
+        auto start = bench_clock::now();
+        for (const auto &op : ops) {
+            if (op.second)
+                sequential.add(op.first);
+            else
+                sequential.del(op.first);
+        }
+        double sequential_time = seconds_since(start);
+
+        TreeSet<int> batched{initial};
+        start = bench_clock::now();
+        for (int i = 0; i < total_ops; i += batch_size) {
+            TreeSet<int>::WriteBatch batch;
+            for (int j = i; j < i + batch_size; j++) {
+                if (ops[j].second)
+                    batch.add(ops[j].first);
+                else
+                    batch.del(ops[j].first);
+            }
+            batched.apply(batch);
+        }
+        double batched_time = seconds_since(start);
+
+        cout << setw(12) << batch_size << setw(16) << fixed << setprecision(1)
+             << sequential_time / total_ops * 1e9 << setw(14)
+             << batched_time / total_ops * 1e9 << '\n';
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * SCANS
+ *
+ * Summing every value of a large TreeSet by stepping an iterator one value at
+ * a time, versus copying runs of values into a buffer with next_batch() and
+ * copy_range() and summing each buffer in a tight (vectorizable) loop.
+ */
+
+
+/*! Sums a buffer of values; kept separate so it compiles to a simple loop. */
+long sum_values(const int *values, size_t n) {
+    long sum = 0;
+    for (size_t i = 0; i < n; i++)
+        sum += values[i];
+    return sum;
+}
+
+
+void bench_scan() {
+    const int num_keys = 1 << 20;
+    const int passes = 8;
+
+    TreeSet<int> s;
+    for (int k : make_random_keys(num_keys, 8))
+        s.add(k);
+
+    cout << "Scans: " << passes << " passes over a " << num_keys
+         << "-key TreeSet<int>\n";
+    cout << setw(16) << "method" << setw(12) << "ns/value" << '\n';
+
+    auto report = [](const char *method, double elapsed) {
+        cout << setw(16) << method << setw(12) << fixed << setprecision(2)
+             << elapsed / ((double) passes * num_keys) * 1e9 << '\n';
+    };
+
+    long sum = 0;
+    auto start = bench_clock::now();
+    for (int p = 0; p < passes; p++) {
+        for (auto it = s.begin(); it != s.end(); ++it)
+            sum += *it;
+    }
+    report("operator++", seconds_since(start));
+    do_not_optimize(sum);
+
+    for (size_t batch_size : {16, 256}) {
+        vector<int> buffer(batch_size);
+        string method = "next_batch " + to_string(batch_size);
+
+        sum = 0;
+        start = bench_clock::now();
+        for (int p = 0; p < passes; p++) {
+            auto it = s.begin();
+            size_t n;
+            while ((n = it.next_batch(buffer)) > 0)
+                sum += sum_values(buffer.data(), n);
+        }
+        report(method.c_str(), seconds_since(start));
+        do_not_optimize(sum);
+    }
+
+    // Ranges of about 256 values each, as a range query would ask for them
+    vector<int> buffer(256);
+    sum = 0;
+    start = bench_clock::now();
+    for (int p = 0; p < passes; p++) {
+        for (int lo = 0; lo < 2 * num_keys; lo += 512) {
+            size_t n = s.copy_range(lo, lo + 512, buffer);
+            sum += sum_values(buffer.data(), n);
+        }
+    }
+    report("copy_range 256", seconds_since(start));
+    do_not_optimize(sum);
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * HASH-CONSED VARIANTS
+ *
+ * Many near-duplicate sets (variants of one base set, each with a few values
+ * changed), held as independent TreeSets versus as HashConsTreeSets that share
+ * their identical subtrees.  Reports the nodes kept alive and the time to
+ * build the variants and compare every one of them with the base.
+ */
+
+
+void bench_hashcons() {
+    const int num_keys = 1 << 14;
+    const int num_variants = 1000;
+    const int edits = 4;
+
+    vector<int> keys = make_random_keys(num_keys, 13);
+    TreeSet<int> base;
+    for (int k : keys)
+        base.add(k);
+
+    cout << "Hash-consing: " << num_variants << " variants of a " << num_keys
+         << "-key set, " << edits << " edits each\n";
+    cout << setw(12) << "sets" << setw(14) << "nodes" << setw(12) << "build ms"
+         << setw(14) << "compare ms" << '\n';
+
+    auto report = [](const char *name, long nodes, double build,
+                     double compare) {
+        cout << setw(12) << name << setw(14) << nodes << setw(12) << fixed
+             << setprecision(1) << build * 1e3 << setw(14) << compare * 1e3
+             << '\n';
+    };
+
+    // Each variant deletes a few base values and adds a few new ones
+    auto edit = [&](auto &set, int variant) {
+        for (int e = 0; e < edits; e++) {
+            set.del(keys[(variant * edits + e) % num_keys]);
+            set.add(2 * num_keys + variant * edits + e);
+        }
+    };
+
+    int equal = 0;
+    {
+        auto start = bench_clock::now();
+        vector<TreeSet<int>> variants(num_variants, base);
+        for (int i = 0; i < num_variants; i++)
+            edit(variants[i], i);
+        double build = seconds_since(start);
+
+        start = bench_clock::now();
+        for (const TreeSet<int> &v : variants)
+            equal += (v == base);
+        report("TreeSet", (long) num_variants * num_keys, build,
+               seconds_since(start));
+    }
+    {
+        auto start = bench_clock::now();
+        HashConsTreeSet<int> hc_base(base);
+        vector<HashConsTreeSet<int>> variants(num_variants, hc_base);
+        for (int i = 0; i < num_variants; i++)
+            edit(variants[i], i);
+        double build = seconds_since(start);
+
+        start = bench_clock::now();
+        for (const HashConsTreeSet<int> &v : variants)
+            equal += (v == hc_base);
+        report("hash-consed", HashConsTreeSet<int>::distinct_nodes(), build,
+               seconds_since(start));
+    }
+    do_not_optimize(equal);
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * VALUE SIZES
+ *
+ * Lookups in sets of records of several sizes, ordered by a small key at the
+ * front of each record, with the records stored in the tree nodes, out of
+ * line, and out of line with the key kept as a prefix in the nodes.
+ */
+
+
+enum value_layout { INLINE, OUT_OF_LINE, OUT_OF_LINE_PREFIX };
+
+const char *layout_names[] = {"inline", "out-of-line", "+key prefix"};
+
+
+/*! A record of Size bytes whose order is given by its key alone. */
+template <size_t Size, value_layout Layout>
+struct sized_record {
+    int key;
+    char payload[Size - sizeof(int)];
+
+    sized_record(int key = 0) : key(key) { }
+
+    bool operator<(const sized_record &rhs) const { return key < rhs.key; }
+};
+
+template <size_t Size, value_layout Layout>
+struct treeset_value_layout<sized_record<Size, Layout>> {
+    static constexpr bool out_of_line = Layout != INLINE;
+};
+
+template <size_t Size>
+struct treeset_key_prefix<sized_record<Size, OUT_OF_LINE_PREFIX>,
+                          std::less<sized_record<Size, OUT_OF_LINE_PREFIX>>> {
+    static int of(const sized_record<Size, OUT_OF_LINE_PREFIX> &r) {
+        return r.key;
+    }
+};
+
+
+/*! Returns the ns per lookup in a set of records of the given type. */
+template <typename Record>
+double time_record_lookups(const vector<int> &keys, const vector<int> &probes) {
+    TreeSet<Record> s;
+    for (int k : keys)
+        s.add(Record(k));
+
+    int found = 0;
+    auto start = bench_clock::now();
+    for (int p : probes)
+        found += s.contains(Record(p));
+    double elapsed = seconds_since(start);
+
+    do_not_optimize(found);
+    return elapsed / probes.size() * 1e9;
+}
+
+
+template <size_t Size>
+void bench_record_size(const vector<int> &keys, const vector<int> &probes) {
+    cout << setw(10) << Size << fixed << setprecision(1)
+         << setw(12) << time_record_lookups<sized_record<Size, INLINE>>(
+                keys, probes)
+         << setw(14) << time_record_lookups<sized_record<Size, OUT_OF_LINE>>(
+                keys, probes)
+         << setw(14)
+         << time_record_lookups<sized_record<Size, OUT_OF_LINE_PREFIX>>(
+                keys, probes)
+         << '\n';
+}
+
+
+void bench_value_sizes() {
+    const int num_keys = 1 << 17;
+
+    vector<int> keys = make_random_keys(num_keys, 14);
+    vector<int> probes = make_random_keys(num_keys, 15);
+
+    cout << "Value sizes: lookups in a " << num_keys
+         << "-key TreeSet of records (ns/op)\n";
+    cout << setw(10) << "bytes";
+    cout << setw(12) << layout_names[INLINE] << setw(14)
+         << layout_names[OUT_OF_LINE] << setw(14)
+         << layout_names[OUT_OF_LINE_PREFIX] << '\n';
+
+    bench_record_size<16>(keys, probes);
+    bench_record_size<64>(keys, probes);
+    bench_record_size<256>(keys, probes);
+    bench_record_size<1024>(keys, probes);
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * NODE LAYOUT
+ *
+ * TreeSet's nodes (key and links together, reached through pointers) against
+ * SoATreeSet's separate key and 32-bit link arrays, on int and double keys.
+ */
+
+
+/*! Times adds, lookups (half of them misses) and a full scan of one set type,
+ * and prints the ns per operation of each. */
+template <typename Set, typename T>
+void time_layout(const char *name, const vector<int> &keys,
+                 const vector<int> &probes) {
+    Set s;
+    double found = 0;
+
+    auto start = bench_clock::now();
+    for (int k : keys)
+        s.add((T) k);
+    double add = seconds_since(start);
+
+    start = bench_clock::now();
+    for (int p : probes)
+        found += s.contains((T) p);
+    double lookup = seconds_since(start);
+
+    start = bench_clock::now();
+    for (auto it = s.begin(); it != s.end(); ++it)
+        found += *it;
+    double scan = seconds_since(start);
+
+    do_not_optimize(found);
+    cout << setw(20) << name << fixed << setprecision(1)
+         << setw(10) << add / keys.size() * 1e9
+         << setw(10) << lookup / probes.size() * 1e9
+         << setw(10) << scan / keys.size() * 1e9 << '\n';
+}
+
+
+void bench_node_layout() {
+    const int num_keys = 1 << 20;
+
+    vector<int> keys = make_random_keys(num_keys, 16);
+    vector<int> probes = make_random_keys(num_keys, 17);
+    for (int &p : probes)
+        p += p % 4;                     // Half of the probes miss
+
+    cout << "Node layout: " << num_keys << " keys (ns/op)\n";
+    cout << setw(20) << "set" << setw(10) << "add" << setw(10) << "contains"
+         << setw(10) << "iterate" << '\n';
+
+    time_layout<TreeSet<int>, int>("TreeSet<int>", keys, probes);
+    time_layout<SoATreeSet<int>, int>("SoATreeSet<int>", keys, probes);
+    time_layout<TreeSet<double>, double>("TreeSet<double>", keys, probes);
+    time_layout<SoATreeSet<double>, double>("SoATreeSet<double>", keys, probes);
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * CHUNKED SERIALIZATION
+ *
+ * Encoding a large TreeSet<int> to the chunked format and decoding it back,
+ * in memory, with increasing numbers of threads.  Throughput is in MB/s of
+ * encoded data.
+ */
+
+
+void bench_serialize() {
+    const int num_keys = 1 << 22;
+
+    using codec = ChunkedTreeSetCodec<int>;
+    TreeSet<int> s;
+    for (int k : make_random_keys(num_keys, 18))
+        s.add(k);
+
+    cout << "Chunked serialization: " << num_keys << "-key TreeSet<int> ("
+         << thread::hardware_concurrency() << " hardware threads)\n";
+    cout << setw(8) << "threads" << setw(14) << "encode MB/s" << setw(14)
+         << "decode MB/s" << '\n';
+
+    for (int threads = 1; threads <= 16; threads *= 2) {
+        auto start = bench_clock::now();
+        vector<char> data = codec::encode(s, threads);
+        double encode = seconds_since(start);
+
+        TreeSet<int> t;
+        start = bench_clock::now();
+        bool ok = codec::decode(data.data(), data.size(), t, threads);
+        double decode = seconds_since(start);
+
+        if (!ok || t.size() != s.size()) {
+            cerr << "decode failed with " << threads << " threads\n";
+            return;
+        }
+
+        double mb = data.size() / 1e6;
+        cout << setw(8) << threads << fixed << setprecision(1)
+             << setw(14) << mb / encode << setw(14) << mb / decode << '\n';
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * SET REUSE
+ *
+ * Filling a set batch after batch: a new TreeSet for every batch, which
+ * allocates every node afresh, against one set emptied with clear(), which
+ * keeps the nodes' memory in its pool for the next batch.
+ */
+
+
+void bench_reuse() {
+    const int batch_keys = 1 << 14;
+    const int batches = 64;
+
+    vector<vector<int>> keys;
+    for (int b = 0; b < batches; b++)
+        keys.push_back(make_random_keys(batch_keys, 100 + b));
+
+    cout << "Set reuse: " << batches << " batches of " << batch_keys
+         << " adds into a TreeSet<int>\n";
+    cout << setw(16) << "set per batch" << setw(12) << "ns/add" << setw(14)
+         << "allocs/add" << '\n';
+
+    auto run = [&](const char *name, bool reuse, bool reserve) {
+        TreeSet<int> reused;
+        long found = 0;
+        AllocCounter counter;
+        auto start = bench_clock::now();
+        for (const vector<int> &batch : keys) {
+            TreeSet<int> fresh;
+            TreeSet<int> &s = reuse ? reused : fresh;
+            s.clear();
+            if (reserve)
+                s.reserve(batch_keys);
+
+            for (int k : batch)
+                s.add(k);
+            found += s.size();
+        }
+        double elapsed = seconds_since(start);
+        AllocStats delta = counter.delta();
+        do_not_optimize(found);
+
+        long adds = (long) batches * batch_keys;
+        cout << setw(16) << name << setw(12) << fixed << setprecision(1)
+             << elapsed / adds * 1e9 << setw(14) << setprecision(3)
+             << (double) delta.allocs / adds << '\n';
+    };
+
+    run("new", false, false);
+    run("clear()", true, false);
+    run("clear+reserve", true, true);
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * ADAPTIVE REPRESENTATION
+ *
+ * AdaptiveTreeSet against each fixed representation on the workloads it
+ * switches for: many tiny sets, a mid-sized set under mixed reads and writes,
+ * and a large set that is only read.  TreeSetView (binary search over a
+ * sorted array) stands in for a fixed flat layout where the set is read-only.
+ */
+
+
+/*! Fills many tiny sets and probes each one; returns ns per operation. */
+template <typename Set>
+double time_tiny_sets(const vector<vector<int>> &batches) {
+    long found = 0, ops = 0;
+    auto start = bench_clock::now();
+    for (const vector<int> &keys : batches) {
+        Set s;
+        for (int k : keys)
+            s.add(k);
+        for (int p = 0; p < 4 * (int) keys.size(); p++)
+            found += s.contains(p * 7 % 64);
+        ops += 5 * keys.size();
+    }
+    double elapsed = seconds_since(start);
+    do_not_optimize(found);
+    return elapsed / ops * 1e9;
+}
+
+
+/*! Runs a mix of half lookups, a quarter adds and a quarter deletes;
+ * returns ns per operation. */
+template <typename Set>
+double time_mixed(const vector<int> &keys, const vector<int> &ops) {
+    Set s;
+    for (int k : keys)
+        s.add(k);
+
+    long found = 0;
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < ops.size(); i++) {
+        if (i % 4 == 1)
+            found += s.add(ops[i]);
+        else if (i % 4 == 3)
+            found += s.del(ops[i]);
+        else
+            found += s.contains(ops[i]);
+    }
+    double elapsed = seconds_since(start);
+    do_not_optimize(found);
+    return elapsed / ops.size() * 1e9;
+}
+
+
+/*! Builds a set, then only reads it; returns ns per lookup. */
+template <typename Set>
+double time_read_only(const Set &s, const vector<int> &probes) {
+    long found = 0;
+    auto start = bench_clock::now();
+    for (int p : probes)
+        found += s.contains(p);
+    double elapsed = seconds_since(start);
+    do_not_optimize(found);
+    return elapsed / probes.size() * 1e9;
+}
+
+
+void bench_adaptive() {
+    const int tiny_sets = 1 << 14, tiny_keys = 16;
+    const int mixed_keys = 1 << 16, mixed_ops = 1 << 21;
+    const int read_keys = 1 << 20, read_probes = 1 << 21;
+
+    vector<vector<int>> batches;
+    for (int b = 0; b < tiny_sets; b++) {
+        vector<int> keys = make_random_keys(tiny_keys, 200 + b);
+        for (int &k : keys)
+            k = k * 2 % 64;
+        batches.push_back(keys);
+    }
+
+    vector<int> mixed = make_random_keys(mixed_keys, 19);
+    vector<int> ops = make_random_keys(mixed_ops, 20);
+    for (int &op : ops)
+        op %= 4 * mixed_keys;           // Keeps the set near its first size
+
+    vector<int> read = make_random_keys(read_keys, 21);
+    vector<int> probes = make_random_keys(read_probes, 22);
+    for (int &p : probes)
+        p %= 4 * read_keys;             // Half of the probes miss
+
+    cout << "Adaptive representation (ns/op)\n";
+    cout << setw(26) << "workload" << setw(10) << "TreeSet" << setw(10)
+         << "flat" << setw(10) << "adaptive" << '\n';
+
+    cout << setw(26) << "16-key sets, 4 reads/add" << fixed << setprecision(1)
+         << setw(10) << time_tiny_sets<TreeSet<int>>(batches)
+         << setw(10) << "n/a"
+         << setw(10) << time_tiny_sets<AdaptiveTreeSet<int>>(batches) << '\n';
+
+    cout << setw(26) << "64K keys, 1 read/write"
+         << setw(10) << time_mixed<TreeSet<int>>(mixed, ops)
+         << setw(10) << "n/a"
+         << setw(10) << time_mixed<AdaptiveTreeSet<int>>(mixed, ops) << '\n';
+
+    TreeSet<int> tree;
+    AdaptiveTreeSet<int> adaptive;
+    for (int k : read) {
+        tree.add(k);
+        adaptive.add(k);
+    }
+    vector<int> sorted = read;
+    sort(sorted.begin(), sorted.end());
+    TreeSetView<int> view{sorted};
+
+    cout << setw(26) << "1M keys, read-only"
+         << setw(10) << time_read_only(tree, probes)
+         << setw(10) << time_read_only(view, probes)
+         << setw(10) << time_read_only(adaptive, probes) << '\n';
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * SIMILARITY JOIN
+ *
+ * Finding every pair of similar sets in a large collection with
+ * TreeSetSimilarityJoin, against calling intersect() on every pair (timed on
+ * a sample and scaled up to the whole collection).
+ */
+
+
+void bench_simjoin() {
+    const int families = 5000, copies = 4;
+    const int universe = 1 << 20, sample = 1000;
+    const double threshold = 0.8;
+
+    // Near-duplicates of base sets of 10 to 100 values, with common values
+    // much more common than rare ones
+    mt19937 rng(23);
+    auto random_value = [&]() {
+        return (int) (rng() % (rng() % universe + 1));
+    };
+
+    vector<TreeSet<int>> sets;
+    for (int f = 0; f < families; f++) {
+        TreeSet<int> base;
+        int size = 10 + (int) (rng() % 91);
+        while (base.size() < size)
+            base.add(random_value());
+
+        for (int c = 0; c < copies; c++) {
+            TreeSet<int> s = base;
+            for (int change = 0; change < size / 20; change++) {
+                s.del(random_value());
+                s.add(random_value());
+            }
+            sets.push_back(s);
+        }
+    }
+    shuffle(sets.begin(), sets.end(), rng);
+
+    cout << "Similarity join: " << sets.size()
+         << " sets of 10-100 values, Jaccard >= " << threshold << " ("
+         << thread::hardware_concurrency() << " hardware threads)\n";
+
+    auto start = bench_clock::now();
+    long found = 0;
+    for (int a = 0; a < sample; a++) {
+        for (int b = a + 1; b < sample; b++) {
+            int shared = sets[a].intersect(sets[b]).size();
+            found += shared >= threshold *
+                (sets[a].size() + sets[b].size() - shared);
+        }
+    }
+    double sample_pairs = (double) sample * (sample - 1) / 2;
+    double all_pairs = (double) sets.size() * (sets.size() - 1) / 2;
+    double brute = seconds_since(start) / sample_pairs * all_pairs;
+    do_not_optimize(found);
+
+    cout << setw(20) << "method" << setw(12) << "seconds" << setw(10)
+         << "pairs" << '\n';
+    cout << setw(20) << "intersect (est.)" << setw(12) << fixed
+         << setprecision(2) << brute << setw(10) << "-" << '\n';
+
+    for (int threads = 1; threads <= 8; threads *= 2) {
+        start = bench_clock::now();
+        vector<treeset_similar_pair> pairs =
+            TreeSetSimilarityJoin<int>::join(sets, threshold, threads);
+        double elapsed = seconds_since(start);
+
+        ostringstream name;
+        name << "join, " << threads << " thread" << (threads > 1 ? "s" : "");
+        cout << setw(20) << name.str() << setw(12) << elapsed << setw(10)
+             << pairs.size() << '\n';
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * QUANTILE SKETCH
+ *
+ * What the optional quantile sketch costs adds and deletes on a large
+ * TreeSet<int>, how fast it answers, and how far its ranks are from the
+ * exact ones, before and after deleting half of the values.
+ */
+
+
+void bench_quantiles() {
+    const int num_keys = 1 << 20;
+
+    vector<int> keys = make_random_keys(num_keys, 24);
+    vector<int> sorted = keys;
+    sort(sorted.begin(), sorted.end());
+
+    // Worst rank error over 1000 evenly spaced probes, as a fraction of size
+    auto worst_error = [](const TreeSet<int> &s, const vector<int> &values) {
+        double worst = 0;
+        for (int i = 0; i < 1000; i++) {
+            int x = values[(size_t) i * values.size() / 1000];
+            int exact = (int) (lower_bound(values.begin(), values.end(), x) -
+                               values.begin());
+            worst = max(worst, (double) abs(s.approx_rank(x) - exact));
+        }
+        return worst / values.size();
+    };
+
+    cout << "Quantile sketch: " << num_keys << "-key TreeSet<int>\n";
+    cout << setw(10) << "sketch" << setw(10) << "ns/add" << setw(10)
+         << "ns/del" << setw(12) << "us/rank" << setw(14) << "us/quantile"
+         << setw(12) << "max error" << setw(16) << "after deletes" << '\n';
+
+    for (bool sketch : {false, true}) {
+        TreeSet<int> s;
+        if (sketch)
+            s.enable_sketch();
+
+        auto start = bench_clock::now();
+        for (int k : keys)
+            s.add(k);
+        double add = seconds_since(start) / num_keys * 1e9;
+
+        double rank = 0, quantile = 0, error = 0;
+        long found = 0;
+        if (sketch) {
+            start = bench_clock::now();
+            for (int i = 0; i < 1000; i++)
+                found += s.approx_rank(i * 2000);
+            rank = seconds_since(start) / 1000 * 1e6;
+
+            start = bench_clock::now();
+            for (int i = 0; i < 1000; i++)
+                found += s.approx_quantile(i / 1000.0);
+            quantile = seconds_since(start) / 1000 * 1e6;
+
+            error = worst_error(s, sorted);
+        }
+
+        // Delete the lower half, skewing the values that are left
+        start = bench_clock::now();
+        for (int i = 0; i < num_keys / 2; i++)
+            s.del(sorted[i]);
+        double del = seconds_since(start) / (num_keys / 2) * 1e9;
+        do_not_optimize(found);
+
+        cout << setw(10) << (sketch ? "on" : "off") << fixed << setprecision(1)
+             << setw(10) << add << setw(10) << del;
+        if (sketch) {
+            vector<int> left(sorted.begin() + num_keys / 2, sorted.end());
+            cout << setw(12) << rank << setw(14) << quantile << setprecision(3)
+                 << setw(11) << error * 100 << '%' << setw(15)
+                 << worst_error(s, left) * 100 << '%' << '\n';
+        } else {
+            cout << setw(12) << "-" << setw(14) << "-" << setw(12) << "-"
+                 << setw(16) << "-" << '\n';
+        }
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * STRING KEY PREFIXES
+ *
+ * TreeSet<string> compares the 8-byte key prefixes kept in its nodes before
+ * the strings themselves.  It is timed against the same set with an ordinary
+ * comparator (which has no prefix) on random strings, where the prefixes
+ * decide almost every comparison, and on strings that all share a long stem,
+ * where they decide none.
+ */
+
+
+//! Orders strings as std::less does, but without TreeSet's string key prefix
+struct plain_string_less {
+    bool operator()(const string &a, const string &b) const { return a < b; }
+};
+
+
+/*! Times adds and lookups of keys then probes, printing ns per operation. */
+template <typename Set>
+void time_string_set(const char *name, const vector<string> &keys,
+                     const vector<string> &probes) {
+    Set s;
+    long found = 0;
+
+    auto start = bench_clock::now();
+    for (const string &k : keys)
+        s.add(k);
+    double add = seconds_since(start);
+
+    start = bench_clock::now();
+    for (const string &p : probes)
+        found += s.contains(p);
+    double lookup = seconds_since(start);
+
+    do_not_optimize(found);
+    cout << setw(12) << name << fixed << setprecision(1)
+         << setw(10) << add / keys.size() * 1e9
+         << setw(10) << lookup / probes.size() * 1e9 << '\n';
+}
+
+
+void bench_string_keys() {
+    const int num_keys = 1 << 18;
+
+    mt19937 rng(25);
+    auto random_key = [&]() {
+        string s(24, ' ');
+        for (char &c : s)
+            c = (char) ('a' + rng() % 26);
+        return s;
+    };
+    auto stem_key = [&]() {
+        return "customer/account/" + to_string(10000000 + rng() % 90000000);
+    };
+
+    cout << "String key prefixes: " << num_keys << " 24-25 byte keys (ns/op)\n";
+
+    for (bool shared : {false, true}) {
+        vector<string> keys, probes;
+        for (int i = 0; i < num_keys; i++)
+            keys.push_back(shared ? stem_key() : random_key());
+        for (int i = 0; i < num_keys; i++)      // Half of the probes miss
+            probes.push_back(i % 2 ? keys[rng() % num_keys]
+                                   : shared ? stem_key() : random_key());
+
+        cout << (shared ? "shared 17-byte stem\n" : "random\n");
+        cout << setw(12) << "comparator" << setw(10) << "add" << setw(10)
+             << "contains" << '\n';
+        time_string_set<TreeSet<string, plain_string_less>>("plain", keys,
+                                                            probes);
+        time_string_set<TreeSet<string>>("prefixed", keys, probes);
+    }
+
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * OPERATION COUNTERS
+ *
+ * Each basic TreeSet operation in its own measured phase, with hardware
+ * counters per operation, to show whether it is bound by cache misses, TLB
+ * misses or branch mispredictions.
+ */
+
+
+void bench_op_counters() {
+    const int num_keys = 1 << 18;
+    const int algebra_keys = 1 << 12;
+
+    PerfCounters counters;
+    vector<int> keys = make_random_keys(num_keys, 8);
+    vector<int> probes = make_random_keys(num_keys, 9);
+    for (int &p : probes)
+        p += p % 4;                     // Half of the probes miss
+
+    cout << "Operation counters: " << num_keys << "-key TreeSet<int>, "
+         << algebra_keys << "-key sets for set algebra\n";
+    print_phase_header(counters);
+
+    TreeSet<int> s;
+    int found = 0;
+
+    measure_phase(counters, "add", num_keys, [&]() {
+        for (int k : keys)
+            s.add(k);
+    });
+
+    measure_phase(counters, "contains", num_keys, [&]() {
+        for (int k : probes)
+            found += s.contains(k);
+    });
+
+    measure_phase(counters, "iterate", num_keys, [&]() {
+        for (auto it = s.begin(); it != s.end(); ++it)
+            found += *it;
+    });
+
+    measure_phase(counters, "del", algebra_keys, [&]() {
+        for (int i = 0; i < algebra_keys; i++)
+            s.del(keys[i]);
+    });
+
+    // Two overlapping sets for the set-algebra phases; ops counts n + m.
+    TreeSet<int> a, b;
+    for (int k : make_random_keys(algebra_keys, 10))
+        a.add(k);
+    for (int k : make_random_keys(algebra_keys, 11))
+        b.add(k + algebra_keys);
+
+    measure_phase(counters, "plus", 2 * algebra_keys, [&]() {
+        found += a.plus(b).size();
+    });
+
+    measure_phase(counters, "intersect", 2 * algebra_keys, [&]() {
+        found += a.intersect(b).size();
+    });
+
+    measure_phase(counters, "minus", 2 * algebra_keys, [&]() {
+        found += a.minus(b).size();
+    });
+
+    const TreeSet<int> a_copy{a};
+    measure_phase(counters, "equals", 2 * algebra_keys, [&]() {
+        found += (a == a_copy);
+    });
+
+    do_not_optimize(found);
+    cout << '\n';
+}
+
+
+/*===========================================================================
+ * ALLOCATIONS
+ *
+ * Heap allocations and bytes requested per operation, counted by the
+ * replacement operator new in allocstats.cpp.
+ */
+
+
+/*! Runs fn and prints the allocations and bytes it made per operation. */
+template <typename Fn>
+void measure_allocs(const char *phase, long ops, Fn fn) {
+    AllocCounter counter;
+    fn();
+    AllocStats delta = counter.delta();
+
+    cout << setw(14) << phase << setw(12) << fixed << setprecision(3)
+         << (double) delta.allocs / ops << setw(12) << setprecision(1)
+         << (double) delta.bytes / ops << '\n';
+}
+
+
+void bench_allocs() {
+    const int num_keys = 1 << 14;
+
+    vector<int> keys = make_random_keys(num_keys, 12);
+
+    cout << "Allocations: " << num_keys << "-key TreeSet<int>\n";
+    cout << setw(14) << "operation" << setw(12) << "allocs/op"
+         << setw(12) << "bytes/op" << '\n';
+
+    TreeSet<int> s, t;
+    int found = 0;
+
+    measure_allocs("add", num_keys, [&]() {
+        for (int k : keys)
+            s.add(k);
+    });
+
+    for (int i = 0; i < num_keys; i += 2)
+        t.add(keys[i] + (i % 4 == 0));  // Half of t overlaps s
+
+    measure_allocs("contains", num_keys, [&]() {
+        for (int k : keys)
+            found += s.contains(k + 1);
+    });
+
+    measure_allocs("begin", 1, [&]() {
+        found += *s.begin();
+    });
+
+    measure_allocs("iterate", num_keys, [&]() {
+        for (auto it = s.begin(); it != s.end(); ++it)
+            found += *it;
+    });
+
+    measure_allocs("copy", num_keys, [&]() {
+        TreeSet<int> copy{s};
+        found += copy.size();
+    });
+
+    const TreeSet<int> s_copy{s};
+    measure_allocs("operator==", 2 * num_keys, [&]() {
+        found += (s == s_copy);
+    });
+
+    measure_allocs("plus", num_keys + t.size(), [&]() {
+        found += s.plus(t).size();
+    });
+
+    measure_allocs("intersect", num_keys + t.size(), [&]() {
+        found += s.intersect(t).size();
+    });
+
+    measure_allocs("minus", num_keys + t.size(), [&]() {
+        found += s.minus(t).size();
+    });
+
+    measure_allocs("WriteBatch", num_keys, [&]() {
+        TreeSet<int>::WriteBatch batch;
+        for (int k : keys)
+            batch.add(k + 1);
+        t.apply(batch);
+    });
+
+    measure_allocs("del", num_keys, [&]() {
+        for (int k : keys)
+            s.del(k);
+    });
+
+    do_not_optimize(found);
+    cout << '\n';
+}
+
+
+/*! This program runs performance benchmarks for the TreeSet class.  Pass the
+ * name of a benchmark to run only that one. */
+int main(int argc, char **argv) {
+    struct benchmark {
+        const char *name;
+        void (*fn)();
+    };
+
+    const benchmark benchmarks[] = {
+        {"ops", bench_op_counters},
+        {"allocs", bench_allocs},
+        {"read-scaling", bench_read_scaling},
+        {"lazy-delete", bench_lazy_delete},
+        {"write-buffer", bench_write_buffer},
+        {"write-batch", bench_write_batch},
+        {"scan", bench_scan},
+        {"hashcons", bench_hashcons},
+        {"value-sizes", bench_value_sizes},
+        {"node-layout", bench_node_layout},
+        {"serialize", bench_serialize},
+        {"reuse", bench_reuse},
+        {"adaptive", bench_adaptive},
+        {"simjoin", bench_simjoin},
+        {"quantiles", bench_quantiles},
+        {"string-keys", bench_string_keys},
+    };
+
+    bool ran = false;
+    for (const benchmark &b : benchmarks) {
+        if (argc < 2 || strcmp(argv[1], b.name) == 0) {
+            b.fn();
+            ran = true;
+        }
+    }
+
+    if (!ran) {
+        cerr << "usage: " << argv[0] << " [benchmark]\nbenchmarks:";
+        for (const benchmark &b : benchmarks)
+            cerr << ' ' << b.name;
+        cerr << endl;
+        return 1;
+    }
+
+    return 0;
+}
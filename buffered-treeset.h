@@ -0,0 +1,280 @@
+#ifndef BUFFERED_TREESET_HH
+#define BUFFERED_TREESET_HH
+
+#include "treeset.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <utility>
+#include <vector>
+
+/***************** Begin BufferedTreeSet declaration  ****************/
+
+template <typename T, typename Compare = std::less<T>>
+class BufferedTreeSetIter; //! Forward declaration of class BufferedTreeSetIter
+
+/*!
+BufferedTreeSet is a write-optimized front end for a TreeSet. Adds and deletes
+are absorbed into a small sorted buffer, and once the buffer fills up it is
+merged into the tree in a single pass, so a burst of writes costs one shared
+descent instead of one random root-to-leaf descent per write. Lookups and
+iteration consult the buffer and the tree together.
+
+Writes are "blind": unlike TreeSet::add() and TreeSet::del(), they do not
+report whether the set changed, since finding out would take the very tree
+descent the buffer exists to avoid. Operations that need the exact contents of
+the tree (size(), tree()) flush the buffer first.
+*/
+template <typename T, typename Compare = std::less<T>>
+class BufferedTreeSet {
+  //! The tree that buffered writes are eventually merged into.
+  TreeSet<T, Compare> _tree;
+
+  /*! Pending writes, sorted by value with at most one entry per value. Each
+    value is paired with true for an add or false for a del.
+  */
+  std::vector<std::pair<T, bool>> _buffer;
+
+  //! Number of pending writes that triggers a flush.
+  size_t _capacity;
+
+  //! Comparator used for the items in the set
+  Compare _cmp;
+
+  //! Returns the first buffered write whose value is not less than value.
+  std::vector<std::pair<T, bool>>::const_iterator
+  find_write(const T &value) const;
+
+  //! Records a pending write, replacing any earlier write of the same value.
+  void buffer_write(const T &value, bool is_add);
+
+public:
+  //! Provide "standard" name for iterator type
+  using iterator = BufferedTreeSetIter<T, Compare>;
+
+  //! Constructor initializes an empty set that buffers up to capacity writes.
+  BufferedTreeSet(size_t capacity = 256) : _capacity(capacity) { };
+
+  //! Returns an iterator to the first value in the set
+  BufferedTreeSetIter<T, Compare> begin() const;
+
+  //! Returns an iterator "past the end" of the set.
+  BufferedTreeSetIter<T, Compare> end() const;
+
+  //! Returns an iterator to the first value that is not less than value.
+  BufferedTreeSetIter<T, Compare> lower_bound(const T &value) const;
+
+  //! Adds value to the set (possibly deferred until the next flush).
+  void add(const T &value) { buffer_write(value, true); };
+
+  //! Removes value from the set (possibly deferred until the next flush).
+  void del(const T &value) { buffer_write(value, false); };
+
+  //! Returns whether the value appears in the set or not.
+  bool contains(const T &value) const;
+
+  //! Merges all pending writes into the tree.
+  void flush();
+
+  //! Returns the number of writes currently waiting in the buffer.
+  size_t buffered() const { return _buffer.size(); };
+
+  //! Returns the number of elements in the set. Flushes pending writes.
+  int size() {
+    flush();
+    return _tree.size();
+  };
+
+  //! Returns the underlying tree. Flushes pending writes.
+  const TreeSet<T, Compare>& tree() {
+    flush();
+    return _tree;
+  };
+};
+
+/***************** End BufferedTreeSet declaration  ****************/
+
+
+
+
+
+/*********** Begin BufferedTreeSetIter declaration & definition ***********/
+
+/*! BufferedTreeSetIter walks the tree and the write buffer side by side,
+  yielding values in sorted order. Buffered adds are merged into the sequence
+  and buffered deletes hide the matching tree value.
+*/
+template <typename T, typename Compare>
+class BufferedTreeSetIter {
+  using op = std::pair<T, bool>;
+
+  TreeSetIter<T, Compare> _tree_it;
+  const op *_buf_it = nullptr;
+  const op *_buf_end = nullptr;
+  Compare _cmp;
+
+  //! True if the current value comes from the tree, the buffer, or both
+  bool _from_tree = false;
+  bool _from_buf = false;
+
+  //! Skips deleted values and decides where the current value comes from.
+  void settle();
+
+public:
+  //! Default constructor creates an "end" iterator
+  BufferedTreeSetIter() { };
+
+  //! Constructor starts at the beginning of both the tree and the buffer
+  BufferedTreeSetIter(const TreeSetIter<T, Compare> &tree_it,
+                      const op *buf_begin, const op *buf_end)
+    : _tree_it(tree_it), _buf_it(buf_begin), _buf_end(buf_end) {
+    settle();
+  }
+
+  //! Pre-increment operator returns a ref to the iterator that was incremented.
+  BufferedTreeSetIter<T, Compare>& operator++();
+
+  //! Post-increment operator returns a copy of the iterator before incremented.
+  BufferedTreeSetIter<T, Compare> operator++(int);
+
+  //! Dereference returns the current value
+  const T& operator*() const {
+    return _from_buf ? _buf_it->first : *_tree_it;
+  };
+
+  //! Iterators are equal when both positions are exhausted or identical
+  bool operator==(const BufferedTreeSetIter<T, Compare> &rhs) const {
+    return _tree_it == rhs._tree_it && _buf_it == rhs._buf_it;
+  };
+
+  //! Inverse of ==
+  bool operator!=(const BufferedTreeSetIter<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+};
+
+template <typename T, typename Compare> inline
+void BufferedTreeSetIter<T, Compare>::settle() {
+  const TreeSetIter<T, Compare> tree_end;
+
+  while (true) {
+    _from_tree = _tree_it != tree_end;
+    _from_buf = _buf_it != _buf_end;
+
+    if (!_from_buf) {
+      _buf_it = _buf_end = nullptr; // so exhausted iterators compare equal
+      return;
+    }
+
+    if (_from_tree && _cmp(*_tree_it, _buf_it->first)) { // tree value first
+      _from_buf = false;
+      return;
+    }
+
+    // Buffer value comes first, or both hold the same value
+    _from_tree = _from_tree && !_cmp(_buf_it->first, *_tree_it);
+
+    if (_buf_it->second) // buffered add
+      return;
+
+    // buffered del hides the value, so skip it in both sequences
+    ++_buf_it;
+    if (_from_tree)
+      ++_tree_it;
+  }
+}
+
+template <typename T, typename Compare> inline
+BufferedTreeSetIter<T, Compare>& BufferedTreeSetIter<T, Compare>::operator++() {
+  if (_from_tree)
+    ++_tree_it;
+
+  if (_from_buf)
+    ++_buf_it;
+
+  settle();
+  return *this;
+}
+
+template <typename T, typename Compare> inline
+BufferedTreeSetIter<T, Compare> BufferedTreeSetIter<T, Compare>::operator++(int) {
+  BufferedTreeSetIter<T, Compare> it = *this;
+  ++(*this);
+  return it;
+}
+
+/************ End BufferedTreeSetIter declaration & definition ************/
+
+
+
+
+
+/***************** Begin BufferedTreeSet definition ****************/
+
+template <typename T, typename Compare> inline
+BufferedTreeSet<T, Compare>::iterator BufferedTreeSet<T, Compare>::begin()
+  const {
+  return BufferedTreeSetIter<T, Compare>{_tree.begin(), _buffer.data(),
+                                         _buffer.data() + _buffer.size()};
+}
+
+template <typename T, typename Compare> inline
+BufferedTreeSet<T, Compare>::iterator BufferedTreeSet<T, Compare>::end() const {
+  return BufferedTreeSetIter<T, Compare>{};
+}
+
+template <typename T, typename Compare> inline
+BufferedTreeSet<T, Compare>::iterator
+BufferedTreeSet<T, Compare>::lower_bound(const T &value) const {
+  const std::pair<T, bool> *first =
+    _buffer.data() + (find_write(value) - _buffer.cbegin());
+  return BufferedTreeSetIter<T, Compare>{_tree.lower_bound(value), first,
+                                         _buffer.data() + _buffer.size()};
+}
+
+template <typename T, typename Compare> inline
+std::vector<std::pair<T, bool>>::const_iterator
+BufferedTreeSet<T, Compare>::find_write(const T &value) const {
+  return std::lower_bound(_buffer.begin(), _buffer.end(), value,
+                          [this](const std::pair<T, bool> &write, const T &v) {
+                            return _cmp(write.first, v);
+                          });
+}
+
+template <typename T, typename Compare> inline
+void BufferedTreeSet<T, Compare>::buffer_write(const T &value, bool is_add) {
+  auto it = _buffer.begin() + (find_write(value) - _buffer.cbegin());
+
+  if (it != _buffer.end() && !_cmp(value, it->first)) {
+    it->second = is_add; // a later write to the same value wins
+    return;
+  }
+
+  _buffer.emplace(it, value, is_add);
+
+  if (_buffer.size() >= _capacity)
+    flush();
+}
+
+template <typename T, typename Compare> inline
+bool BufferedTreeSet<T, Compare>::contains(const T &value) const {
+  auto it = find_write(value);
+
+  if (it != _buffer.end() && !_cmp(value, it->first))
+    return it->second; // the pending write decides
+
+  return _tree.contains(value);
+}
+
+template <typename T, typename Compare> inline
+void BufferedTreeSet<T, Compare>::flush() {
+  if (_buffer.empty())
+    return;
+
+  _tree.apply_sorted(_buffer);
+  _buffer.clear();
+}
+
+/***************** End BufferedTreeSet definition ****************/
+
+#endif
@@ -0,0 +1,113 @@
+#!/bin/sh
+#
+# Build-time benchmark for libtreeset: generates a consumer program made of
+# many translation units that all use the common TreeSet instantiations, and
+# times compiling and linking it header-only, then again with
+# -DTREESET_EXTERN_TEMPLATES against libtreeset.a.
+#
+# Usage: compile-bench.sh [units [compiler flags ...]]
+#   (run through "make compile-bench", which builds libtreeset.a first)
+
+set -e
+
+UNITS=${1:-8}
+[ $# -gt 0 ] && shift
+FLAGS=${*:-"-std=c++20 -Wall -g -pthread"}
+CXX=${CXX:-g++}
+
+SRC=$(pwd)
+WORK=$(mktemp -d)
+trap 'rm -rf "$WORK"' EXIT
+
+if [ ! -f "$SRC/libtreeset.a" ]; then
+    echo "libtreeset.a not found; run \"make compile-bench\"" >&2
+    exit 1
+fi
+
+# Each unit exercises the same API surface a typical client would: adds,
+# deletes, lookups, iteration, set algebra and a write batch.
+i=0
+while [ $i -lt "$UNITS" ]; do
+    cat > "$WORK/unit$i.cpp" <<UNIT
+#include "treeset.h"
+#include <string>
+
+template <typename T, typename Compare>
+static long exercise(const T &a, const T &b) {
+    TreeSet<T, Compare> s{a, b}, t;
+    t.add(b);
+    s.del(a);
+
+    typename TreeSet<T, Compare>::WriteBatch batch;
+    batch.add(a);
+    s.apply(batch);
+
+    long n = s.contains(a) + s.plus(t).size() + s.intersect(t).size() +
+             s.minus(t).size() + (s == t);
+    for (auto it = s.begin(); it != s.end(); ++it)
+        n++;
+    return n;
+}
+
+long unit$i() {
+    return exercise<int, std::less<int>>($i, 1) +
+           exercise<int, std::greater<int>>($i, 2) +
+           exercise<long, std::less<long>>($i, 3) +
+           exercise<std::string, std::less<std::string>>("$i", "x");
+}
+UNIT
+    i=$((i + 1))
+done
+
+{
+    i=0
+    while [ $i -lt "$UNITS" ]; do
+        echo "long unit$i();"
+        i=$((i + 1))
+    done
+    echo "int main() {"
+    echo "    long n = 0;"
+    i=0
+    while [ $i -lt "$UNITS" ]; do
+        echo "    n += unit$i();"
+        i=$((i + 1))
+    done
+    echo "    return n > 0 ? 0 : 1;"
+    echo "}"
+} > "$WORK/main.cpp"
+
+now() {
+    date +%s.%N
+}
+
+# build LABEL EXTRA_FLAGS LIBS: compiles every unit, then links, and prints
+# one row of timings in seconds plus the total object size in KiB.
+build() {
+    label=$1
+    extra=$2
+    libs=$3
+
+    rm -f "$WORK"/*.o "$WORK/prog"
+
+    start=$(now)
+    for f in "$WORK"/*.cpp; do
+        $CXX $FLAGS $extra -I"$SRC" -c "$f" -o "${f%.cpp}.o"
+    done
+    compiled=$(now)
+    $CXX $FLAGS "$WORK"/*.o $libs -o "$WORK/prog"
+    linked=$(now)
+
+    "$WORK/prog"
+
+    size=$(cat "$WORK"/*.o | wc -c)
+    echo "$label $start $compiled $linked $size" | awk '{
+        printf "%-14s %10.2f %10.2f %10.2f %12d\n",
+               $1, $3 - $2, $4 - $3, $4 - $2, $5 / 1024 }'
+}
+
+echo "$UNITS units, flags: $FLAGS"
+echo
+printf "%-14s %10s %10s %10s %12s\n" build "compile s" "link s" "total s" \
+       "objects KiB"
+build header-only "" ""
+build libtreeset "-DTREESET_EXTERN_TEMPLATES" "$SRC/libtreeset.a"
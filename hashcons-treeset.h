@@ -0,0 +1,521 @@
+#ifndef HASHCONS_TREESET_HH
+#define HASHCONS_TREESET_HH
+
+#include "treeset.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/***************** Begin HashConsTreeSet declaration  ****************/
+
+template <typename T, typename Compare = std::less<T>,
+          typename Hash = std::hash<T>>
+class HashConsTreeSetIter; //! Forward declaration of class HashConsTreeSetIter
+
+/*!
+HashConsTreeSet is an ordered set for programs that keep many sets with mostly
+the same contents (e.g. variants of one configuration). Its nodes are
+immutable and hash-consed: every node lives in one global table per type, and
+building a node identical to one that already exists (same value, same
+children) returns the existing node instead. So identical subtrees are stored
+once no matter how many sets contain them, and memory grows with the number of
+distinct subtrees rather than with the number of sets.
+
+For identical contents to give identical subtrees, the tree's shape depends
+only on its contents: it is a treap whose node priorities come from hashing the
+values. Each set is a handle to the root of such a tree. Copying a set is O(1),
+add() and del() rebuild only the O(log n) nodes on the changed path, and two
+sets are equal exactly when their roots are the same node, so operator== is a
+pointer comparison.
+
+Hash must be consistent with Compare: values that are equivalent under Compare
+must hash alike. The global table is locked by a mutex, so sets can be built
+and dropped on several threads at once.
+*/
+template <typename T, typename Compare = std::less<T>,
+          typename Hash = std::hash<T>>
+class HashConsTreeSet {
+  struct node {
+    T value;
+    std::shared_ptr<const node> left;
+    std::shared_ptr<const node> right;
+
+    //! Hash of the value and the identity of both children
+    size_t hash;
+
+    //! Treap priority: nodes have higher priority than their descendants
+    uint64_t priority;
+
+    //! Number of values in the subtree
+    int size;
+  };
+  using sp_node = std::shared_ptr<const node>;
+
+  /*! The hash-consing table of every live node, keyed by node hash. Entries
+    hold weak references, so the table does not keep nodes alive; a node's
+    deleter removes its entry.
+  */
+  struct node_table {
+    std::mutex mutex;
+    std::unordered_multimap<size_t,
+                            std::pair<const node *, std::weak_ptr<const node>>>
+      nodes;
+  };
+
+  //! Root of this set's tree
+  sp_node _root;
+
+  /*! Returns the table for this node type. It is never destroyed, so sets
+    that outlive main() can still release their nodes safely.
+  */
+  static node_table &table();
+
+  //! Returns the treap priority of a value.
+  static uint64_t priority(const T &value);
+
+  //! Returns true if a node holding value a belongs above one holding b.
+  static bool above(const T &a, uint64_t a_priority, const T &b,
+                    uint64_t b_priority);
+
+  /*! Returns the unique node holding value with the given children, creating
+    it only if no such node is alive yet.
+  */
+  static sp_node make_node(const T &value, const sp_node &left,
+                           const sp_node &right);
+
+  //! Deleter for nodes: drops the node's table entry, then frees it.
+  static void release(const node *n);
+
+  //! Returns the subtree n with value added; sets added if it was missing.
+  static sp_node insert(const sp_node &n, const T &value, bool &added);
+
+  //! Returns the subtree n without value; sets removed if it was there.
+  static sp_node erase(const sp_node &n, const T &value, bool &removed);
+
+  //! Joins two treaps, where every value in a is less than every one in b.
+  static sp_node join(const sp_node &a, const sp_node &b);
+
+  /*! Builds the treap holding the sorted values[lo, hi), whose priorities are
+    in priorities[lo, hi).
+  */
+  static sp_node build(const std::vector<T> &values,
+                       const std::vector<uint64_t> &priorities, int lo, int hi);
+
+  //! Makes this set hold exactly the given values, which must be sorted.
+  void assign_sorted(const std::vector<T> &values);
+
+public:
+  //! Provide "standard" name for iterator type
+  using iterator = HashConsTreeSetIter<T, Compare, Hash>;
+
+  //! Constructor initializes an empty set.
+  HashConsTreeSet() { };
+
+  //! Initializer-list constructor
+  HashConsTreeSet(const std::initializer_list<T> &list);
+
+  //! Makes a hash-consed set with the same values as a TreeSet.
+  explicit HashConsTreeSet(const TreeSet<T, Compare> &s);
+
+  //! Returns an iterator to the first value in the set
+  HashConsTreeSetIter<T, Compare, Hash> begin() const;
+
+  //! Returns an iterator "past the end" of the set.
+  HashConsTreeSetIter<T, Compare, Hash> end() const;
+
+  //! Returns the number of elements in the set.
+  int size() const { return _root == nullptr ? 0 : _root->size; };
+
+  //! Returns whether the value appears in the set or not.
+  bool contains(const T &value) const;
+
+  //! Attempts to add a value to the set.
+  bool add(const T &value);
+
+  //! Attempts to remove value from the set.
+  bool del(const T &value);
+
+  //! Returns true if the rhs set contains the same values, in O(1) time.
+  bool operator==(const HashConsTreeSet &rhs) const {
+    return _root == rhs._root;
+  };
+
+  //! Inverse of ==
+  bool operator!=(const HashConsTreeSet &rhs) const {
+    return !(*this == rhs);
+  };
+
+  //! Returns a TreeSet with the same values, e.g. to use its set algebra.
+  TreeSet<T, Compare> to_treeset() const;
+
+  /*! Returns the number of distinct nodes alive across all sets of this type,
+    which is what their memory use grows with.
+  */
+  static size_t distinct_nodes();
+
+  //! As a friend, the iterator can walk the set's nodes
+  friend class HashConsTreeSetIter<T, Compare, Hash>;
+};
+
+/*! HashConsTreeSetIter walks a HashConsTreeSet in order. As with TreeSet, an
+  iterator is only valid while the set it came from is alive and unmodified.
+*/
+template <typename T, typename Compare, typename Hash>
+class HashConsTreeSetIter {
+  using node = typename HashConsTreeSet<T, Compare, Hash>::node;
+
+  //! Nodes still waiting to be visited; the top is the current node.
+  std::vector<const node *> _stack;
+
+  //! Pushes n and the chain of left children below it onto the stack.
+  void push_left_spine(const node *n);
+
+public:
+  //! Default constructor makes an "end" iterator
+  HashConsTreeSetIter() { };
+
+  //! Constructor positions the iterator at the smallest value under root
+  HashConsTreeSetIter(const node *root) { push_left_spine(root); };
+
+  //! Pre-increment operator returns a ref to the iterator that was incremented.
+  HashConsTreeSetIter& operator++();
+
+  //! Dereference returns value of node being pointed to by iterator
+  const T& operator*() const { return _stack.back()->value; };
+
+  //! Compares the nodes the iterators point to
+  bool operator==(const HashConsTreeSetIter &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const HashConsTreeSetIter &rhs) const {
+    return !(*this == rhs);
+  };
+};
+
+/***************** End HashConsTreeSet declaration  ****************/
+
+
+
+
+
+/***************** Begin HashConsTreeSetIter definition ****************/
+
+template <typename T, typename Compare, typename Hash> inline
+void HashConsTreeSetIter<T, Compare, Hash>::push_left_spine(const node *n) {
+  while (n != nullptr) {
+    _stack.push_back(n);
+    n = n->left.get();
+  }
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSetIter<T, Compare, Hash>&
+HashConsTreeSetIter<T, Compare, Hash>::operator++() {
+  if (!_stack.empty()) {
+    const node *n = _stack.back();
+    _stack.pop_back();
+    push_left_spine(n->right.get());
+  }
+
+  return *this;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+bool HashConsTreeSetIter<T, Compare, Hash>::operator==(
+  const HashConsTreeSetIter &rhs) const {
+  if (_stack.empty() || rhs._stack.empty())
+    return _stack.empty() == rhs._stack.empty();
+
+  return _stack.back() == rhs._stack.back();
+}
+
+/***************** End HashConsTreeSetIter definition  ****************/
+
+
+
+
+
+/***************** Begin HashConsTreeSet definition ****************/
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::node_table&
+HashConsTreeSet<T, Compare, Hash>::table() {
+  static node_table *t = new node_table;
+  return *t;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+uint64_t HashConsTreeSet<T, Compare, Hash>::priority(const T &value) {
+  // splitmix64 finalizer, since std::hash is often the identity on integers
+  uint64_t x = Hash{}(value);
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+bool HashConsTreeSet<T, Compare, Hash>::above(const T &a, uint64_t a_priority,
+                                              const T &b, uint64_t b_priority) {
+  // Ties are broken by value, so the tree's shape is fixed by its contents
+  if (a_priority != b_priority)
+    return a_priority > b_priority;
+  return Compare{}(a, b);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::sp_node
+HashConsTreeSet<T, Compare, Hash>::make_node(const T &value,
+                                             const sp_node &left,
+                                             const sp_node &right) {
+  Compare cmp;
+  auto hash_of = [](const sp_node &n) { return n == nullptr ? 0 : n->hash; };
+
+  uint64_t p = priority(value);
+  size_t h = (size_t) p;
+  h ^= hash_of(left) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+  h ^= hash_of(right) + 0x9e3779b97f4a7c15ULL + (h << 6) + (h >> 2);
+
+  node_table &t = table();
+
+  // Looks for a live node with this value and these children; needs the lock
+  auto find = [&]() -> sp_node {
+    auto [first, last] = t.nodes.equal_range(h);
+    for (auto it = first; it != last; ++it) {
+      const node *n = it->second.first;
+      if (n->left == left && n->right == right && !cmp(n->value, value) &&
+          !cmp(value, n->value)) {
+        // A node whose last owner is releasing it is as good as gone
+        if (sp_node existing = it->second.second.lock())
+          return existing;
+      }
+    }
+    return nullptr;
+  };
+
+  {
+    std::lock_guard<std::mutex> lock(t.mutex);
+    if (sp_node existing = find())
+      return existing;
+  }
+
+  // The new node is made without the lock held, since its deleter takes the
+  // lock if making it fails. Declared before the lock, it is also released
+  // after the lock if another thread made the same node in the meantime.
+  int size = 1 + (left == nullptr ? 0 : left->size) +
+    (right == nullptr ? 0 : right->size);
+  sp_node n{new node{value, left, right, h, p, size}, release};
+
+  std::lock_guard<std::mutex> lock(t.mutex);
+  if (sp_node existing = find())
+    return existing;
+
+  t.nodes.emplace(h, std::make_pair(n.get(), std::weak_ptr<const node>(n)));
+  return n;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+void HashConsTreeSet<T, Compare, Hash>::release(const node *n) {
+  {
+    node_table &t = table();
+    std::lock_guard<std::mutex> lock(t.mutex);
+
+    auto [first, last] = t.nodes.equal_range(n->hash);
+    for (auto it = first; it != last; ++it) {
+      if (it->second.first == n) {
+        t.nodes.erase(it);
+        break;
+      }
+    }
+  }
+
+  // Freeing n releases its children, which take the lock themselves
+  delete n;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::sp_node
+HashConsTreeSet<T, Compare, Hash>::insert(const sp_node &n, const T &value,
+                                          bool &added) {
+  Compare cmp;
+  if (n == nullptr) {
+    added = true;
+    return make_node(value, nullptr, nullptr);
+  }
+
+  if (cmp(value, n->value)) {
+    sp_node l = insert(n->left, value, added);
+    if (!added)
+      return n;
+    if (above(l->value, l->priority, n->value, n->priority)) // rotate right
+      return make_node(l->value, l->left, make_node(n->value, l->right,
+                                                    n->right));
+    return make_node(n->value, l, n->right);
+  }
+
+  if (cmp(n->value, value)) {
+    sp_node r = insert(n->right, value, added);
+    if (!added)
+      return n;
+    if (above(r->value, r->priority, n->value, n->priority)) // rotate left
+      return make_node(r->value, make_node(n->value, n->left, r->left),
+                       r->right);
+    return make_node(n->value, n->left, r);
+  }
+
+  return n; // already in the set
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::sp_node
+HashConsTreeSet<T, Compare, Hash>::erase(const sp_node &n, const T &value,
+                                         bool &removed) {
+  Compare cmp;
+  if (n == nullptr)
+    return n;
+
+  if (cmp(value, n->value)) {
+    sp_node l = erase(n->left, value, removed);
+    return removed ? make_node(n->value, l, n->right) : n;
+  }
+
+  if (cmp(n->value, value)) {
+    sp_node r = erase(n->right, value, removed);
+    return removed ? make_node(n->value, n->left, r) : n;
+  }
+
+  removed = true;
+  return join(n->left, n->right);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::sp_node
+HashConsTreeSet<T, Compare, Hash>::join(const sp_node &a, const sp_node &b) {
+  if (a == nullptr)
+    return b;
+  if (b == nullptr)
+    return a;
+
+  if (above(a->value, a->priority, b->value, b->priority))
+    return make_node(a->value, a->left, join(a->right, b));
+  return make_node(b->value, join(a, b->left), b->right);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::sp_node
+HashConsTreeSet<T, Compare, Hash>::build(const std::vector<T> &values,
+                                         const std::vector<uint64_t> &priorities,
+                                         int lo, int hi) {
+  if (lo >= hi)
+    return nullptr;
+
+  // The value that belongs on top is the root; the rest split around it
+  int top = lo;
+  for (int i = lo + 1; i < hi; i++) {
+    if (above(values[i], priorities[i], values[top], priorities[top]))
+      top = i;
+  }
+
+  return make_node(values[top], build(values, priorities, lo, top),
+                   build(values, priorities, top + 1, hi));
+}
+
+template <typename T, typename Compare, typename Hash> inline
+void HashConsTreeSet<T, Compare, Hash>::assign_sorted(
+  const std::vector<T> &values) {
+  std::vector<uint64_t> priorities;
+  priorities.reserve(values.size());
+  for (const T &value : values)
+    priorities.push_back(priority(value));
+
+  _root = build(values, priorities, 0, (int) values.size());
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::HashConsTreeSet(
+  const std::initializer_list<T> &list) {
+  for (const T &value : list)
+    add(value);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::HashConsTreeSet(
+  const TreeSet<T, Compare> &s) {
+  std::vector<T> values;
+  values.reserve(s.size());
+  for (auto it = s.begin(); it != s.end(); ++it)
+    values.push_back(*it);
+
+  assign_sorted(values);
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::iterator
+HashConsTreeSet<T, Compare, Hash>::begin() const {
+  return HashConsTreeSetIter<T, Compare, Hash>{_root.get()};
+}
+
+template <typename T, typename Compare, typename Hash> inline
+HashConsTreeSet<T, Compare, Hash>::iterator
+HashConsTreeSet<T, Compare, Hash>::end() const {
+  return HashConsTreeSetIter<T, Compare, Hash>{};
+}
+
+template <typename T, typename Compare, typename Hash> inline
+bool HashConsTreeSet<T, Compare, Hash>::contains(const T &value) const {
+  Compare cmp;
+  const node *n = _root.get();
+
+  while (n != nullptr) {
+    if (cmp(value, n->value))
+      n = n->left.get();
+    else if (cmp(n->value, value))
+      n = n->right.get();
+    else
+      return true;
+  }
+
+  return false;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+bool HashConsTreeSet<T, Compare, Hash>::add(const T &value) {
+  bool added = false;
+  _root = insert(_root, value, added);
+  return added;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+bool HashConsTreeSet<T, Compare, Hash>::del(const T &value) {
+  bool removed = false;
+  _root = erase(_root, value, removed);
+  return removed;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+TreeSet<T, Compare> HashConsTreeSet<T, Compare, Hash>::to_treeset() const {
+  TreeSet<T, Compare> s;
+  typename TreeSet<T, Compare>::WriteBatch batch;
+  for (auto it = begin(); it != end(); ++it)
+    batch.add(*it);
+
+  s.apply(batch);
+  return s;
+}
+
+template <typename T, typename Compare, typename Hash> inline
+size_t HashConsTreeSet<T, Compare, Hash>::distinct_nodes() {
+  node_table &t = table();
+  std::lock_guard<std::mutex> lock(t.mutex);
+  return t.nodes.size();
+}
+
+/***************** End HashConsTreeSet definition ****************/
+
+#endif
@@ -0,0 +1,96 @@
+#ifndef LATENCY_HISTOGRAM_HH
+#define LATENCY_HISTOGRAM_HH
+
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+/*!
+LatencyHistogram records latencies (in nanoseconds) in log-linear buckets, in
+the style of an HDR histogram: every power-of-two range is split into 32
+equal sub-buckets, so each recorded value is kept to within about 3% of its
+true value no matter how large it is, and recording costs a few instructions
+and no allocation. Percentiles are read back as the upper edge of the bucket
+they land in, so they never understate a latency.
+*/
+class LatencyHistogram {
+  //! Sub-buckets per power of two (as a number of bits), and their count.
+  static const int SUB_BITS = 5;
+  static const int SUB_COUNT = 1 << SUB_BITS;
+
+  //! Enough buckets for any 64-bit value.
+  static const int NUM_BUCKETS = (64 - SUB_BITS) * SUB_COUNT + 2 * SUB_COUNT;
+
+  std::vector<uint64_t> _counts;
+  uint64_t _total = 0;
+  uint64_t _max = 0;
+
+  //! Returns the bucket that value is counted in.
+  static int bucket_of(uint64_t value) {
+    if (value < 2 * SUB_COUNT)
+      return (int) value;
+
+    int shift = std::bit_width(value) - 1 - SUB_BITS;
+    return shift * SUB_COUNT + (int) (value >> shift);
+  }
+
+  //! Returns the largest value that is counted in bucket b.
+  static uint64_t bucket_max(int b) {
+    if (b < 2 * SUB_COUNT)
+      return (uint64_t) b;
+
+    int shift = b / SUB_COUNT - 1;
+    uint64_t top = (uint64_t) (b % SUB_COUNT + SUB_COUNT);
+    return ((top + 1) << shift) - 1;
+  }
+
+public:
+  //! Constructor creates an empty histogram
+  LatencyHistogram() : _counts(NUM_BUCKETS, 0) { };
+
+  //! Records one latency.
+  void record(uint64_t value) {
+    _counts[bucket_of(value)]++;
+    _total++;
+    if (value > _max)
+      _max = value;
+  };
+
+  //! Adds all of the latencies recorded in other to this histogram.
+  void merge(const LatencyHistogram &other) {
+    for (int b = 0; b < NUM_BUCKETS; b++)
+      _counts[b] += other._counts[b];
+    _total += other._total;
+    if (other._max > _max)
+      _max = other._max;
+  };
+
+  //! Returns the number of latencies recorded.
+  uint64_t count() const { return _total; };
+
+  //! Returns the largest latency recorded (exactly).
+  uint64_t max() const { return _max; };
+
+  /*! Returns the latency that percentile p (in [0, 100]) of the recorded
+    latencies are less than or equal to, or 0 if nothing was recorded.
+  */
+  uint64_t percentile(double p) const {
+    if (_total == 0)
+      return 0;
+
+    uint64_t rank = (uint64_t) (p / 100.0 * _total + 0.5);
+    if (rank < 1)
+      rank = 1;
+
+    uint64_t seen = 0;
+    for (int b = 0; b < NUM_BUCKETS; b++) {
+      seen += _counts[b];
+      if (seen >= rank)
+        return bucket_max(b) < _max ? bucket_max(b) : _max;
+    }
+
+    return _max;
+  };
+};
+
+#endif
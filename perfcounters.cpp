@@ -0,0 +1,148 @@
+#include "perfcounters.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include <cstring>
+
+
+#ifdef __linux__
+
+/*! Fills in the perf_event_attr type/config pair for counter c. */
+static void event_for(PerfCounters::counter c, perf_event_attr &attr) {
+    const uint64_t read_miss = PERF_COUNT_HW_CACHE_OP_READ << 8 |
+                               PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+
+    switch (c) {
+    case PerfCounters::CYCLES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case PerfCounters::INSTRUCTIONS:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case PerfCounters::L1D_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | read_miss;
+        break;
+    case PerfCounters::LLC_MISSES:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case PerfCounters::DTLB_MISSES:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_DTLB | read_miss;
+        break;
+    default:
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+}
+
+
+/*! Opens a disabled, user-space-only counter for counter c, or returns -1. */
+static int open_counter(PerfCounters::counter c) {
+    perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    event_for(c, attr);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+#endif // __linux__
+
+
+PerfCounters::PerfCounters() {
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+#ifdef __linux__
+        fds[i] = open_counter((counter) i);
+#else
+        fds[i] = -1;
+#endif
+        values[i] = 0;
+    }
+}
+
+PerfCounters::~PerfCounters() {
+#ifdef __linux__
+    for (int fd : fds) {
+        if (fd >= 0)
+            close(fd);
+    }
+#endif
+}
+
+void PerfCounters::start() {
+#ifdef __linux__
+    for (int fd : fds) {
+        if (fd >= 0) {
+            ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#endif
+}
+
+void PerfCounters::stop() {
+#ifdef __linux__
+    for (int fd : fds) {
+        if (fd >= 0)
+            ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    for (int i = 0; i < NUM_COUNTERS; i++) {
+        values[i] = 0;
+        if (fds[i] < 0)
+            continue;
+
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (read(fds[i], data, sizeof(data)) != (ssize_t) sizeof(data))
+            continue;
+
+        // If the kernel had to multiplex the counters, scale up the count to
+        // estimate the value over the whole time the counter was enabled.
+        if (data[2] > 0 && data[2] < data[1])
+            values[i] = (uint64_t) ((double) data[0] * data[1] / data[2]);
+        else
+            values[i] = data[0];
+    }
+#endif
+}
+
+bool PerfCounters::available(counter c) const {
+    return fds[c] >= 0;
+}
+
+bool PerfCounters::any_available() const {
+    for (int fd : fds) {
+        if (fd >= 0)
+            return true;
+    }
+
+    return false;
+}
+
+uint64_t PerfCounters::value(counter c) const {
+    return values[c];
+}
+
+const char *PerfCounters::name(counter c) {
+    static const char *names[NUM_COUNTERS] = {
+        "cycles", "instrs", "L1d-miss", "LLC-miss", "dTLB-miss", "br-miss"
+    };
+
+    return names[c];
+}
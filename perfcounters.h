@@ -0,0 +1,49 @@
+#ifndef PERFCOUNTERS_HH
+#define PERFCOUNTERS_HH
+
+
+#include <cstdint>
+
+
+/*!
+ * PerfCounters reads the CPU's hardware performance counters for the calling
+ * thread through Linux perf_event_open().  Each counter is opened on its own,
+ * so if the kernel, the hardware or the sandbox refuses one of them (which is
+ * common in containers and VMs), the rest keep working and the missing one is
+ * simply reported as unavailable.  On other platforms every counter is
+ * unavailable.
+ */
+class PerfCounters {
+public:
+    enum counter {                          // the events being counted
+        CYCLES,
+        INSTRUCTIONS,
+        L1D_MISSES,
+        LLC_MISSES,
+        DTLB_MISSES,
+        BRANCH_MISSES,
+        NUM_COUNTERS
+    };
+
+    PerfCounters();                         // open all counters
+    ~PerfCounters();                        // close all counters
+
+    PerfCounters(const PerfCounters &) = delete;
+    PerfCounters& operator=(const PerfCounters &) = delete;
+
+    void start();                           // reset and start counting
+    void stop();                            // stop counting and read values
+
+    bool available(counter c) const;        // true iff counter c was opened
+    bool any_available() const;             // true iff any counter was opened
+    uint64_t value(counter c) const;        // count between start() and stop()
+
+    static const char *name(counter c);     // short name for reports
+
+private:
+    int fds[NUM_COUNTERS];                  // perf event fds, -1 if missing
+    uint64_t values[NUM_COUNTERS];          // values read by stop()
+};
+
+
+#endif // PERFCOUNTERS_HH
@@ -0,0 +1,207 @@
+#include "treeset.h"
+#include "buffered-treeset.h"
+#include "treeset-trace.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace std;
+
+
+/*===========================================================================
+ * TRACE REPLAY
+ *
+ * Replays a recorded operation trace (see treeset-trace.h) against several
+ * TreeSet configurations and reports the time each one takes, so different
+ * engines can be compared on the same real traffic offline.  Every
+ * configuration must produce the same checksum; a mismatch means a
+ * configuration answered some lookup or range differently.
+ *
+ * Usage:
+ *   replay-treeset TRACE [config ...]      replay a trace of int32/int64 keys
+ *   replay-treeset --synth TRACE OPS       write a synthetic trace to replay
+ */
+
+
+using replay_clock = chrono::steady_clock;
+
+
+/*!
+ * A configuration to replay traces against.  The function replays the records
+ * against a freshly made set and returns the checksum.
+ */
+template <typename T>
+struct config {
+    const char *name;
+    uint64_t (*replay)(const vector<treeset_trace::record<T>> &records);
+};
+
+
+/*! Plain TreeSet: deletes unlink nodes right away. */
+template <typename T>
+uint64_t replay_eager(const vector<treeset_trace::record<T>> &records) {
+    TreeSet<T> s;
+    return replay_trace(records, s);
+}
+
+
+/*! TreeSet with lazy deletion and tombstone-triggered compaction. */
+template <typename T>
+uint64_t replay_lazy(const vector<treeset_trace::record<T>> &records) {
+    TreeSet<T> s;
+    s.set_lazy_delete(true);
+    return replay_trace(records, s);
+}
+
+
+/*! BufferedTreeSet with its default write-buffer capacity. */
+template <typename T>
+uint64_t replay_buffered(const vector<treeset_trace::record<T>> &records) {
+    BufferedTreeSet<T> s;
+    return replay_trace(records, s);
+}
+
+
+/*!
+ * Replays the trace read by reader against each named configuration (or
+ * all of them), printing one row per configuration.  Returns false if a name
+ * is unknown or the configurations disagree.
+ */
+template <typename T>
+bool replay_all(TraceReader<T> &reader, char **names, int num_names) {
+    const config<T> configs[] = {
+        {"eager", replay_eager<T>},
+        {"lazy", replay_lazy<T>},
+        {"buffered", replay_buffered<T>},
+    };
+
+    // Read the whole trace first, so that I/O is not part of the timing.
+    vector<treeset_trace::record<T>> records = reader.read_all();
+
+    long counts[256] = {0};
+    for (const auto &r : records)
+        counts[r.kind]++;
+
+    cout << records.size() << " ops (" << counts[treeset_trace::ADD]
+         << " add, " << counts[treeset_trace::DEL] << " del, "
+         << counts[treeset_trace::CONTAINS] << " contains, "
+         << counts[treeset_trace::RANGE] << " range), " << sizeof(T)
+         << "-byte keys\n\n";
+
+    cout << setw(10) << "config" << setw(12) << "total ms" << setw(10)
+         << "ns/op" << setw(20) << "checksum" << '\n';
+
+    bool ok = true, have_checksum = false;
+    uint64_t first_checksum = 0;
+
+    for (const config<T> &c : configs) {
+        bool wanted = num_names == 0;
+        for (int i = 0; i < num_names; i++)
+            wanted = wanted || strcmp(names[i], c.name) == 0;
+        if (!wanted)
+            continue;
+
+        auto start = replay_clock::now();
+        uint64_t checksum = c.replay(records);
+        double elapsed =
+            chrono::duration<double>(replay_clock::now() - start).count();
+
+        cout << setw(10) << c.name << setw(12) << fixed << setprecision(1)
+             << elapsed * 1e3 << setw(10)
+             << (records.empty() ? 0 : elapsed / records.size() * 1e9)
+             << setw(20) << checksum << '\n';
+
+        if (have_checksum && checksum != first_checksum) {
+            cerr << c.name << ": checksum differs from the first configuration"
+                 << endl;
+            ok = false;
+        }
+        first_checksum = checksum;
+        have_checksum = true;
+    }
+
+    for (int i = 0; i < num_names; i++) {
+        bool known = false;
+        for (const config<T> &c : configs)
+            known = known || strcmp(names[i], c.name) == 0;
+        if (!known) {
+            cerr << "unknown config: " << names[i]
+                 << " (configs: eager lazy buffered)" << endl;
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+
+/*!
+ * Records a synthetic workload of the given number of operations through a
+ * RecordingTreeSet: mostly lookups, with adds and deletes of random keys and
+ * some short range scans.
+ */
+void synthesize(ostream &out, long ops) {
+    TraceWriter<int32_t> writer(out);
+    RecordingTreeSet<int32_t> s;
+    s.record_to(&writer);
+
+    mt19937 rng(12345);
+    uniform_int_distribution<int32_t> key_dist(0, 1 << 20);
+    long visited = 0;
+
+    for (long i = 0; i < ops; i++) {
+        int32_t key = key_dist(rng);
+        int roll = rng() % 100;
+
+        if (roll < 30)
+            s.add(key);
+        else if (roll < 45)
+            s.del(key);
+        else if (roll < 95)
+            s.contains(key);
+        else
+            visited += s.for_range(key, key + 1000, [](int32_t) { });
+    }
+
+    cout << "wrote " << ops << " ops; final size " << s.size() << ", "
+         << visited << " values visited by ranges" << endl;
+}
+
+
+int main(int argc, char **argv) {
+    if (argc == 4 && strcmp(argv[1], "--synth") == 0) {
+        ofstream out(argv[2], ios::binary);
+        synthesize(out, atol(argv[3]));
+        return out ? 0 : 1;
+    }
+
+    if (argc < 2 || argv[1][0] == '-') {
+        cerr << "usage: " << argv[0] << " TRACE [config ...]\n"
+             << "       " << argv[0] << " --synth TRACE OPS\n"
+             << "configs: eager lazy buffered" << endl;
+        return 1;
+    }
+
+    ifstream in(argv[1], ios::binary);
+
+    // The trace header says how big the keys are; try each key type we know.
+    TraceReader<int32_t> reader32(in);
+    if (reader32.ok())
+        return !replay_all(reader32, argv + 2, argc - 2);
+
+    in.clear();
+    in.seekg(0);
+    TraceReader<int64_t> reader64(in);
+    if (reader64.ok())
+        return !replay_all(reader64, argv + 2, argc - 2);
+
+    cerr << argv[1] << ": not a trace of 4- or 8-byte integer keys" << endl;
+    return 1;
+}
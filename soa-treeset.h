@@ -0,0 +1,615 @@
+#ifndef SOA_TREESET_HH
+#define SOA_TREESET_HH
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <initializer_list>
+#include <iostream>
+#include <vector>
+
+/***************** Begin SoATreeSet declaration  ****************/
+
+template <typename T, typename Compare = std::less<T>>
+class SoATreeSetIter; //! Forward declaration of class SoATreeSetIter
+
+/*!
+SoATreeSet is an ordered set with the same interface as TreeSet, and the same
+scapegoat-tree balancing, but a "structure of arrays" node store: node i is
+keys[i], left[i] and right[i] in three separate contiguous arrays, and links
+are 32-bit indices rather than pointers. A search reads only the key and the
+one link it follows at each level, and the whole tree is laid out again in
+breadth-first order whenever it is rebuilt as a whole, so the top levels share
+cache lines. It suits small, cheaply copied T (ints, doubles); slots of deleted
+values are reused by later adds.
+*/
+template <typename T, typename Compare = std::less<T>>
+class SoATreeSet {
+  //! Index of "no node"
+  static constexpr uint32_t NIL = UINT32_MAX;
+
+  //! Weight balance of the scapegoat tree, as in TreeSet
+  static constexpr double ALPHA = 2.0 / 3.0;
+
+  //! The node store: node i is _keys[i], _left[i] and _right[i].
+  std::vector<T> _keys;
+  std::vector<uint32_t> _left;
+  std::vector<uint32_t> _right;
+
+  //! Slots of deleted nodes, to be reused by later adds
+  std::vector<uint32_t> _free;
+
+  uint32_t _root = NIL;
+
+  //! Number of elements in the set
+  int _size = 0;
+
+  //! Largest number of nodes since the tree was last rebuilt as a whole
+  int _max_nodes = 0;
+
+  //! Comparator used for the items in the set
+  Compare _cmp;
+
+  //! Returns how deep a node may lie before the tree must be rebalanced.
+  int depth_bound() const;
+
+  //! Returns the number of nodes in the subtree rooted at n.
+  int count_nodes(uint32_t n) const;
+
+  //! Stores value in a free slot (or a new one) and returns its index.
+  uint32_t new_node(const T &value);
+
+  //! Appends the indices of the subtree n to out, in order.
+  void flatten(uint32_t n, std::vector<uint32_t> &out) const;
+
+  //! Links nodes[lo, hi) into a balanced subtree and returns its root.
+  uint32_t build(const std::vector<uint32_t> &nodes, int lo, int hi);
+
+  //! Rebuilds the subtree in link balanced, returning its number of nodes.
+  int rebuild(uint32_t &link);
+
+  /*! Lays the whole tree out again, balanced, in breadth-first order, with no
+    free slots, and restarts the count for _max_nodes.
+  */
+  void rebuild_all();
+
+  /*! Makes this set hold the sorted values, as a tree laid out breadth-first.
+  */
+  void assign_sorted(const std::vector<T> &values);
+
+public:
+  //! Provide "standard" name for iterator type
+  using iterator = SoATreeSetIter<T, Compare>;
+
+  //! As a friend, the iterator can walk the node arrays
+  friend class SoATreeSetIter<T, Compare>;
+
+  //! Constructor initializes an empty set.
+  SoATreeSet() { };
+
+  //! Initializer-list constructor
+  SoATreeSet(const std::initializer_list<T> &list);
+
+  //! Return an iterator to the first value in the set
+  SoATreeSetIter<T, Compare> begin() const;
+
+  //! Return an iterator "past the end" of the set.
+  SoATreeSetIter<T, Compare> end() const;
+
+  //! Return an iterator to the first value that is not less than value.
+  SoATreeSetIter<T, Compare> lower_bound(const T &value) const;
+
+  //! Return an iterator to the first value that is greater than value.
+  SoATreeSetIter<T, Compare> upper_bound(const T &value) const;
+
+  //! Returns true if the rhs set contains the same values as this set.
+  bool operator==(const SoATreeSet<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const SoATreeSet<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  }
+
+  //! Computes the set-union of this set and the provided set s.
+  SoATreeSet<T, Compare> plus(const SoATreeSet<T, Compare> &s) const;
+
+  //! Computes the set-intersection of this set & provided set s.
+  SoATreeSet<T, Compare> intersect(const SoATreeSet<T, Compare> &s) const;
+
+  //! Computes the set-difference of this set & provided set s.
+  SoATreeSet<T, Compare> minus(const SoATreeSet<T, Compare> &s) const;
+
+  //! Returns the number of elements in the set.
+  int size() const { return _size; };
+
+  //! Attempts to add a value to the set.
+  bool add(const T &value);
+
+  //! Attempts to remove value from the set.
+  bool del(const T &value);
+
+  //! Returns whether the value appears in the set or not.
+  bool contains(const T &value) const;
+};
+
+/*! SoATreeSetIter walks an SoATreeSet in order. The scapegoat depth bound
+  keeps any tree that fits 32-bit indices under 64 levels deep, so the stack
+  of pending nodes lives inside the iterator. As with TreeSet, an iterator is
+  only valid while its set is alive and unmodified.
+*/
+template <typename T, typename Compare>
+class SoATreeSetIter {
+  static constexpr uint32_t NIL = UINT32_MAX;
+
+  const SoATreeSet<T, Compare> *_set = nullptr;
+
+  //! Nodes still waiting to be visited; the top is the current node.
+  std::array<uint32_t, 64> _stack;
+  int _depth = 0;
+
+  //! Pushes n and the chain of left children below it onto the stack.
+  void push_left_spine(uint32_t n);
+
+  //! As a friend, SoATreeSet can position iterators for lower/upper_bound
+  friend class SoATreeSet<T, Compare>;
+
+public:
+  //! Default constructor makes an "end" iterator
+  SoATreeSetIter() { };
+
+  //! Constructor positions the iterator at the smallest value of set
+  SoATreeSetIter(const SoATreeSet<T, Compare> *set) : _set(set) {
+    push_left_spine(set->_root);
+  };
+
+  //! Pre-increment operator returns a ref to the iterator that was incremented.
+  SoATreeSetIter<T, Compare>& operator++();
+
+  //! Post-increment operator returns a copy of the iterator before incremented.
+  SoATreeSetIter<T, Compare> operator++(int) {
+    SoATreeSetIter<T, Compare> it = *this;
+    ++(*this);
+    return it;
+  };
+
+  //! Dereference returns value of node being pointed to by iterator
+  const T& operator*() const { return _set->_keys[_stack[_depth - 1]]; };
+
+  //! Compares the nodes the iterators point to
+  bool operator==(const SoATreeSetIter<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const SoATreeSetIter<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+};
+
+/*! Outputs the contents of the set in the same format as TreeSet: "[1,2,3]" */
+template <typename T, typename Compare>
+std::ostream& operator<<(std::ostream &os, const SoATreeSet<T, Compare> &s) {
+  os << "[";
+
+  for (auto it = s.begin(); it != s.end(); ) {
+    os << *it;
+    if (++it != s.end())
+      os << ",";
+  }
+
+  os << "]";
+  return os;
+}
+
+/***************** End SoATreeSet declaration  ****************/
+
+
+
+
+
+/***************** Begin SoATreeSetIter definition ****************/
+
+template <typename T, typename Compare> inline
+void SoATreeSetIter<T, Compare>::push_left_spine(uint32_t n) {
+  while (n != NIL) {
+    _stack[_depth++] = n;
+    n = _set->_left[n];
+  }
+}
+
+template <typename T, typename Compare> inline
+SoATreeSetIter<T, Compare>& SoATreeSetIter<T, Compare>::operator++() {
+  if (_depth > 0) {
+    uint32_t n = _stack[--_depth];
+    push_left_spine(_set->_right[n]);
+  }
+
+  return *this;
+}
+
+template <typename T, typename Compare> inline
+bool SoATreeSetIter<T, Compare>::operator==(
+  const SoATreeSetIter<T, Compare> &rhs) const {
+  if (_depth == 0 || rhs._depth == 0)
+    return _depth == rhs._depth;
+
+  return _set == rhs._set && _stack[_depth - 1] == rhs._stack[rhs._depth - 1];
+}
+
+/***************** End SoATreeSetIter definition  ****************/
+
+
+
+
+
+/***************** Begin SoATreeSet definition ****************/
+
+template <typename T, typename Compare> inline
+int SoATreeSet<T, Compare>::depth_bound() const {
+  static const double log_inv_alpha = std::log(1.0 / ALPHA);
+  return (int) (std::log((double) std::max(_max_nodes, 1)) / log_inv_alpha);
+}
+
+template <typename T, typename Compare> inline
+int SoATreeSet<T, Compare>::count_nodes(uint32_t n) const {
+  if (n == NIL)
+    return 0;
+
+  return 1 + count_nodes(_left[n]) + count_nodes(_right[n]);
+}
+
+template <typename T, typename Compare> inline
+uint32_t SoATreeSet<T, Compare>::new_node(const T &value) {
+  uint32_t n;
+  if (!_free.empty()) {
+    n = _free.back();
+    _free.pop_back();
+    _keys[n] = value;
+  } else {
+    n = (uint32_t) _keys.size();
+    _keys.push_back(value);
+    _left.push_back(NIL);
+    _right.push_back(NIL);
+  }
+
+  _left[n] = _right[n] = NIL;
+  return n;
+}
+
+template <typename T, typename Compare> inline
+void SoATreeSet<T, Compare>::flatten(uint32_t n,
+                                     std::vector<uint32_t> &out) const {
+  if (n == NIL)
+    return;
+
+  flatten(_left[n], out);
+  out.push_back(n);
+  flatten(_right[n], out);
+}
+
+template <typename T, typename Compare> inline
+uint32_t SoATreeSet<T, Compare>::build(const std::vector<uint32_t> &nodes,
+                                       int lo, int hi) {
+  if (lo >= hi)
+    return NIL;
+
+  int mid = lo + (hi - lo) / 2;
+  uint32_t n = nodes[mid];
+  _left[n] = build(nodes, lo, mid);
+  _right[n] = build(nodes, mid + 1, hi);
+  return n;
+}
+
+template <typename T, typename Compare> inline
+int SoATreeSet<T, Compare>::rebuild(uint32_t &link) {
+  std::vector<uint32_t> nodes;
+  flatten(link, nodes);
+  link = build(nodes, 0, (int) nodes.size());
+  return (int) nodes.size();
+}
+
+template <typename T, typename Compare> inline
+void SoATreeSet<T, Compare>::rebuild_all() {
+  std::vector<T> values;
+  values.reserve(_size);
+  for (auto it = begin(); it != end(); ++it)
+    values.push_back(*it);
+
+  assign_sorted(values);
+}
+
+template <typename T, typename Compare> inline
+void SoATreeSet<T, Compare>::assign_sorted(const std::vector<T> &values) {
+  int n = (int) values.size();
+  _keys.clear();
+  _left.clear();
+  _right.clear();
+  _free.clear();
+  _keys.reserve(n);
+  _left.reserve(n);
+  _right.reserve(n);
+
+  // Lay the balanced tree out level by level: each queue entry is a range of
+  // values whose middle becomes the next node, linked from its parent's slot.
+  // The arrays never grow past the reserve, so the links stay put.
+  struct pending {
+    int lo, hi;
+    uint32_t *link;
+  };
+  std::vector<pending> queue{{0, n, &_root}};
+  _root = NIL;
+
+  for (size_t i = 0; i < queue.size(); i++) {
+    pending p = queue[i];
+    if (p.lo >= p.hi)
+      continue;
+
+    int mid = p.lo + (p.hi - p.lo) / 2;
+    uint32_t node = (uint32_t) _keys.size();
+    _keys.push_back(values[mid]);
+    _left.push_back(NIL);
+    _right.push_back(NIL);
+    *p.link = node;
+    queue.push_back({p.lo, mid, &_left[node]});
+    queue.push_back({mid + 1, p.hi, &_right[node]});
+  }
+
+  _size = n;
+  _max_nodes = n;
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare>::SoATreeSet(const std::initializer_list<T> &list) {
+  for (const T &value : list)
+    add(value);
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare>::iterator SoATreeSet<T, Compare>::begin() const {
+  return SoATreeSetIter<T, Compare>{this};
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare>::iterator SoATreeSet<T, Compare>::end() const {
+  return SoATreeSetIter<T, Compare>{};
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare>::iterator SoATreeSet<T, Compare>::lower_bound(
+  const T &value) const {
+  SoATreeSetIter<T, Compare> it;
+  it._set = this;
+
+  for (uint32_t n = _root; n != NIL; ) {
+    if (_cmp(_keys[n], value)) {
+      n = _right[n];
+    } else {
+      it._stack[it._depth++] = n;
+      n = _left[n];
+    }
+  }
+
+  return it;
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare>::iterator SoATreeSet<T, Compare>::upper_bound(
+  const T &value) const {
+  SoATreeSetIter<T, Compare> it;
+  it._set = this;
+
+  for (uint32_t n = _root; n != NIL; ) {
+    if (_cmp(value, _keys[n])) {
+      it._stack[it._depth++] = n;
+      n = _left[n];
+    } else {
+      n = _right[n];
+    }
+  }
+
+  return it;
+}
+
+template <typename T, typename Compare> inline
+bool SoATreeSet<T, Compare>::operator==(const SoATreeSet<T, Compare> &rhs)
+  const {
+  if (_size != rhs._size)
+    return false;
+
+  for (auto a = begin(), b = rhs.begin(); a != end(); ++a, ++b) {
+    if (_cmp(*a, *b) || _cmp(*b, *a))
+      return false;
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare> SoATreeSet<T, Compare>::plus(
+  const SoATreeSet<T, Compare> &s) const {
+  std::vector<T> values;
+  values.reserve(_size + s._size);
+
+  auto a = begin(), b = s.begin();
+  while (a != end() || b != s.end()) {
+    if (b == s.end() || (a != end() && _cmp(*a, *b))) {
+      values.push_back(*a++);
+    } else {
+      if (a != end() && !_cmp(*b, *a)) // in both sets
+        ++a;
+      values.push_back(*b++);
+    }
+  }
+
+  SoATreeSet<T, Compare> result;
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare> SoATreeSet<T, Compare>::intersect(
+  const SoATreeSet<T, Compare> &s) const {
+  std::vector<T> values;
+
+  auto a = begin(), b = s.begin();
+  while (a != end() && b != s.end()) {
+    if (_cmp(*a, *b)) {
+      ++a;
+    } else if (_cmp(*b, *a)) {
+      ++b;
+    } else {
+      values.push_back(*a++);
+      ++b;
+    }
+  }
+
+  SoATreeSet<T, Compare> result;
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+SoATreeSet<T, Compare> SoATreeSet<T, Compare>::minus(
+  const SoATreeSet<T, Compare> &s) const {
+  std::vector<T> values;
+
+  auto b = s.begin();
+  for (auto a = begin(); a != end(); ++a) {
+    while (b != s.end() && _cmp(*b, *a))
+      ++b;
+    if (b == s.end() || _cmp(*a, *b))
+      values.push_back(*a);
+  }
+
+  SoATreeSet<T, Compare> result;
+  result.assign_sorted(values);
+  return result;
+}
+
+template <typename T, typename Compare> inline
+bool SoATreeSet<T, Compare>::contains(const T &value) const {
+  // One comparison per level: the value, if present, is the last node that it
+  // was not less than.
+  uint32_t candidate = NIL;
+
+  for (uint32_t n = _root; n != NIL; ) {
+    if (_cmp(value, _keys[n])) {
+      n = _left[n];
+    } else {
+      candidate = n;
+      n = _right[n];
+    }
+  }
+
+  return candidate != NIL && !_cmp(_keys[candidate], value);
+}
+
+template <typename T, typename Compare> inline
+bool SoATreeSet<T, Compare>::add(const T &value) {
+  // The links followed from the root down, so the scapegoat can be found on
+  // the way back up. Indices, since new_node() may move the link arrays.
+  uint32_t path[64];
+  int depth = 0;
+  uint32_t candidate = NIL;
+
+  for (uint32_t n = _root; n != NIL; ) {
+    path[depth++] = n;
+    if (_cmp(value, _keys[n])) {
+      n = _left[n];
+    } else {
+      candidate = n;
+      n = _right[n];
+    }
+  }
+
+  if (candidate != NIL && !_cmp(_keys[candidate], value))
+    return false;
+
+  uint32_t n = new_node(value);
+  if (depth == 0)
+    _root = n;
+  else if (_cmp(value, _keys[path[depth - 1]]))
+    _left[path[depth - 1]] = n;
+  else
+    _right[path[depth - 1]] = n;
+
+  _size++;
+  _max_nodes = std::max(_max_nodes, _size);
+
+  if (depth > depth_bound()) {
+    // Walk back up to the deepest ancestor with one lopsided child
+    int size = 1;
+    uint32_t child = n;
+    for (int i = depth - 1; i >= 0; i--) {
+      uint32_t parent = path[i];
+      uint32_t sibling = _left[parent] == child ? _right[parent]
+                                                : _left[parent];
+      int parent_size = size + 1 + count_nodes(sibling);
+
+      if (size > ALPHA * parent_size) {
+        uint32_t &link = i == 0 ? _root
+          : (_left[path[i - 1]] == parent ? _left[path[i - 1]]
+                                          : _right[path[i - 1]]);
+        rebuild(link);
+        break;
+      }
+
+      size = parent_size;
+      child = parent;
+    }
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare> inline
+bool SoATreeSet<T, Compare>::del(const T &value) {
+  uint32_t *link = &_root, *candidate = nullptr;
+
+  while (*link != NIL) {
+    uint32_t n = *link;
+    if (_cmp(value, _keys[n])) {
+      link = &_left[n];
+    } else {
+      candidate = link;
+      link = &_right[n];
+    }
+  }
+
+  if (candidate == nullptr || _cmp(_keys[*candidate], value))
+    return false;
+
+  // Unlink the node, replacing it by its in-order successor if it has two
+  // children
+  uint32_t n = *candidate;
+  if (_left[n] == NIL) {
+    *candidate = _right[n];
+  } else if (_right[n] == NIL) {
+    *candidate = _left[n];
+  } else {
+    uint32_t *succ_link = &_right[n];
+    while (_left[*succ_link] != NIL)
+      succ_link = &_left[*succ_link];
+
+    uint32_t succ = *succ_link;
+    *succ_link = _right[succ];
+    _left[succ] = _left[n];
+    _right[succ] = _right[n];
+    *candidate = succ;
+  }
+
+  _free.push_back(n);
+  _size--;
+
+  // Once the tree has shrunk well below its size at the last rebuild, its
+  // depth bound is too loose, so rebuild it
+  if (_size < ALPHA * _max_nodes)
+    rebuild_all();
+
+  return true;
+}
+
+/***************** End SoATreeSet definition ****************/
+
+#endif
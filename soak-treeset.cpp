@@ -0,0 +1,223 @@
+#include "treeset.h"
+#include "latency-histogram.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+
+/*===========================================================================
+ * SOAK BENCHMARK
+ *
+ * Runs a long mixed workload against TreeSets of several sizes, timing every
+ * single operation and recording the latencies in per-operation histograms.
+ * Averages hide the occasional long pause (destroying or copying a large set,
+ * a deep descent into a degenerate part of the tree), so the report shows
+ * p50/p99/p99.9/max for each operation type and tree size, to catch
+ * worst-case regressions.
+ *
+ * Usage: soak-treeset [seconds [size ...]]
+ * The seconds are split evenly between the sizes, which must be positive.
+ * Defaults: 10 seconds and sizes 1000, 10000 and 100000.
+ */
+
+
+using soak_clock = chrono::steady_clock;
+
+
+/*! The kinds of operation in the workload, and how they are reported. */
+enum soak_op {
+    OP_CONTAINS,
+    OP_ADD,
+    OP_ADD_ASCENDING,
+    OP_DEL,
+    OP_RANGE,
+    OP_COPY,
+    OP_DESTROY,
+    NUM_SOAK_OPS
+};
+
+const char *soak_op_names[NUM_SOAK_OPS] = {
+    "contains", "add", "add-ascending", "del", "range(100)", "copy", "destroy"
+};
+
+
+/*!
+ * Picks the next operation to run.  Point operations dominate; adds and
+ * deletes are balanced so the set stays near its target size, and the
+ * expensive whole-set operations are rare.
+ */
+soak_op pick_op(mt19937 &rng, int size, int target) {
+    int roll = rng() % 1000;
+
+    if (roll < 2)
+        return OP_COPY;                     // copy, then destroy the copy
+    if (roll < 50)
+        return OP_RANGE;
+    if (roll < 450)
+        return OP_CONTAINS;
+
+    // Steer the size back toward the target, never deleting from an empty set.
+    bool grow = size == 0 || size < target ||
+                (size == target && roll % 2 == 0);
+    if (!grow)
+        return OP_DEL;
+
+    return roll < 470 ? OP_ADD_ASCENDING : OP_ADD;
+}
+
+
+/*!
+ * Keeps the compiler from optimizing away a computed value that is otherwise
+ * unused by the benchmark.
+ */
+template <typename T>
+void do_not_optimize(const T &value) {
+    asm volatile("" : : "g"(&value) : "memory");
+}
+
+
+/*! Returns the nanoseconds elapsed since start. */
+uint64_t ns_since(soak_clock::time_point start) {
+    return (uint64_t) chrono::duration_cast<chrono::nanoseconds>(
+        soak_clock::now() - start).count();
+}
+
+
+/*!
+ * Runs the workload on a set of about target values for the given number of
+ * seconds, recording each operation's latency into hist[op].
+ */
+void soak(int target, double seconds, unsigned seed,
+          vector<LatencyHistogram> &hist) {
+    mt19937 rng(seed);
+    uniform_int_distribution<int> value_dist(0, 1 << 30);
+
+    // Keys are long so that ascending adds never overflow, however long the
+    // run: at millions of adds per second, a long lasts for millennia.
+    TreeSet<long> s;
+    vector<long> members;
+    long next_ascending = (1L << 30) + 1;   // above every random value
+    long found = 0;
+
+    while (s.size() < target) {
+        long value = value_dist(rng);
+        if (s.add(value))
+            members.push_back(value);
+    }
+
+    auto deadline = soak_clock::now() + chrono::duration<double>(seconds);
+
+    // Check the clock every so often rather than after every operation.
+    while (soak_clock::now() < deadline) {
+        for (int i = 0; i < 1000; i++) {
+            soak_op op = pick_op(rng, s.size(), target);
+            long value = value_dist(rng);
+            size_t victim = members.empty() ? 0 : rng() % members.size();
+
+            auto start = soak_clock::now();
+
+            switch (op) {
+            case OP_CONTAINS:
+                found += s.contains(value);
+                break;
+
+            case OP_ADD:
+                if (s.add(value))
+                    members.push_back(value);
+                break;
+
+            case OP_ADD_ASCENDING:
+                s.add(next_ascending);
+                members.push_back(next_ascending++);
+                break;
+
+            case OP_DEL:
+                s.del(members[victim]);
+                members[victim] = members.back();
+                members.pop_back();
+                break;
+
+            case OP_RANGE: {
+                auto it = s.lower_bound(value);
+                for (int j = 0; j < 100 && it != s.end(); j++, ++it)
+                    found += *it;
+                break;
+            }
+
+            case OP_COPY: {
+                TreeSet<long> *copy = new TreeSet<long>{s};
+                hist[OP_COPY].record(ns_since(start));
+
+                start = soak_clock::now();
+                delete copy;
+                op = OP_DESTROY;
+                break;
+            }
+
+            default:
+                break;
+            }
+
+            hist[op].record(ns_since(start));
+        }
+    }
+
+    do_not_optimize(found);
+}
+
+
+/*! Prints one row of the report for histogram h. */
+void print_row(const char *op, int size, const LatencyHistogram &h) {
+    if (h.count() == 0)
+        return;
+
+    cout << setw(14) << op << setw(9) << size << setw(12) << h.count()
+         << setw(10) << h.percentile(50) << setw(10) << h.percentile(99)
+         << setw(10) << h.percentile(99.9) << setw(12) << h.max() << '\n';
+}
+
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 10;
+
+    vector<int> sizes;
+    for (int i = 2; i < argc; i++)
+        sizes.push_back(atoi(argv[i]));
+    if (sizes.empty())
+        sizes = {1000, 10000, 100000};
+
+    bool sizes_ok = all_of(sizes.begin(), sizes.end(),
+                           [](int size) { return size > 0; });
+
+    if (seconds <= 0 || !sizes_ok) {
+        cerr << "usage: " << argv[0] << " [seconds [size ...]]" << endl;
+        return 1;
+    }
+
+    cout << "Soak: " << seconds << "s of mixed operations over sizes";
+    for (int size : sizes)
+        cout << ' ' << size;
+    cout << "\n\n";
+
+    cout << setw(14) << "operation" << setw(9) << "size" << setw(12) << "count"
+         << setw(10) << "p50" << setw(10) << "p99" << setw(10) << "p99.9"
+         << setw(12) << "max" << "   (ns)\n";
+
+    for (size_t i = 0; i < sizes.size(); i++) {
+        vector<LatencyHistogram> hist(NUM_SOAK_OPS);
+        soak(sizes[i], seconds / sizes.size(), 1000 + i, hist);
+
+        for (int op = 0; op < NUM_SOAK_OPS; op++)
+            print_row(soak_op_names[op], sizes[i], hist[op]);
+    }
+
+    return 0;
+}
@@ -1,8 +1,54 @@
+#include <string>
+#include <vector>
+
+
+/*!
+ * Records the TreeSet's static probes (see treeset-probes.h) while recording
+ * is switched on, so the tests can check that each probe fires with the
+ * expected arguments without needing a tracer.
+ */
+struct probe_recorder {
+    struct event {
+        std::string name;
+        std::vector<long> args;
+
+        bool operator==(const event &other) const = default;
+    };
+
+    bool recording = false;
+    std::vector<event> events;
+
+    template <typename... Args>
+    void fire(const char *name, Args... args) {
+        if (recording)
+            events.push_back({name, {(long) args...}});
+    }
+};
+
+probe_recorder probes;
+
+#define TREESET_PROBE_HOOK(name, ...) probes.fire(name, __VA_ARGS__)
+
 #include "testbase.h"
+#include "allocstats.h"
 #include "treeset.h"
+#include "buffered-treeset.h"
+#include "treeset-trace.h"
+#include "hashcons-treeset.h"
+#include "soa-treeset.h"
+#include "treeset-chunked.h"
+#include "adaptive-treeset.h"
+#include "treeset-simjoin.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstring>
+#include <random>
+#include <set>
 #include <sstream>
+#include <thread>
+#include <tuple>
 #include <vector>
 
 using namespace std;
@@ -39,6 +85,45 @@ void del_values(TestContext &ctx, TreeSet<T, Compare> &s, const vector<T> values
 }
 
 
+/*! Returns every ordering of the values, starting from the sorted one. */
+template <typename T>
+vector<vector<T>> all_permutations(vector<T> values) {
+    vector<vector<T>> perms;
+
+    std::sort(values.begin(), values.end());
+    do {
+        perms.push_back(values);
+    } while (next_permutation(values.begin(), values.end()));
+
+    return perms;
+}
+
+
+/*!
+ * Runs task(i) for every i in [0, n) on a pool of worker threads, one per
+ * hardware thread.  Tasks are handed out to whichever worker is free, so a
+ * task must depend only on i (seed any randomness from i) for the results to
+ * be the same however the tasks are scheduled.  Tasks may call ctx.CHECK().
+ */
+template <typename Fn>
+void parallel_for(int n, Fn task) {
+    atomic<int> next{0};
+    auto worker = [&]() {
+        for (int i = next++; i < n; i = next++)
+            task(i);
+    };
+
+    int num_workers = max(1, min((int) thread::hardware_concurrency(), n));
+    vector<thread> pool;
+    for (int i = 1; i < num_workers; i++)
+        pool.emplace_back(worker);
+
+    worker();                           // this thread works too
+    for (thread &t : pool)
+        t.join();
+}
+
+
 /*===========================================================================
  * ADD/DEL IN VARIOUS ORDERS
  *
@@ -64,7 +149,7 @@ void check_add_del_ordering(TestContext &ctx, TreeSet<T, Compare> &s,
     // Check that all of the values are present.
     ctx.CHECK(s.size() == (int) add_order.size());
     for (T value : expected_values)
-        ctx.CHECK(!s.contains(value));
+        ctx.CHECK(s.contains(value));
 
     // Delete all values from the tree-set in the order specified.
     del_values(ctx, s, del_order);
@@ -80,22 +165,19 @@ void check_add_del_ordering(TestContext &ctx, TreeSet<T, Compare> &s,
  * Given N, this function attempts to add the values [0..N-1] to a tree-set in
  * all possible orderings.  For each of those orderings, the values are also
  * deleted from the tree-set in all possible orderings.  Thus, this function has
- * a time complexity of approximately O(N^2 * log N).
+ * a time complexity of approximately O((N!)^2 * N log N).  Each add ordering
+ * is checked on its own worker thread.
  */
 template <typename T, typename Compare>
 void test_add_del_all_orders(TestContext &ctx, const vector<T> &values) {
-    vector<T> add_order{values};
-    vector<T> del_order{values};
+    vector<vector<T>> orders = all_permutations(values);
 
-    std::sort(add_order.begin(), add_order.end());
-    std::sort(del_order.begin(), del_order.end());
-
-    while (next_permutation(add_order.begin(), add_order.end())) {
-        while (next_permutation(del_order.begin(), del_order.end())) {
+    parallel_for(orders.size(), [&](int i) {
+        for (const vector<T> &del_order : orders) {
             TreeSet<T, Compare> s;
-            check_add_del_ordering(ctx, s, add_order, del_order, values);
+            check_add_del_ordering(ctx, s, orders[i], del_order, values);
         }
-    }
+    });
 }
 
 
@@ -180,6 +262,308 @@ void test_add_del_brute_force(TestContext &ctx) {
     ctx.DESC("Add/delete all sequences (5 string values, std::greater)");
     test_add_del_all_orders<string, std::greater<string>>(ctx, make_string_vector(5));
     ctx.result();
+
+    ctx.DESC("Add/delete all sequences (6 string values, std::less)");
+    test_add_del_all_orders<string, std::less<string>>(ctx, make_string_vector(6));
+    ctx.result();
+
+    ctx.DESC("Add/delete all sequences (6 string values, std::greater)");
+    test_add_del_all_orders<string, std::greater<string>>(ctx, make_string_vector(6));
+    ctx.result();
+}
+
+
+/*===========================================================================
+ * RANDOM STRESS
+ *
+ * Long randomized runs of mixed operations on larger sets, checked against
+ * std::set.  The runs are independent tasks, each seeded from its index, and
+ * are spread across worker threads.
+ */
+
+
+/*!
+ * An int key for the large runs.  Like counted_key below, it has no
+ * std::numeric_limits, so TreeSet skips the O(n) sanity check it makes after
+ * every operation in debug builds, which would make large runs quadratic.
+ */
+struct stress_key {
+    int value = 0;
+
+    bool operator<(const stress_key &rhs) const { return value < rhs.value; }
+    operator int() const { return value; }
+};
+
+
+/*!
+ * Runs a random mix of adds, deletes and lookups on values in [0, range)
+ * against the set s and a std::set, checking that they agree all along.
+ */
+template <typename Set>
+void check_random_ops(TestContext &ctx, Set &s, unsigned seed, int ops,
+                      int range) {
+    mt19937 rng(seed);
+    set<int> expected;
+
+    for (int i = 0; i < ops; i++) {
+        int value = rng() % range;
+
+        switch (rng() % 4) {
+        case 0:
+        case 1:
+            ctx.CHECK(s.add({value}) == expected.insert(value).second);
+            break;
+        case 2:
+            ctx.CHECK(s.del({value}) == (expected.erase(value) == 1));
+            break;
+        default:
+            ctx.CHECK(s.contains({value}) == (expected.count(value) == 1));
+        }
+    }
+
+    vector<int> actual;
+    for (auto it = s.begin(); it != s.end(); ++it)
+        actual.push_back(*it);
+
+    ctx.CHECK(s.size() == (int) expected.size());
+    ctx.CHECK(actual == vector<int>(expected.begin(), expected.end()));
+}
+
+
+void test_random_stress(TestContext &ctx) {
+    const int TASKS = 16;
+
+    // Adds are twice as likely as deletes, so the large runs settle at about
+    // 10^5 values, deep enough for every rebuild path to run many times
+    const int LARGE_TASKS = 4, LARGE_OPS = 1000000, LARGE_RANGE = 150000;
+
+    ctx.DESC("Random add/del/contains runs match std::set");
+    parallel_for(TASKS, [&](int i) {
+        TreeSet<int> s;
+        check_random_ops(ctx, s, 1000 + i, 2000, 400);
+    });
+    ctx.result();
+
+    ctx.DESC("Random add/del/contains runs match std::set (lazy delete)");
+    parallel_for(TASKS, [&](int i) {
+        TreeSet<int> s;
+        s.set_lazy_delete(true);
+        check_random_ops(ctx, s, 2000 + i, 2000, 400);
+    });
+    ctx.result();
+
+    ctx.DESC("Large random runs (10^5 values, 10^6 ops) match std::set");
+    parallel_for(LARGE_TASKS, [&](int i) {
+        TreeSet<stress_key> s;
+        check_random_ops(ctx, s, 3000 + i, LARGE_OPS, LARGE_RANGE);
+    });
+    ctx.result();
+
+    ctx.DESC("Large random runs match std::set (lazy delete)");
+    parallel_for(LARGE_TASKS, [&](int i) {
+        TreeSet<stress_key> s;
+        s.set_lazy_delete(true);
+        check_random_ops(ctx, s, 4000 + i, LARGE_OPS, LARGE_RANGE);
+    });
+    ctx.result();
+}
+
+
+/*===========================================================================
+ * COMPLEXITY
+ *
+ * Counts the comparisons TreeSet makes on large sets, built in orders that
+ * are hard on unbalanced trees, to catch operations that still give correct
+ * answers but have become asymptotically too slow.
+ */
+
+
+/*!
+ * An int key for counting comparisons.  It has no std::numeric_limits, so
+ * TreeSet skips its O(n) sanity checks, and the counts (and running times)
+ * only reflect the operations themselves.
+ */
+struct counted_key {
+    int value = 0;
+};
+
+ostream& operator<<(ostream &os, const counted_key &k) {
+    return os << k.value;
+}
+
+
+/*! Comparator that counts its calls, separately on each thread. */
+struct counting_less {
+    static thread_local long calls;
+
+    bool operator()(const counted_key &a, const counted_key &b) const {
+        calls++;
+        return a.value < b.value;
+    }
+};
+
+thread_local long counting_less::calls = 0;
+
+using counted_set = TreeSet<counted_key, counting_less>;
+
+
+/*! Comparator that throws bad_alloc on its calls_left'th call from now. */
+struct fallible_less {
+    static atomic<long> calls_left;
+
+    bool operator()(int a, int b) const {
+        if (calls_left-- == 0)
+            throw bad_alloc();
+        return a < b;
+    }
+};
+
+atomic<long> fallible_less::calls_left{-1};
+
+
+/*!
+ * Returns the keys [0, n) in one of several orders: sorted, reversed,
+ * shuffled, or "zig-zag" (0, n-1, 1, n-2, ...), which builds a degenerate
+ * unbalanced tree one level deeper with every key.
+ */
+vector<counted_key> make_key_order(int n, const string &order) {
+    vector<counted_key> keys;
+
+    for (int i = 0; i < n; i++) {
+        if (order == "zig-zag")
+            keys.push_back({i % 2 == 0 ? i / 2 : n - 1 - i / 2});
+        else if (order == "reverse")
+            keys.push_back({n - 1 - i});
+        else
+            keys.push_back({i});
+    }
+
+    if (order == "random")
+        shuffle(keys.begin(), keys.end(), mt19937(n));
+
+    return keys;
+}
+
+
+/*!
+ * Adds, looks up and deletes n keys in the given order, checking that each
+ * kind of operation makes O(log n) comparisons per call: at most
+ * per_op * log2(n) on average, and for lookups (which never rebalance) at most
+ * the scapegoat depth bound log_1.5(n) + 2 every single time.
+ */
+void check_point_op_comparisons(TestContext &ctx, int n, const string &order,
+                                double per_op) {
+    vector<counted_key> keys = make_key_order(n, order);
+    double budget = per_op * log2(n) * n;
+    counted_set s;
+
+    counting_less::calls = 0;
+    for (const counted_key &k : keys)
+        ctx.CHECK(s.add(k));
+    ctx.CHECK(counting_less::calls <= budget);
+
+    int max_lookup = (int) (log(n) / log(1.5)) + 2;
+    long worst = 0;
+
+    counting_less::calls = 0;
+    for (int i = -1; i <= n; i++) {             // hits, and misses at the ends
+        long before = counting_less::calls;
+        ctx.CHECK(s.contains({i}) == (i >= 0 && i < n));
+        worst = max(worst, counting_less::calls - before);
+    }
+    ctx.CHECK(counting_less::calls <= budget);
+    ctx.CHECK(worst <= max_lookup);
+
+    // Delete the first half in the same order, then the rest in reverse
+    counting_less::calls = 0;
+    for (int i = 0; i < n / 2; i++)
+        ctx.CHECK(s.del(keys[i]));
+    for (int i = n - 1; i >= n / 2; i--)
+        ctx.CHECK(s.del(keys[i]));
+    ctx.CHECK(counting_less::calls <= budget);
+    ctx.CHECK(s.size() == 0);
+}
+
+
+/*!
+ * Checks that set algebra and equality on sets of sizes n and m make at most
+ * 2(n + m) comparisons, as a linear merge of the two sets would.
+ */
+void check_set_algebra_comparisons(TestContext &ctx, int n, int m) {
+    counted_set a, b;
+    for (const counted_key &k : make_key_order(n, "random"))
+        a.add({2 * k.value});                   // evens
+    for (const counted_key &k : make_key_order(m, "random"))
+        b.add({3 * k.value});                   // multiples of 3
+
+    long budget = 2L * (n + m);
+
+    counting_less::calls = 0;
+    counted_set u = a.plus(b);
+    ctx.CHECK(counting_less::calls <= budget);
+
+    counting_less::calls = 0;
+    counted_set i = a.intersect(b);
+    ctx.CHECK(counting_less::calls <= budget);
+
+    counting_less::calls = 0;
+    counted_set d = a.minus(b);
+    ctx.CHECK(counting_less::calls <= budget);
+
+    counting_less::calls = 0;
+    ctx.CHECK(u == u.plus(i));                  // equal walk over u
+    ctx.CHECK(counting_less::calls <= budget + 2L * (u.size() + i.size()));
+
+    // Every multiple of 6 is in both; the rest of the evens are only in a.
+    int sixes = min((n - 1) / 3, (m - 1) / 2) + 1;
+    ctx.CHECK(i.size() == sixes);
+    ctx.CHECK(d.size() == n - sixes);
+    ctx.CHECK(u.size() == n + m - sixes);
+}
+
+
+void test_complexity(TestContext &ctx) {
+    const vector<string> orders = {"sorted", "reverse", "random", "zig-zag"};
+
+    ctx.DESC("Point operations make O(log n) comparisons (n = 10^3, 10^5)");
+    parallel_for(orders.size(), [&](int i) {
+        check_point_op_comparisons(ctx, 1000, orders[i], 3);
+        check_point_op_comparisons(ctx, 100000, orders[i], 3);
+    });
+    ctx.result();
+
+    // Only the random order at 10^6: the adversarial orders rebuild often
+    // and take too long unoptimized, and 10^5 already tells O(log n) apart.
+    ctx.DESC("Point operations make O(log n) comparisons (n = 10^6)");
+    check_point_op_comparisons(ctx, 1000000, "random", 3);
+    ctx.result();
+
+    ctx.DESC("Set algebra makes O(n + m) comparisons");
+    check_set_algebra_comparisons(ctx, 1000, 1000);
+    check_set_algebra_comparisons(ctx, 100000, 10);
+    check_set_algebra_comparisons(ctx, 10, 100000);
+    check_set_algebra_comparisons(ctx, 300000, 200000);
+    ctx.result();
+
+    ctx.DESC("Batches of ascending adds keep lookups O(log n)");
+    {
+        counted_set s;
+        int n = 0;
+        for (int batch_num = 0; batch_num < 1000; batch_num++) {
+            counted_set::WriteBatch batch;
+            for (int i = 0; i < 100; i++)
+                batch.add({n++});
+            s.apply(batch);
+        }
+
+        int max_lookup = (int) (log(n) / log(1.5)) + 2;
+        for (int i = 0; i < n; i += 97) {
+            counting_less::calls = 0;
+            ctx.CHECK(s.contains({i}));
+            ctx.CHECK(counting_less::calls <= max_lookup);
+        }
+    }
+    ctx.result();
 }
 
 
@@ -226,16 +610,15 @@ void check_iter_ordering(TestContext &ctx, TreeSet<T, Compare> &s,
  */
 template <typename T, typename Compare>
 void test_iter_all_orders(TestContext &ctx, const vector<T> &values) {
-    vector<T> add_order{values};
+    vector<vector<T>> orders = all_permutations(values);
     vector<T> expected_order{values};
 
-    std::sort(add_order.begin(), add_order.end());
     std::sort(expected_order.begin(), expected_order.end(), Compare{});
 
-    while (next_permutation(add_order.begin(), add_order.end())) {
+    parallel_for(orders.size(), [&](int i) {
         TreeSet<T, Compare> s;
-        check_iter_ordering(ctx, s, add_order, expected_order);
-    }
+        check_iter_ordering(ctx, s, orders[i], expected_order);
+    });
 }
 
 
@@ -274,6 +657,10 @@ void test_iter_brute_force(TestContext &ctx) {
     test_iter_all_orders<int, std::greater<int>>(ctx, make_int_vector(6));
     ctx.result();
 
+    ctx.DESC("Add/iterate over all sequences (8 int values, std::less)");
+    test_iter_all_orders<int, std::less<int>>(ctx, make_int_vector(8));
+    ctx.result();
+
     // STRINGS
 
     ctx.DESC("Add/iterate over all sequences (3 string values, std::less)");
@@ -318,16 +705,16 @@ void test_iter_brute_force(TestContext &ctx) {
  */
 template <typename T, typename Compare>
 void test_equal_all_orders(TestContext &ctx, const vector<T> &values) {
-    vector<T> add_order{values};
-
-    std::sort(add_order.begin(), add_order.end());
+    vector<vector<T>> orders = all_permutations(values);
 
     TreeSet<T, Compare> orig;
-    add_values(ctx, orig, add_order);
+    add_values(ctx, orig, orders[0]);
 
     TreeSet<T, Compare> empty;
 
-    while (next_permutation(add_order.begin(), add_order.end())) {
+    parallel_for(orders.size(), [&](int i) {
+        const vector<T> &add_order = orders[i];
+
         // Add all values to the tree-set, in the order specified.
         TreeSet<T, Compare> s;
         add_values(ctx, s, add_order);
@@ -343,7 +730,7 @@ void test_equal_all_orders(TestContext &ctx, const vector<T> &values) {
         ctx.CHECK(!(s != orig));
 
         ctx.CHECK(s != empty);
-    }
+    });
 }
 
 
@@ -425,10 +812,9 @@ void test_equal_brute_force(TestContext &ctx) {
  */
 template <typename T, typename Compare>
 void test_ostream_all_orders(TestContext &ctx, const vector<T> &values) {
-    vector<T> add_order{values};
+    vector<vector<T>> orders = all_permutations(values);
     vector<T> expected_order{values};
 
-    std::sort(add_order.begin(), add_order.end());
     std::sort(expected_order.begin(), expected_order.end(), Compare{});
 
     ostringstream os;
@@ -446,7 +832,9 @@ void test_ostream_all_orders(TestContext &ctx, const vector<T> &values) {
 
     string expected = os.str();
 
-    while (next_permutation(add_order.begin(), add_order.end())) {
+    parallel_for(orders.size(), [&](int i) {
+        const vector<T> &add_order = orders[i];
+
         // Add all values to the tree-set, in the order specified.
         TreeSet<T, Compare> s;
         add_values(ctx, s, add_order);
@@ -456,13 +844,12 @@ void test_ostream_all_orders(TestContext &ctx, const vector<T> &values) {
         for (T value : values)
             ctx.CHECK(s.contains(value));
 
-        // Output the tree-set to the stream.
-        os.str("");
-        os << s;
-        string actual = os.str();
+        // Output the tree-set to a stream of its own.
+        ostringstream task_os;
+        task_os << s;
 
-        ctx.CHECK(actual == expected);
-    }
+        ctx.CHECK(task_os.str() == expected);
+    });
 }
 
 
@@ -1042,35 +1429,2200 @@ void test_set_ops(TestContext &ctx, const char *cmp_fn) {
 }
 
 
-/*! This program is a simple test-suite for the TreeSet class. */
-int main() {
+void test_bounds(TestContext &ctx) {
+    const TreeSet<int> s{10, 20, 30, 40};
+    const TreeSet<int, std::greater<int>> g{10, 20, 30, 40};
+    const TreeSet<int> empty;
 
-    cout << "Testing the TreeSet class." << endl << endl;
+    ctx.DESC("lower_bound/upper_bound (std::less)");
 
-    TestContext ctx(cout);
+    ctx.CHECK(*s.lower_bound(5) == 10);
+    ctx.CHECK(*s.lower_bound(10) == 10);
+    ctx.CHECK(*s.lower_bound(25) == 30);
+    ctx.CHECK(s.lower_bound(41) == s.end());
 
-    test_treeset_default_ctor(ctx);
-    test_basic_add_contains_size(ctx);
-    test_basic_add_del_2(ctx);
-    test_add_del_brute_force(ctx);
+    ctx.CHECK(*s.upper_bound(5) == 10);
+    ctx.CHECK(*s.upper_bound(10) == 20);
+    ctx.CHECK(*s.upper_bound(39) == 40);
+    ctx.CHECK(s.upper_bound(40) == s.end());
 
-    test_treeset_copy_ctor(ctx);
-    test_treeset_copy_assign(ctx);
+    ctx.CHECK(empty.lower_bound(1) == empty.end());
+    ctx.CHECK(empty.upper_bound(1) == empty.end());
 
-    test_iter_basic(ctx);
-    test_iter_brute_force(ctx);
+    // Iteration continues in order from a bound.
+    auto it = s.lower_bound(15);
+    ctx.CHECK(*it++ == 20);
+    ctx.CHECK(*it++ == 30);
+    ctx.CHECK(*it++ == 40);
+    ctx.CHECK(it == s.end());
 
-    test_initializer_lists(ctx);
+    ctx.result();
 
-    test_basic_equality(ctx);
-    test_equal_brute_force(ctx);
+    ctx.DESC("lower_bound/upper_bound (std::greater)");
 
-    test_basic_ostream(ctx);
-    test_basic_ostream_greater(ctx);
-    test_ostream_brute_force(ctx);
+    ctx.CHECK(*g.lower_bound(45) == 40);
+    ctx.CHECK(*g.lower_bound(30) == 30);
+    ctx.CHECK(*g.upper_bound(30) == 20);
+    ctx.CHECK(g.lower_bound(5) == g.end());
+    ctx.CHECK(g.upper_bound(10) == g.end());
 
-    test_set_ops<std::less<int>>(ctx, "std::less");
-    test_set_ops<std::greater<int>>(ctx, "std::greater");
+    ctx.result();
+}
+
+
+/*!
+ * Reads the whole set through next_batch() with buffers of the given size,
+ * checking that every call fills the buffer except the one that reaches the
+ * end.
+ */
+template <typename T, typename Compare>
+vector<T> read_in_batches(TestContext &ctx, const TreeSet<T, Compare> &s,
+                          size_t batch_size) {
+    vector<T> values, buffer(batch_size);
+    auto it = s.begin();
+
+    while (true) {
+        size_t n = it.next_batch(buffer);
+        values.insert(values.end(), buffer.begin(), buffer.begin() + n);
+        if (n < batch_size)
+            break;
+    }
+
+    ctx.CHECK(it == s.end());
+    ctx.CHECK(it.next_batch(buffer) == 0);
+    return values;
+}
+
+
+void test_batch_iteration(TestContext &ctx) {
+    ctx.DESC("next_batch fills buffers with runs of values in order");
+
+    TreeSet<int> s;
+    vector<int> expected;
+    mt19937 rng(11);
+    for (int i = 0; i < 1000; i++) {
+        int v = rng() % 5000;
+        if (s.add(v))
+            expected.push_back(v);
+    }
+    sort(expected.begin(), expected.end());
+
+    for (size_t batch_size : {1, 3, 8, 64, 999, 5000})
+        ctx.CHECK(read_in_batches(ctx, s, batch_size) == expected);
+
+    // Continues from wherever the iterator is, and mixes with operator++
+    auto it = s.lower_bound(expected[10]);
+    ++it;
+    vector<int> buffer(4);
+    ctx.CHECK(it.next_batch(buffer) == 4);
+    ctx.CHECK(buffer == vector<int>(expected.begin() + 11,
+                                    expected.begin() + 15));
+    ctx.CHECK(*it == expected[15]);
+    ctx.CHECK(it.next_batch(span<int>()) == 0);
+    ctx.CHECK(*it == expected[15]);
+
+    ctx.CHECK(read_in_batches(ctx, TreeSet<int>(), 8).empty());
+
+    // Tombstones are skipped
+    TreeSet<int> lazy{s};
+    lazy.set_lazy_delete(true, 0.9);
+    vector<int> remaining;
+    for (size_t i = 0; i < expected.size(); i++) {
+        if (i % 3 == 0)
+            ctx.CHECK(lazy.del(expected[i]));
+        else
+            remaining.push_back(expected[i]);
+    }
+    ctx.CHECK(lazy.tombstones() > 0);
+    ctx.CHECK(read_in_batches(ctx, lazy, 16) == remaining);
+
+    const TreeSet<string, std::greater<string>> g{"b", "d", "a", "c"};
+    ctx.CHECK(read_in_batches(ctx, g, 3) ==
+              vector<string>({"d", "c", "b", "a"}));
+
+    ctx.result();
+
+    ctx.DESC("copy_range copies [lo, hi) up to the buffer size");
+
+    const TreeSet<int> t{10, 20, 30, 40, 50};
+    vector<int> out(10);
+
+    ctx.CHECK(t.copy_range(15, 45, out) == 3);
+    ctx.CHECK(vector<int>(out.begin(), out.begin() + 3) ==
+              vector<int>({20, 30, 40}));
+    ctx.CHECK(t.copy_range(10, 50, out) == 4);      // hi is excluded
+    ctx.CHECK(t.copy_range(0, 100, out) == 5);
+    ctx.CHECK(t.copy_range(0, 100, span<int>(out).first(2)) == 2);
+    ctx.CHECK(out[0] == 10 && out[1] == 20);
+    ctx.CHECK(t.copy_range(21, 29, out) == 0);
+    ctx.CHECK(t.copy_range(40, 20, out) == 0);      // empty range
+    ctx.CHECK(TreeSet<int>().copy_range(0, 100, out) == 0);
+
+    const TreeSet<int, std::greater<int>> tg{10, 20, 30, 40, 50};
+    ctx.CHECK(tg.copy_range(45, 15, out) == 3);
+    ctx.CHECK(vector<int>(out.begin(), out.begin() + 3) ==
+              vector<int>({40, 30, 20}));
+
+    ctx.CHECK(lazy.copy_range(0, 5000, span<int>(buffer)) == 4);
+    ctx.CHECK(buffer == vector<int>(remaining.begin(), remaining.begin() + 4));
+
+    ctx.result();
+}
+
+
+void test_prefix_range(TestContext &ctx) {
+    using entry = tuple<int, long, int>;        // (tenant, timestamp, id)
+
+    ctx.DESC("prefix_range finds tuples by leading columns");
+
+    TreeSet<entry> s;
+    vector<entry> all;
+    mt19937 rng(5);
+    for (int i = 0; i < 2000; i++) {
+        entry e{(int) (rng() % 10), (long) (rng() % 1000), i};
+        s.add(e);
+        all.push_back(e);
+    }
+    sort(all.begin(), all.end());
+
+    // Everything matching pred, in order
+    auto matching = [&all](auto pred) {
+        vector<entry> result;
+        for (const entry &e : all) {
+            if (pred(e))
+                result.push_back(e);
+        }
+        return result;
+    };
+
+    auto collect = [](const TreeSet<entry>::value_range &r) {
+        vector<entry> result;
+        for (const entry &e : r)
+            result.push_back(e);
+        return result;
+    };
+
+    for (int tenant = -1; tenant <= 10; tenant++) {
+        ctx.CHECK(collect(s.prefix_range(tenant)) ==
+                  matching([=](const entry &e) {
+                      return get<0>(e) == tenant;
+                  }));
+
+        for (long ts : {0L, 137L, 999L}) {
+            ctx.CHECK(collect(s.prefix_range(tenant, ts)) ==
+                      matching([=](const entry &e) {
+                          return get<0>(e) == tenant && get<1>(e) == ts;
+                      }));
+        }
+
+        ctx.CHECK(collect(s.prefix_range(tenant, column_range{100L, 250L})) ==
+                  matching([=](const entry &e) {
+                      return get<0>(e) == tenant && get<1>(e) >= 100 &&
+                             get<1>(e) < 250;
+                  }));
+    }
+
+    // An empty range of timestamps, and a full-key prefix
+    ctx.CHECK(collect(s.prefix_range(3, column_range{500L, 500L})).empty());
+    const entry &first = all.front();
+    ctx.CHECK(collect(s.prefix_range(get<0>(first), get<1>(first),
+                                     get<2>(first))) == vector<entry>{first});
+
+    // Columns only need to be comparable with the tuple's own columns
+    TreeSet<pair<string, int>> names{{"ann", 1}, {"bob", 2}, {"bob", 5},
+                                     {"cat", 3}};
+    int bobs = 0;
+    for (const auto &p : names.prefix_range("bob"))
+        bobs += p.second;
+    ctx.CHECK(bobs == 7);
+
+    ctx.CHECK(collect(TreeSet<entry>().prefix_range(1)).empty());
+
+    ctx.result();
+}
+
+
+/*!
+ * Runs random adds and deletes on a bitmap-backed TreeSet and a std::set with
+ * the same ordering, checking that every result and the final contents agree.
+ */
+template <typename T, typename Compare>
+void check_bitmap_set(TestContext &ctx, unsigned seed) {
+    TreeSet<T, Compare> s;
+    set<T, Compare> expected;
+    mt19937 rng(seed);
+
+    for (int i = 0; i < 20000; i++) {
+        T v = (T) rng();
+        if (rng() % 3 == 0)
+            ctx.CHECK(s.del(v) == (expected.erase(v) == 1));
+        else
+            ctx.CHECK(s.add(v) == expected.insert(v).second);
+        ctx.CHECK(s.contains(v) == (expected.count(v) == 1));
+    }
+
+    ctx.CHECK(s.size() == (int) expected.size());
+    vector<T> values;
+    for (auto it = s.begin(); it != s.end(); it++)
+        values.push_back(*it);
+    ctx.CHECK(values == vector<T>(expected.begin(), expected.end()));
+
+    T probe = (T) rng();
+    auto lb = s.lower_bound(probe);
+    auto expected_lb = expected.lower_bound(probe);
+    ctx.CHECK((lb == s.end()) == (expected_lb == expected.end()));
+    if (lb != s.end() && expected_lb != expected.end())
+        ctx.CHECK(*lb == *expected_lb);
+
+    // Set algebra against a second set, word-parallel vs std::set_*
+    TreeSet<T, Compare> t;
+    set<T, Compare> expected_t;
+    for (int i = 0; i < 3000; i++) {
+        T v = (T) rng();
+        t.add(v);
+        expected_t.insert(v);
+    }
+
+    auto as_vector = [](const TreeSet<T, Compare> &x) {
+        vector<T> result;
+        for (auto it = x.begin(); it != x.end(); ++it)
+            result.push_back(*it);
+        return result;
+    };
+
+    vector<T> u, i, d;
+    set_union(expected.begin(), expected.end(), expected_t.begin(),
+              expected_t.end(), back_inserter(u), Compare());
+    set_intersection(expected.begin(), expected.end(), expected_t.begin(),
+                     expected_t.end(), back_inserter(i), Compare());
+    set_difference(expected.begin(), expected.end(), expected_t.begin(),
+                   expected_t.end(), back_inserter(d), Compare());
+
+    ctx.CHECK(as_vector(s.plus(t)) == u);
+    ctx.CHECK(s.plus(t).size() == (int) u.size());
+    ctx.CHECK(as_vector(s.intersect(t)) == i);
+    ctx.CHECK(s.intersect(t).size() == (int) i.size());
+    ctx.CHECK(as_vector(s.minus(t)) == d);
+    ctx.CHECK(s.minus(t).size() == (int) d.size());
+}
+
+
+enum class small_enum : uint8_t { zero, one, two, big = 250 };
+
+
+void test_bitmap_sets(TestContext &ctx) {
+    ctx.DESC("Small-key sets are bitmaps of 256 bits or 8 KiB");
+
+    ctx.CHECK(sizeof(TreeSet<uint8_t>) <= 64);
+    ctx.CHECK(sizeof(TreeSet<uint16_t>) <= 8192 + 64);
+
+    ctx.result();
+
+    ctx.DESC("Bitmap sets match std::set, in either order");
+
+    check_bitmap_set<uint8_t, std::less<uint8_t>>(ctx, 1);
+    check_bitmap_set<uint8_t, std::greater<uint8_t>>(ctx, 2);
+    check_bitmap_set<int8_t, std::less<int8_t>>(ctx, 3);
+    check_bitmap_set<uint16_t, std::less<uint16_t>>(ctx, 4);
+    check_bitmap_set<int16_t, std::less<int16_t>>(ctx, 5);
+    check_bitmap_set<int16_t, std::greater<int16_t>>(ctx, 6);
+
+    ctx.result();
+
+    ctx.DESC("Bitmap sets support the rest of the TreeSet interface");
+
+    TreeSet<int16_t> s{-300, 5, 0, 32767, -32768};
+    ostringstream os;
+    os << s;
+    ctx.CHECK(os.str() == "[-32768,-300,0,5,32767]");
+    ctx.CHECK(s == TreeSet<int16_t>({5, 0, 32767, -32768, -300}));
+    ctx.CHECK(s != TreeSet<int16_t>({5}));
+    ctx.CHECK(*s.upper_bound(0) == 5);
+    ctx.CHECK(s.upper_bound(32767) == s.end());
+
+    // There is no stored key to refer to, so iterators yield keys by value
+    bool by_value = is_same_v<decltype(*s.begin()), int16_t>;
+    ctx.CHECK(by_value);
+
+    vector<int16_t> buffer(3);
+    auto it = s.begin();
+    ctx.CHECK(it.next_batch(buffer) == 3);
+    ctx.CHECK(buffer == vector<int16_t>({-32768, -300, 0}));
+    ctx.CHECK(it.next_batch(buffer) == 2);
+    ctx.CHECK(s.copy_range(-300, 32767, buffer) == 3);
+    ctx.CHECK(buffer == vector<int16_t>({-300, 0, 5}));
+
+    TreeSet<int16_t>::WriteBatch batch;
+    batch.add(7);
+    batch.del(5);
+    batch.add(5);
+    batch.del(-300);
+    s.apply(batch);
+    ctx.CHECK(s == TreeSet<int16_t>({-32768, 0, 5, 7, 32767}));
+
+    BufferedTreeSet<uint8_t> buffered(4);
+    for (int i = 0; i < 100; i++)
+        buffered.add(i * 7 % 256);
+    buffered.del(7);
+    ctx.CHECK(buffered.size() == 99);
+    ctx.CHECK(!buffered.contains(7) && buffered.contains(14));
+
+    TreeSet<small_enum> e{small_enum::big, small_enum::zero};
+    ctx.CHECK(e.contains(small_enum::big));
+    ctx.CHECK(!e.contains(small_enum::one));
+    ctx.CHECK(*e.begin() == small_enum::zero);
+
+    ctx.result();
+}
+
+
+/*!
+ * A 200-byte record ordered by its id alone, so TreeSet keeps it out of line.
+ * The payload is derived from the id, so a record can be checked for damage.
+ */
+struct big_record {
+    uint64_t id = 0;
+    char payload[192] = {};
+
+    big_record(uint64_t id = 0) : id(id) {
+        for (size_t i = 0; i < sizeof(payload); i++)
+            payload[i] = (char) (id + i);
+    }
+
+    bool intact() const {
+        for (size_t i = 0; i < sizeof(payload); i++) {
+            if (payload[i] != (char) (id + i))
+                return false;
+        }
+        return true;
+    }
+};
+
+struct big_record_less {
+    bool operator()(const big_record &a, const big_record &b) const {
+        return a.id < b.id;
+    }
+};
+
+struct big_record_greater {
+    bool operator()(const big_record &a, const big_record &b) const {
+        return a.id > b.id;
+    }
+};
+
+ostream& operator<<(ostream &os, const big_record &r) {
+    return os << r.id;
+}
+
+/*
+ * A deliberately coarse prefix (many ids share one), so that searches have to
+ * fall back on comparing full records.  Only the ascending order has one.
+ */
+template <>
+struct treeset_key_prefix<big_record, big_record_less> {
+    static uint32_t of(const big_record &r) { return (uint32_t) (r.id >> 4); }
+};
+
+
+/*!
+ * Runs random adds and deletes of big records against a std::set of their ids,
+ * then checks the contents, and that copies and set algebra keep records whole.
+ */
+template <typename Compare>
+void check_big_records(TestContext &ctx, bool lazy) {
+    TreeSet<big_record, Compare> s;
+    s.set_lazy_delete(lazy);
+    set<uint64_t> expected;
+    mt19937 rng(lazy ? 8 : 9);
+
+    for (int i = 0; i < 5000; i++) {
+        uint64_t id = rng() % 2000;
+        if (rng() % 3 == 0)
+            ctx.CHECK(s.del(id) == (expected.erase(id) == 1));
+        else
+            ctx.CHECK(s.add(id) == expected.insert(id).second);
+        ctx.CHECK(s.contains(id) == (expected.count(id) == 1));
+    }
+
+    TreeSet<big_record, Compare> copy{s};
+    TreeSet<big_record, Compare> merged = copy.plus({1u << 20});
+    vector<uint64_t> ids;
+    bool intact = true;
+    for (auto it = merged.begin(); it != merged.end(); ++it) {
+        ids.push_back((*it).id);
+        intact = intact && (*it).intact();
+    }
+
+    vector<uint64_t> expected_ids(expected.begin(), expected.end());
+    expected_ids.push_back(1u << 20);
+    if (is_same_v<Compare, big_record_greater>)
+        sort(expected_ids.begin(), expected_ids.end(), greater<uint64_t>());
+
+    ctx.CHECK(ids == expected_ids);
+    ctx.CHECK(intact);
+    ctx.CHECK(copy == s);
+}
+
+
+void test_out_of_line_values(TestContext &ctx) {
+    ctx.DESC("Large values are stored out of line, with key prefixes");
+
+    check_big_records<big_record_less>(ctx, false);
+    check_big_records<big_record_less>(ctx, true);
+    check_big_records<big_record_greater>(ctx, false);
+    check_big_records<big_record_greater>(ctx, true);
+
+    ctx.result();
+}
+
+
+void test_const_equality(TestContext &ctx) {
+    const TreeSet<int> s1{1, 2, 3}, s2{3, 2, 1}, s3{1, 2};
+
+    ctx.DESC("Equality/inequality on const sets");
+
+    ctx.CHECK(s1 == s2);
+    ctx.CHECK(!(s1 != s2));
+    ctx.CHECK(s1 != s3);
+    ctx.CHECK(s1.plus(s3) == s1);
+    ctx.CHECK(s1.intersect(s3) == s3);
+
+    ctx.result();
+}
+
+
+void test_lazy_delete(TestContext &ctx) {
+    ctx.DESC("Lazy deletion leaves tombstones that reads skip");
+
+    TreeSet<int> s{4, 2, 6, 1, 3, 5, 7};
+    s.set_lazy_delete(true, 0.5);
+
+    ctx.CHECK(s.del(4));
+    ctx.CHECK(s.del(1));
+    ctx.CHECK(!s.del(1));                 // Already a tombstone
+    ctx.CHECK(s.size() == 5);
+    ctx.CHECK(s.tombstones() == 2);
+
+    ctx.CHECK(!s.contains(4));
+    ctx.CHECK(!s.contains(1));
+    ctx.CHECK(s.contains(2));
+    ctx.CHECK(s.contains(3));
+
+    ctx.CHECK(s == TreeSet<int>({2, 3, 5, 6, 7}));
+    ctx.CHECK(*s.lower_bound(4) == 5);
+    ctx.CHECK(*s.begin() == 2);
+
+    // Re-adding a tombstoned value revives its node.
+    ctx.CHECK(s.add(4));
+    ctx.CHECK(!s.add(4));
+    ctx.CHECK(s.contains(4));
+    ctx.CHECK(s.size() == 6);
+    ctx.CHECK(s.tombstones() == 1);
+
+    // Copies carry their tombstones along.
+    TreeSet<int> copy{s};
+    ctx.CHECK(copy == s);
+    ctx.CHECK(copy.tombstones() == 1);
+
+    ctx.result();
+
+    ctx.DESC("Lazy deletion compacts past the tombstone threshold");
+
+    TreeSet<int> t;
+    t.set_lazy_delete(true, 0.25);
+    for (int i = 0; i < 100; i++)
+        t.add(i);
+
+    for (int i = 0; i < 25; i++)
+        ctx.CHECK(t.del(i * 4));
+
+    ctx.CHECK(t.tombstones() == 25);    // Exactly at the threshold
+    ctx.CHECK(t.del(1));
+    ctx.CHECK(t.tombstones() == 0);     // Compacted
+    ctx.CHECK(t.size() == 74);
+
+    vector<int> remaining;
+    for (int i = 2; i < 100; i++) {
+        if (i % 4 != 0)
+            remaining.push_back(i);
+    }
+
+    auto it = t.begin();
+    for (int value : remaining) {
+        ctx.CHECK(*it == value);
+        ++it;
+    }
+    ctx.CHECK(it == t.end());
+
+    // Turning lazy deletion off compacts immediately.
+    ctx.CHECK(t.del(2));
+    ctx.CHECK(t.tombstones() == 1);
+    t.set_lazy_delete(false);
+    ctx.CHECK(t.tombstones() == 0);
+    ctx.CHECK(!t.contains(2));
+    ctx.CHECK(t.del(3));
+    ctx.CHECK(t.tombstones() == 0);
+    ctx.CHECK(t.size() == 72);
+
+    // Deleting every value leaves an empty set.
+    TreeSet<int> u{1, 2, 3};
+    u.set_lazy_delete(true, 1.0);
+    ctx.CHECK(u.del(1));
+    ctx.CHECK(u.del(2));
+    ctx.CHECK(u.del(3));
+    ctx.CHECK(u.size() == 0);
+    ctx.CHECK(u.begin() == u.end());
+    ctx.CHECK(u.add(2));
+    ctx.CHECK(u.size() == 1);
+    ctx.CHECK(u.tombstones() == 0);
+
+    ctx.result();
+}
+
+
+/*!
+ * Collects the values produced by iterating over a set-like collection, so the
+ * contents can be compared against an expected vector.
+ */
+template <typename Set>
+vector<int> to_vector(const Set &s) {
+    vector<int> v;
+    for (auto it = s.begin(); it != s.end(); ++it)
+        v.push_back(*it);
+
+    return v;
+}
+
+
+void test_buffered_treeset(TestContext &ctx) {
+    ctx.DESC("Buffered writes are visible before and after a flush");
+
+    BufferedTreeSet<int> s(4);
+
+    s.add(5);
+    s.add(1);
+    s.add(3);
+    ctx.CHECK(s.buffered() == 3);
+    ctx.CHECK(s.contains(1));
+    ctx.CHECK(s.contains(3));
+    ctx.CHECK(!s.contains(2));
+    ctx.CHECK(to_vector(s) == vector<int>({1, 3, 5}));
+
+    s.add(7);                           // Fills the buffer, so it flushes
+    ctx.CHECK(s.buffered() == 0);
+    ctx.CHECK(to_vector(s) == vector<int>({1, 3, 5, 7}));
+
+    // A buffered delete hides a value that is already in the tree, and a
+    // later add of the same value overrides the delete.
+    s.del(3);
+    s.del(42);                          // Not in the set
+    s.add(4);
+    ctx.CHECK(!s.contains(3));
+    ctx.CHECK(!s.contains(42));
+    ctx.CHECK(s.contains(4));
+    ctx.CHECK(to_vector(s) == vector<int>({1, 4, 5, 7}));
+
+    s.add(3);
+    ctx.CHECK(s.contains(3));
+    ctx.CHECK(s.buffered() == 3);
+    ctx.CHECK(to_vector(s) == vector<int>({1, 3, 4, 5, 7}));
+
+    s.del(7);
+    s.del(1);
+    ctx.CHECK(to_vector(s) == vector<int>({3, 4, 5}));
+    ctx.CHECK(s.size() == 3);           // Flushes
+    ctx.CHECK(s.buffered() == 0);
+    ctx.CHECK(s.tree() == TreeSet<int>({3, 4, 5}));
+
+    ctx.result();
+
+    ctx.DESC("Buffered flushes match unbuffered add/del");
+
+    BufferedTreeSet<int> b(16);
+    TreeSet<int> t;
+    unsigned x = 12345;
+    for (int i = 0; i < 2000; i++) {
+        x = x * 1103515245 + 12345;
+        int value = (x >> 8) % 300;
+        if ((x >> 4) % 3 == 0) {
+            b.del(value);
+            t.del(value);
+        } else {
+            b.add(value);
+            t.add(value);
+        }
+
+        if (i % 97 == 0)
+            ctx.CHECK(to_vector(b) == to_vector(t));
+    }
+
+    for (int value = 0; value < 300; value++)
+        ctx.CHECK(b.contains(value) == t.contains(value));
+
+    ctx.CHECK(b.tree() == t);
+    ctx.CHECK(b.size() == t.size());
+
+    ctx.result();
+}
+
+
+/*!
+ * A value type whose copy-constructor throws once a global budget of copies
+ * runs out, used to check that a failed operation leaves a set untouched.
+ */
+struct fragile {
+    static int copies_left;
+
+    int value;
+
+    fragile(int value = 0) : value(value) { }
+
+    fragile(const fragile &other) : value(other.value) {
+        if (copies_left-- == 0)
+            throw bad_alloc();
+    }
+
+    fragile& operator=(const fragile &other) = default;
+
+    bool operator==(const fragile &other) const { return value == other.value; }
+    bool operator<(const fragile &other) const { return value < other.value; }
+};
+
+int fragile::copies_left = -1;
+
+ostream& operator<<(ostream &os, const fragile &f) {
+    return os << f.value;
+}
+
+
+void test_write_batch(TestContext &ctx) {
+    ctx.DESC("Write batch applies adds/deletes with cancellation");
+
+    TreeSet<int> s{10, 20, 30, 40, 50};
+    TreeSet<int>::WriteBatch batch;
+
+    batch.add(25);
+    batch.del(10);
+    batch.add(60);
+    batch.del(60);                      // Cancels the add of 60
+    batch.del(30);
+    batch.add(30);                      // Cancels the del of 30
+    batch.add(20);                      // Already present
+    batch.del(99);                      // Not present
+    batch.add(1);
+    batch.add(2);
+    batch.add(3);
+    ctx.CHECK(batch.size() == 11);
+
+    s.apply(batch);
+    ctx.CHECK(s.size() == 8);
+    ctx.CHECK(to_vector(s) == vector<int>({1, 2, 3, 20, 25, 30, 40, 50}));
+
+    // Applying an empty batch changes nothing.
+    batch.clear();
+    s.apply(batch);
+    ctx.CHECK(s.size() == 8);
+
+    // Batches against an empty set build the whole tree at once.
+    TreeSet<int, std::greater<int>> g;
+    TreeSet<int, std::greater<int>>::WriteBatch gb;
+    for (int i = 0; i < 100; i++)
+        gb.add(i);
+    gb.del(50);
+    g.apply(gb);
+    ctx.CHECK(g.size() == 99);
+    ctx.CHECK(*g.begin() == 99);
+    ctx.CHECK(!g.contains(50));
+
+    ctx.result();
+
+    ctx.DESC("Write batch matches one-at-a-time add/del");
+
+    unsigned x = 777;
+    for (bool lazy : {false, true}) {
+        TreeSet<int> batched, sequential;
+        batched.set_lazy_delete(lazy, 0.3);
+        sequential.set_lazy_delete(lazy, 0.3);
+
+        for (int round = 0; round < 50; round++) {
+            TreeSet<int>::WriteBatch b;
+            for (int i = 0; i < 40; i++) {
+                x = x * 1103515245 + 12345;
+                int value = (x >> 8) % 200;
+                if ((x >> 4) % 3 == 0) {
+                    b.del(value);
+                    sequential.del(value);
+                } else {
+                    b.add(value);
+                    sequential.add(value);
+                }
+            }
+
+            batched.apply(b);
+            ctx.CHECK(batched == sequential);
+            ctx.CHECK(batched.size() == sequential.size());
+        }
+    }
+
+    ctx.result();
+
+    ctx.DESC("Write batch is all-or-nothing when an allocation fails");
+
+    TreeSet<fragile> f;
+    for (int i = 0; i < 20; i += 2)
+        f.add(fragile(i));
+
+    TreeSet<fragile>::WriteBatch fb;
+    fb.del(fragile(4));
+    fb.add(fragile(5));
+    fb.add(fragile(7));
+    fb.add(fragile(100));
+
+    // Fail at every possible point of the batch in turn, until it succeeds.
+    for (int budget = 0; ; budget++) {
+        fragile::copies_left = budget;
+        try {
+            f.apply(fb);
+            fragile::copies_left = -1;
+            break;
+        } catch (const bad_alloc &) {
+            fragile::copies_left = -1;
+        }
+
+        ctx.CHECK(f.size() == 10);
+        ctx.CHECK(f.contains(fragile(4)));
+        ctx.CHECK(!f.contains(fragile(5)));
+        ctx.CHECK(!f.contains(fragile(7)));
+        ctx.CHECK(!f.contains(fragile(100)));
+    }
+
+    ctx.CHECK(f.size() == 12);
+    ctx.CHECK(!f.contains(fragile(4)));
+    ctx.CHECK(f.contains(fragile(5)));
+    ctx.CHECK(f.contains(fragile(100)));
+
+    ctx.result();
+
+    ctx.DESC("Sketch updates that fail never undo a change or throw");
+
+    // Once the set has changed, a failed sketch update only marks the sketch
+    // stale, so every failure is either before the change or not seen at all
+    for (bool lazy : {false, true}) {
+        TreeSet<fragile> g;
+        g.set_lazy_delete(lazy);
+        for (int i = 0; i < 20; i += 2)
+            g.add(fragile(i));
+        g.enable_sketch();
+
+        for (int budget = 0; ; budget++) {
+            fragile::copies_left = budget;
+            try {
+                g.apply(fb);
+                fragile::copies_left = -1;
+                break;
+            } catch (const bad_alloc &) {
+                fragile::copies_left = -1;
+            }
+
+            ctx.CHECK(g.size() == 10 && g.contains(fragile(4)));
+            ctx.CHECK(!g.contains(fragile(5)) && !g.contains(fragile(100)));
+        }
+        ctx.CHECK(g.size() == 12 && g.approx_rank(fragile(100)) == 11);
+
+        for (int budget = 0; budget < 100; budget++) {
+            fragile::copies_left = budget;
+            bool added = false, deleted = false;
+            try {
+                added = g.add(fragile(9));
+                deleted = g.del(fragile(0));
+                fragile::copies_left = -1;
+            } catch (const bad_alloc &) {
+                fragile::copies_left = -1;
+            }
+
+            // Each change either happened and returned, or never happened
+            ctx.CHECK(g.contains(fragile(9)) == added);
+            ctx.CHECK(g.contains(fragile(0)) != deleted);
+            ctx.CHECK(g.approx_rank(fragile(100)) == g.size() - 1);
+
+            if (added && deleted)
+                break;
+            g.del(fragile(9));
+            g.add(fragile(0));
+        }
+        ctx.CHECK(g.size() == 12 && g.approx_quantile(0) == fragile(2));
+    }
+
+    ctx.result();
+}
+
+
+/*===========================================================================
+ * ALLOCATION BUDGETS
+ *
+ * The global operator new/delete are replaced (see allocstats.cpp) so these
+ * tests can count the heap allocations each TreeSet operation makes, and fail
+ * if a change makes an operation allocate more than its budget.
+ */
+
+
+/*! Make a set of n pseudo-random values in [0, 4n), along with its values. */
+TreeSet<int> make_random_set(int n, unsigned seed, vector<int> &values) {
+    TreeSet<int> s;
+    unsigned x = seed;
+    while (s.size() < n) {
+        x = x * 1103515245 + 12345;
+        int value = (x >> 8) % (4 * n);
+        if (s.add(value))
+            values.push_back(value);
+    }
+
+    return s;
+}
+
+
+void test_allocation_budgets(TestContext &ctx) {
+    vector<int> values, other_values;
+    TreeSet<int> s = make_random_set(1000, 42, values);
+    TreeSet<int> t = make_random_set(1000, 43, other_values);
+    const TreeSet<int> s_copy{s};
+
+    ctx.DESC("Allocation budget: zero for read-only operations");
+
+    {
+        AllocCounter counter;
+        int found = 0;
+        for (int i = 0; i < 4000; i++)
+            found += s.contains(i);
+        ctx.CHECK(counter.allocs() == 0);
+        ctx.CHECK(found == 1000);
+    }
+
+    {
+        AllocCounter counter;
+        long total = 0;
+        for (auto it = s.begin(); it != s.end(); ++it)
+            total += *it;
+        ctx.CHECK(counter.allocs() == 0);
+        ctx.CHECK(total > 0);
+    }
+
+    {
+        AllocCounter counter;
+        auto it = s.lower_bound(2000);
+        auto jt = s.upper_bound(2000);
+        ctx.CHECK(it != s.end() && jt != s.end());
+        ctx.CHECK(counter.allocs() == 0);
+    }
+
+    {
+        AllocCounter counter;
+        ctx.CHECK(s == s_copy);
+        ctx.CHECK(s != t);
+        ctx.CHECK(counter.allocs() == 0);
+    }
+
+    ctx.result();
+
+    ctx.DESC("Allocation budget: O(log n) node slabs for adds, zero for del");
+
+    {
+        // The node pool, then slabs of 16, 16, 32, ... 512 nodes
+        TreeSet<int> u;
+        AllocCounter counter;
+        for (int value : values)
+            u.add(value);
+        ctx.CHECK(counter.allocs() == 8);
+
+        AllocCounter dup_counter;
+        for (int value : values)
+            ctx.CHECK(!u.add(value));
+        ctx.CHECK(dup_counter.allocs() == 0);
+
+        AllocCounter del_counter;
+        for (int i = 0; i < 500; i++)
+            u.del(values[i]);
+        ctx.CHECK(del_counter.allocs() == 0);
+    }
+
+    {
+        TreeSet<int> u{s};
+        u.set_lazy_delete(true, 0.9);
+        AllocCounter counter;
+        for (int i = 0; i < 500; i++)
+            u.del(values[i]);
+        ctx.CHECK(counter.allocs() == 0);
+    }
+
+    ctx.result();
+
+    ctx.DESC("Allocation budget: one per result value for copies/set algebra");
+
+    {
+        AllocCounter counter;
+        TreeSet<int> copy{s};
+        ctx.CHECK(counter.allocs() == copy.size());
+    }
+
+    {
+        AllocCounter counter;
+        TreeSet<int> result = s.plus(t);
+        ctx.CHECK(counter.allocs() == result.size());
+    }
+
+    {
+        AllocCounter counter;
+        TreeSet<int> result = s.intersect(t);
+        ctx.CHECK(counter.allocs() == result.size());
+    }
+
+    {
+        AllocCounter counter;
+        TreeSet<int> result = s.minus(t);
+        ctx.CHECK(counter.allocs() == result.size());
+    }
+
+    ctx.result();
+
+    ctx.DESC("Allocation budget: zero for refilling a cleared set");
+
+    {
+        TreeSet<int> u;
+        for (int value : values)
+            u.add(value);
+
+        for (int round = 0; round < 3; round++) {
+            u.clear();
+            ctx.CHECK(u.size() == 0 && u.begin() == u.end());
+            ctx.CHECK(!u.contains(values[0]));
+
+            AllocCounter counter;
+            for (int value : values)
+                u.add(value);
+            for (int i = 0; i < 500; i += 2)
+                u.del(values[i]);
+            for (int i = 0; i < 500; i += 2)
+                u.add(values[i]);
+            ctx.CHECK(counter.allocs() == 0);
+            ctx.CHECK(u == s);
+        }
+
+        // Batches draw their nodes from the pool too; what they allocate is
+        // only the batch's own bookkeeping
+        u.clear();
+        TreeSet<int>::WriteBatch batch;
+        for (int value : values)
+            batch.add(value);
+        AllocCounter counter;
+        u.apply(batch);
+        ctx.CHECK(counter.allocs() < 50);
+        ctx.CHECK(u == s);
+    }
+
+    ctx.result();
+
+    ctx.DESC("Allocation budget: one block for adds after reserve()");
+
+    {
+        TreeSet<int> u;
+        u.reserve(1000);                    // waits for the first node's size
+        AllocCounter counter;
+        for (int value : values)
+            u.add(value);
+        ctx.CHECK(counter.allocs() == 1);
+        ctx.CHECK(u == s);
+    }
+
+    {
+        TreeSet<int> u{1, 2, 3};
+        AllocCounter counter;
+        u.reserve(1003);
+        ctx.CHECK(counter.allocs() == 1);
+        for (int value : values)
+            u.add(value + 4000);
+        ctx.CHECK(counter.allocs() == 1);
+        ctx.CHECK(u.size() == 1003);
+    }
+
+    {
+        // Nodes outlive the set that made them, along with its pool
+        TreeSet<int> moved;
+        {
+            TreeSet<int> u{1, 2, 3};
+            moved = std::move(u);
+        }
+        ctx.CHECK(moved.add(4) && moved.del(1));
+        ostringstream os;
+        os << moved;
+        ctx.CHECK(os.str() == "[2,3,4]");
+    }
+
+    {
+        // A move hands the tree and its pool over, so the set can go to
+        // another thread while the moved-from one is reused and destroyed
+        TreeSet<int> sent;
+        for (int i = 0; i < 2000; i++)
+            sent.add(i * 797 % 2000);
+
+        atomic<int> left{-1};
+        thread t([&left](TreeSet<int> mine) {
+            for (int i = 0; i < 2000; i += 2)
+                mine.del(i);
+            left = mine.size();
+        }, std::move(sent));
+
+        ctx.CHECK(sent.size() == 0 && sent.begin() == sent.end());
+        for (int i = 0; i < 2000; i++)
+            sent.add(i);
+        sent.clear();
+        t.join();
+        ctx.CHECK(left == 1000);
+    }
+
+    {
+        // Bitmap sets are left empty by a move too, like every other TreeSet
+        TreeSet<uint8_t> small{1, 2, 3};
+        small.enable_sketch();
+        TreeSet<uint8_t> taken{std::move(small)};
+        ctx.CHECK(small.size() == 0 && small.begin() == small.end());
+        ctx.CHECK(!small.has_sketch() && !small.contains(2));
+        ctx.CHECK(taken.size() == 3 && taken.has_sketch());
+
+        small.add(7);
+        taken = std::move(small);
+        ctx.CHECK(small.size() == 0 && taken == TreeSet<uint8_t>({7}));
+        taken = TreeSet<uint8_t>(taken);
+        ctx.CHECK(taken.size() == 1 && taken.contains(7));
+    }
+
+    ctx.result();
+}
+
+
+void test_trace_replay(TestContext &ctx) {
+    ctx.DESC("Recorded trace reads back exactly");
+
+    stringstream trace;
+    TraceWriter<int> writer(trace);
+    RecordingTreeSet<int> r;
+
+    r.add(99);                          // Not recorded yet
+    r.record_to(&writer);
+    ctx.CHECK(r.add(5));
+    ctx.CHECK(r.add(1));
+    ctx.CHECK(!r.add(5));
+    ctx.CHECK(r.contains(1));
+    ctx.CHECK(r.del(99));
+    ctx.CHECK(!r.contains(99));
+
+    vector<int> seen;
+    ctx.CHECK(r.for_range(0, 5, [&seen](int v) { seen.push_back(v); }) == 1);
+    ctx.CHECK(seen == vector<int>({1}));
+
+    r.record_to(nullptr);
+    r.add(7);                           // Not recorded any more
+
+    TraceReader<int> reader(trace);
+    ctx.CHECK(reader.ok());
+    vector<treeset_trace::record<int>> records = reader.read_all();
+    ctx.CHECK(records.size() == 7);
+    if (records.size() == 7) {
+        ctx.CHECK(records[0].kind == treeset_trace::ADD && records[0].key == 5);
+        ctx.CHECK(records[2].kind == treeset_trace::ADD && records[2].key == 5);
+        ctx.CHECK(records[3].kind == treeset_trace::CONTAINS);
+        ctx.CHECK(records[4].kind == treeset_trace::DEL && records[4].key == 99);
+        ctx.CHECK(records[6].kind == treeset_trace::RANGE &&
+                  records[6].key == 0 && records[6].hi == 5);
+    }
+
+    // The header records the key size, so the trace can't be misread.
+    trace.clear();
+    trace.seekg(0);
+    TraceReader<long long> wrong_size(trace);
+    ctx.CHECK(!wrong_size.ok());
+
+    stringstream garbage("not a trace");
+    TraceReader<int> bad_magic(garbage);
+    ctx.CHECK(!bad_magic.ok());
+
+    ctx.result();
+
+    ctx.DESC("Replay gives the same results on every configuration");
+
+    stringstream big_trace;
+    TraceWriter<int> big_writer(big_trace);
+    RecordingTreeSet<int> recorded;
+    recorded.record_to(&big_writer);
+
+    uint64_t expected = 0;
+    unsigned x = 777;
+    for (int i = 0; i < 5000; i++) {
+        x = x * 1103515245 + 12345;
+        int value = (x >> 8) % 1000;
+
+        switch ((x >> 4) % 4) {
+        case 0:
+            recorded.add(value);
+            break;
+        case 1:
+            recorded.del(value);
+            break;
+        case 2:
+            expected += recorded.contains(value);
+            break;
+        default:
+            expected += recorded.for_range(value, value + 50, [](int) { });
+        }
+    }
+
+    TraceReader<int> big_reader(big_trace);
+    vector<treeset_trace::record<int>> ops = big_reader.read_all();
+    ctx.CHECK(ops.size() == 5000);
+
+    TreeSet<int> eager;
+    ctx.CHECK(replay_trace(ops, eager) == expected);
+    ctx.CHECK(eager == recorded.set());
+
+    TreeSet<int> lazy;
+    lazy.set_lazy_delete(true);
+    ctx.CHECK(replay_trace(ops, lazy) == expected);
+    ctx.CHECK(lazy == recorded.set());
+
+    BufferedTreeSet<int> buffered(32);
+    ctx.CHECK(replay_trace(ops, buffered) == expected);
+    ctx.CHECK(buffered.tree() == recorded.set());
+
+    ctx.result();
+}
+
+
+void test_probes(TestContext &ctx) {
+    ctx.DESC("Static probes fire with depth and size arguments");
+
+    using event = probe_recorder::event;
+
+    TreeSet<int> s;
+    probes.events.clear();
+    probes.recording = true;
+
+    s.add(5);
+    s.add(3);
+    s.add(3);                           // Already present
+    s.contains(3);
+    s.contains(4);                      // Falls off below 3
+    s.del(3);                           // 1 of 2 nodes left: rebuild
+    s.del(42);
+
+    probes.recording = false;
+    ctx.CHECK(probes.events == vector<event>({
+        {"add", {0, 1}}, {"add", {1, 2}}, {"add", {2, 2}},
+        {"contains", {2, 1}}, {"contains", {2, 0}},
+        {"del", {1, 1}}, {"rebalance", {1, 1}}, {"del", {1, 1}}
+    }));
+
+    ctx.result();
+
+    ctx.DESC("Static probes fire for bulk updates, rebalancing, set algebra");
+
+    TreeSet<int> a{1, 2, 3, 4}, b{3, 4, 5};
+    a.set_lazy_delete(true, 0.4);
+
+    probes.events.clear();
+    probes.recording = true;
+
+    TreeSet<int>::WriteBatch batch;
+    batch.add(10);
+    batch.add(11);
+    batch.del(1);
+    a.apply(batch);                     // 5 live + 1 tombstone; the adds
+                                        // hang too deep: rebalance
+
+    a.del(2);
+    a.del(10);                          // 3 of 6 nodes dead: rebalance
+
+    TreeSet<int> u = a.plus(b);
+    TreeSet<int> i = a.intersect(b);
+    TreeSet<int> m = a.minus(b);
+
+    probes.recording = false;
+
+    vector<event> events;
+    for (const event &e : probes.events) {
+        if (e.name != "add" && e.name != "contains")
+            events.push_back(e);
+    }
+
+    ctx.CHECK(events == vector<event>({
+        {"batch_entry", {3, 4}}, {"rebalance", {4, 5}},
+        {"batch_return", {2, 5}},
+        {"del", {1, 4}}, {"del", {2, 3}}, {"rebalance", {3, 3}},
+        {"plus_entry", {3, 3}}, {"plus_return", {4}},
+        {"intersect_entry", {3, 3}}, {"intersect_return", {2}},
+        {"minus_entry", {3, 3}}, {"minus_return", {1}}
+    }));
+
+    ctx.result();
+}
+
+
+void test_hashcons(TestContext &ctx) {
+    using hc_set = HashConsTreeSet<int>;
+
+    ctx.DESC("Hash-consed sets match std::set under random add/del");
+    {
+        hc_set s;
+        set<int> expected;
+        mt19937 rng(21);
+        for (int i = 0; i < 5000; i++) {
+            int v = rng() % 300;
+            if (rng() % 3 == 0)
+                ctx.CHECK(s.del(v) == (expected.erase(v) == 1));
+            else
+                ctx.CHECK(s.add(v) == expected.insert(v).second);
+        }
+
+        ctx.CHECK(s.size() == (int) expected.size());
+        ctx.CHECK(to_vector(s) ==
+                  vector<int>(expected.begin(), expected.end()));
+        for (int v = -1; v <= 300; v++)
+            ctx.CHECK(s.contains(v) == (expected.count(v) == 1));
+        ctx.CHECK(to_vector(s.to_treeset()) == to_vector(s));
+    }
+    ctx.CHECK(hc_set::distinct_nodes() == 0);       // All released again
+    ctx.result();
+
+    ctx.DESC("Hash-consed sets share identical subtrees");
+    {
+        // The same contents in any order are the very same tree
+        vector<int> values;
+        for (const counted_key &k : make_key_order(1000, "random"))
+            values.push_back(k.value);
+
+        hc_set a, b;
+        for (int v : values)
+            a.add(v);
+        for (auto it = values.rbegin(); it != values.rend(); ++it)
+            b.add(*it);
+        hc_set c(a.to_treeset());
+
+        ctx.CHECK(a == b);
+        ctx.CHECK(a == c);
+        ctx.CHECK(hc_set::distinct_nodes() == 1000);
+
+        // 100 variants that each differ in a few values add O(log n) nodes each
+        vector<hc_set> variants;
+        for (int i = 0; i < 100; i++) {
+            hc_set v = a;
+            v.del(values[i]);
+            v.add(2000 + i);
+            ctx.CHECK(v != a);
+            ctx.CHECK(v.size() == 1000);
+            variants.push_back(v);
+        }
+        ctx.CHECK(hc_set::distinct_nodes() < 1000 + 100 * 4 * 10);
+
+        // Undoing the edits gets back to the shared original
+        hc_set undone = variants[7];
+        undone.del(2007);
+        undone.add(values[7]);
+        ctx.CHECK(undone == a);
+
+        hc_set empty1, empty2{5};
+        empty2.del(5);
+        ctx.CHECK(empty1 == empty2);
+    }
+    ctx.CHECK(hc_set::distinct_nodes() == 0);
+    ctx.result();
+}
+
+
+void test_soa_treeset(TestContext &ctx) {
+    ctx.DESC("SoATreeSet matches std::set under random add/del");
+    {
+        SoATreeSet<int> s;
+        set<int> expected;
+        mt19937 rng(22);
+        for (int i = 0; i < 20000; i++) {
+            int v = rng() % 500;
+            if (rng() % 3 == 0)
+                ctx.CHECK(s.del(v) == (expected.erase(v) == 1));
+            else
+                ctx.CHECK(s.add(v) == expected.insert(v).second);
+
+            if (i % 1000 == 0) {
+                ctx.CHECK(to_vector(s) ==
+                          vector<int>(expected.begin(), expected.end()));
+            }
+        }
+
+        ctx.CHECK(s.size() == (int) expected.size());
+        for (int v = -1; v <= 500; v++) {
+            ctx.CHECK(s.contains(v) == (expected.count(v) == 1));
+
+            auto lo = s.lower_bound(v), hi = s.upper_bound(v);
+            auto e_lo = expected.lower_bound(v), e_hi = expected.upper_bound(v);
+            ctx.CHECK((lo == s.end()) == (e_lo == expected.end()));
+            ctx.CHECK(lo == s.end() || *lo == *e_lo);
+            ctx.CHECK((hi == s.end()) == (e_hi == expected.end()));
+            ctx.CHECK(hi == s.end() || *hi == *e_hi);
+        }
+    }
+    ctx.result();
+
+    ctx.DESC("SoATreeSet keeps lookups O(log n) for sorted and zig-zag adds");
+    for (const string order : {"sorted", "zig-zag"}) {
+        const int n = 100000;
+        SoATreeSet<counted_key, counting_less> s;
+        for (const counted_key &k : make_key_order(n, order))
+            ctx.CHECK(s.add(k));
+
+        int max_lookup = (int) (log(n) / log(1.5)) + 2;
+        for (int i = -1; i <= n; i += 7) {
+            counting_less::calls = 0;
+            ctx.CHECK(s.contains({i}) == (i >= 0 && i < n));
+            ctx.CHECK(counting_less::calls <= max_lookup);
+        }
+
+        // Shrinking rebuilds the tree; what's left must still be in order
+        for (int i = 0; i < n; i += 3)
+            ctx.CHECK(s.del({i}));
+        ctx.CHECK(s.size() == n - (n + 2) / 3);
+
+        int prev = -1;
+        bool ordered = true;
+        for (auto it = s.begin(); it != s.end(); ++it) {
+            ordered = ordered && (*it).value > prev && (*it).value % 3 != 0;
+            prev = (*it).value;
+        }
+        ctx.CHECK(ordered);
+    }
+    ctx.result();
+
+    ctx.DESC("SoATreeSet set algebra, equality and output");
+    {
+        SoATreeSet<double, std::greater<double>> a{1.5, 2.5, 3.5, 4.5};
+        SoATreeSet<double, std::greater<double>> b{3.5, 4.5, 5.5};
+
+        ostringstream os;
+        os << a.plus(b) << a.intersect(b) << a.minus(b) << b.minus(a);
+        ctx.CHECK(os.str() == "[5.5,4.5,3.5,2.5,1.5][4.5,3.5][2.5,1.5][5.5]");
+
+        ctx.CHECK(a.plus(b) == b.plus(a));
+        ctx.CHECK(a.intersect(b) != a);
+        ctx.CHECK(a.minus(a).size() == 0);
+        ctx.CHECK(a.minus(a).begin() == a.minus(a).end());
+
+        // A set built by set algebra goes on accepting adds and deletes
+        SoATreeSet<double, std::greater<double>> c = a.plus(b);
+        ctx.CHECK(c.add(0.5));
+        ctx.CHECK(c.del(3.5));
+        ctx.CHECK(!c.del(3.5));
+        os.str("");
+        os << c;
+        ctx.CHECK(os.str() == "[5.5,4.5,2.5,1.5,0.5]");
+    }
+    ctx.result();
+}
+
+
+void test_chunked_serialization(TestContext &ctx) {
+    using codec = ChunkedTreeSetCodec<int>;
+
+    ctx.DESC("Chunked encoding round-trips any chunk size and thread count");
+    for (int n : {0, 1, 2, 7, 1000, 5000}) {
+        TreeSet<int> s;
+        for (const counted_key &k : make_key_order(n, "random"))
+            s.add(3 * k.value - n);
+
+        for (size_t chunk_values : {1, 3, 64, 1 << 16}) {
+            for (int threads : {1, 4}) {
+                vector<char> data = codec::encode(s, threads, chunk_values);
+                TreeSet<int> t{99};
+                ctx.CHECK(codec::decode(data.data(), data.size(), t, threads));
+                ctx.CHECK(t == s);
+                ctx.CHECK(t.size() == n);
+                ctx.CHECK(codec::encode(t, 1, chunk_values) == data);
+            }
+        }
+    }
+    ctx.result();
+
+    ctx.DESC("Chunked encoding skips tombstones and streams through iostreams");
+    {
+        TreeSet<int> s;
+        s.set_lazy_delete(true);
+        for (int i = 0; i < 5000; i++)
+            s.add(i);
+        for (int i = 0; i < 5000; i += 7)
+            s.del(i);
+
+        stringstream ss;
+        codec::write(ss, s, 3, 100);
+        TreeSet<int> t;
+        ctx.CHECK(codec::read(ss, t, 2));
+        ctx.CHECK(t == s);
+        ctx.CHECK(to_vector(t) == to_vector(s));
+
+        // A decoded set is an ordinary set
+        ctx.CHECK(t.add(7));
+        ctx.CHECK(t.del(8));
+        ctx.CHECK(t.contains(7) && !t.contains(8) && !t.contains(14));
+    }
+    ctx.result();
+
+    ctx.DESC("Decoded sets keep lookups O(log n)");
+    for (size_t chunk_values : {1, 2, 1000, 1 << 16}) {
+        const int n = 100000;
+        counted_set s;
+        for (const counted_key &k : make_key_order(n, "sorted"))
+            s.add(k);
+
+        using counted_codec = ChunkedTreeSetCodec<counted_key, counting_less>;
+        vector<char> data = counted_codec::encode(s, 2, chunk_values);
+        counted_set t;
+        ctx.CHECK(counted_codec::decode(data.data(), data.size(), t, 2));
+        ctx.CHECK(t.size() == n);
+
+        int max_lookup = (int) (log(n) / log(1.5)) + 2;
+        for (int i = -1; i <= n; i += 11) {
+            counting_less::calls = 0;
+            ctx.CHECK(t.contains({i}) == (i >= 0 && i < n));
+            ctx.CHECK(counting_less::calls <= max_lookup);
+        }
+    }
+    ctx.result();
+
+    ctx.DESC("Malformed chunked data is rejected without changing the set");
+    {
+        TreeSet<int> s;
+        for (int i = 0; i < 100; i++)
+            s.add(i);
+        const vector<char> good = codec::encode(s, 1, 16);
+
+        auto rejected = [&](const vector<char> &data) {
+            TreeSet<int> t{1, 2, 3};
+            bool ok = codec::decode(data.data(), data.size(), t);
+            return !ok && to_vector(t) == vector<int>({1, 2, 3});
+        };
+
+        // header (24 bytes), 7 index entries of 4 + 8 + 8 bytes, then values
+        const size_t values = 24 + 7 * 20;
+        vector<char> data = good;
+        data[0] = 'X';
+        ctx.CHECK(rejected(data));                          // bad magic
+
+        ctx.CHECK(rejected(vector<char>(good.begin(), good.end() - 1)));
+        ctx.CHECK(rejected(vector<char>(good.begin(), good.begin() + 10)));
+
+        data = good;
+        swap(data[values + 4], data[values + 8]);           // unsorted chunk
+        ctx.CHECK(rejected(data));
+
+        data = good;
+        data[values + 16 * 4] = 0;                          // index mismatch
+        ctx.CHECK(rejected(data));
+
+        data = good;                                        // chunks overlap
+        int value;
+        memcpy(&value, &data[values + 15 * 4], 4);
+        value = 16;
+        memcpy(&data[values + 15 * 4], &value, 4);
+        ctx.CHECK(rejected(data));
+
+        vector<char> wrong_size = ChunkedTreeSetCodec<long>::encode(
+            TreeSet<long>{1, 2});
+        ctx.CHECK(rejected(wrong_size));                    // not ints
+
+        using greater_codec = ChunkedTreeSetCodec<int, std::greater<int>>;
+        TreeSet<int, std::greater<int>> r;
+        bool ok = greater_codec::decode(good.data(), good.size(), r);
+        ctx.CHECK(!ok && r.size() == 0);                    // wrong order
+    }
+    ctx.result();
+
+    ctx.DESC("Chunked decoding failures on any thread reach the caller");
+    {
+        using fallible_codec = ChunkedTreeSetCodec<int, fallible_less>;
+        TreeSet<int> s;
+        for (int i = 0; i < 256; i++)
+            s.add(i);
+        const vector<char> data = codec::encode(s, 1, 16);
+
+        // Every thread checks the order of its chunks, so each failure point
+        // lands on one of the decoding threads
+        for (long fail_at : {0, 40, 100, 200}) {
+            TreeSet<int, fallible_less> t{1, 2, 3};
+            fallible_less::calls_left = fail_at;
+            bool threw = false;
+            try {
+                fallible_codec::decode(data.data(), data.size(), t, 4);
+            } catch (const bad_alloc &) {
+                threw = true;
+            }
+            fallible_less::calls_left = -1;
+
+            ctx.CHECK(threw && t.size() == 3 && t.contains(2));
+        }
+    }
+    ctx.result();
+}
+
+
+void test_treeset_view(TestContext &ctx) {
+    vector<int> evens, thirds;
+    for (int i = 0; i < 3000; i += 2)
+        evens.push_back(i);
+    for (int i = 0; i < 3000; i += 3)
+        thirds.push_back(i);
+
+    TreeSetView<int> view{evens};
+    TreeSet<int> evens_set, thirds_set;
+    for (int v : evens)
+        evens_set.add(v);
+    for (int v : thirds)
+        thirds_set.add(v);
+
+    ctx.DESC("TreeSetView answers queries like the TreeSet of its values");
+    {
+        ctx.CHECK(view.size() == evens_set.size());
+        ctx.CHECK(to_vector(view) == evens);
+        ctx.CHECK(view == evens_set && evens_set == view);
+        ctx.CHECK(view != thirds_set && thirds_set != view);
+        ctx.CHECK(view == TreeSetView<int>(evens));
+        ctx.CHECK(view != TreeSetView<int>(thirds));
+
+        for (int v = -2; v <= 3001; v++) {
+            ctx.CHECK(view.contains(v) == evens_set.contains(v));
+
+            auto lo = view.lower_bound(v), hi = view.upper_bound(v);
+            auto s_lo = evens_set.lower_bound(v), s_hi = evens_set.upper_bound(v);
+            ctx.CHECK((lo == view.end()) == (s_lo == evens_set.end()));
+            ctx.CHECK(lo == view.end() || *lo == *s_lo);
+            ctx.CHECK((hi == view.end()) == (s_hi == evens_set.end()));
+            ctx.CHECK(hi == view.end() || *hi == *s_hi);
+        }
+
+        vector<int> buffer(8), expected(8);
+        ctx.CHECK(view.copy_range(11, 21, buffer) == 5);
+        ctx.CHECK(evens_set.copy_range(11, 21, expected) == 5);
+        ctx.CHECK(buffer == expected);
+        ctx.CHECK(view.copy_range(0, 3000, buffer) == 8);
+
+        ostringstream os;
+        os << TreeSetView<int>(span<const int>(evens).first(4))
+           << TreeSetView<int>();
+        ctx.CHECK(os.str() == "[0,2,4,6][]");
+    }
+    ctx.result();
+
+    ctx.DESC("TreeSetView queries do not allocate");
+    {
+        AllocCounter counter;
+        TreeSetView<int> copy = view;
+        int found = 0;
+        for (int v = 0; v < 3000; v++)
+            found += copy.contains(v);
+        found += *view.lower_bound(100) + *view.upper_bound(100);
+        found += (view == evens_set) + (view == copy);
+        ctx.CHECK(counter.allocs() == 0);
+        ctx.CHECK(found == 1500 + 100 + 102 + 2);
+    }
+    ctx.result();
+
+    ctx.DESC("Set algebra mixes TreeSetViews and TreeSets");
+    {
+        TreeSetView<int> thirds_view{thirds};
+
+        ctx.CHECK(view.plus(thirds_set) == evens_set.plus(thirds_set));
+        ctx.CHECK(view.intersect(thirds_set) == evens_set.intersect(thirds_set));
+        ctx.CHECK(view.minus(thirds_set) == evens_set.minus(thirds_set));
+
+        ctx.CHECK(thirds_set.plus(view) == thirds_set.plus(evens_set));
+        ctx.CHECK(thirds_set.intersect(view) ==
+                  thirds_set.intersect(evens_set));
+        ctx.CHECK(thirds_set.minus(view) == thirds_set.minus(evens_set));
+
+        ctx.CHECK(view.plus(thirds_view) == evens_set.plus(thirds_set));
+        ctx.CHECK(view.intersect(thirds_view).size() == 500);
+        ctx.CHECK(view.minus(thirds_view) == evens_set.minus(thirds_set));
+        ctx.CHECK(view.minus(view).size() == 0);
+
+        // The results are ordinary sets
+        TreeSet<int> u = view.plus(thirds_set);
+        ctx.CHECK(u.add(1) && u.del(0));
+        ctx.CHECK(u.size() == 2000);
+    }
+    ctx.result();
+
+    ctx.DESC("TreeSetView works with comparators and prefix_range");
+    {
+        const double descending[] = {4.5, 3.5, 2.5};
+        TreeSetView<double, std::greater<double>> d{descending};
+        TreeSet<double, std::greater<double>> s{3.5, 1.5};
+        ostringstream os;
+        os << d.plus(s) << s.minus(d) << d.intersect(s);
+        ctx.CHECK(os.str() == "[4.5,3.5,2.5,1.5][1.5][3.5]");
+        ctx.CHECK(d.lower_bound(3.0) != d.end() && *d.lower_bound(3.0) == 2.5);
+
+        using row = tuple<int, int>;
+        vector<row> rows = {{1, 5}, {2, 1}, {2, 4}, {2, 9}, {3, 0}};
+        TreeSetView<row> r{rows};
+        ctx.CHECK(r.prefix_range(2).size() == 3);
+        ctx.CHECK(r.prefix_range(2, column_range{2, 9}) ==
+                  TreeSetView<row>(span<const row>(rows).subspan(2, 1)));
+        ctx.CHECK(r.prefix_range(4).size() == 0);
+    }
+    ctx.result();
+
+    ctx.DESC("Set algebra mixes TreeSetViews and bitmap TreeSets");
+    {
+        const uint8_t low[] = {1, 2, 3, 200};
+        TreeSetView<uint8_t> v{low};
+        TreeSet<uint8_t> s{2, 3, 4, 255};
+
+        ctx.CHECK(v.plus(s) == TreeSet<uint8_t>({1, 2, 3, 4, 200, 255}));
+        ctx.CHECK(v.intersect(s) == TreeSet<uint8_t>({2, 3}));
+        ctx.CHECK(v.minus(s) == TreeSet<uint8_t>({1, 200}));
+        ctx.CHECK(s.plus(v) == v.plus(s));
+        ctx.CHECK(s.intersect(v) == v.intersect(s));
+        ctx.CHECK(s.minus(v) == TreeSet<uint8_t>({4, 255}));
+        ctx.CHECK(v.plus(v) == v && v.minus(v).size() == 0);
+
+        ctx.CHECK(s != v && v != s);
+        TreeSet<uint8_t> same{200, 3, 2, 1};
+        ctx.CHECK(same == v && v == same);
+
+        const int16_t descending[] = {500, -7, -300};
+        TreeSetView<int16_t, std::greater<int16_t>> d{descending};
+        TreeSet<int16_t, std::greater<int16_t>> t{-7, 0};
+        ostringstream os;
+        os << d.plus(t) << t.minus(d) << d.intersect(t);
+        ctx.CHECK(os.str() == "[500,0,-7,-300][0][-7]");
+    }
+    ctx.result();
+}
+
+
+void test_adaptive_treeset(TestContext &ctx) {
+    using adaptive = AdaptiveTreeSet<int>;
+
+    ctx.DESC("AdaptiveTreeSet matches std::set through every representation");
+    {
+        mt19937 rng(122);
+        adaptive s;
+        set<int> expected;
+        bool seen[3] = {false, false, false};
+
+        // Grow past the inline array, read until frozen, then shrink again
+        for (int round = 0; round < 3; round++) {
+            for (int i = 0; i < 400; i++) {
+                int v = (int) (rng() % 1000);
+                ctx.CHECK(s.add(v) == expected.insert(v).second);
+            }
+            for (int i = 0; i < 3000; i++) {
+                int v = (int) (rng() % 1000);
+                ctx.CHECK(s.contains(v) == (expected.count(v) == 1));
+                seen[s.current_representation()] = true;
+            }
+            ctx.CHECK(s.current_representation() == adaptive::FROZEN);
+            ctx.CHECK(to_vector(s) ==
+                      vector<int>(expected.begin(), expected.end()));
+
+            for (int v = -1; v <= 1000; v++) {
+                auto lo = s.lower_bound(v), hi = s.upper_bound(v);
+                auto e_lo = expected.lower_bound(v);
+                auto e_hi = expected.upper_bound(v);
+                ctx.CHECK((lo == s.end()) == (e_lo == expected.end()));
+                ctx.CHECK(lo == s.end() || *lo == *e_lo);
+                ctx.CHECK((hi == s.end()) == (e_hi == expected.end()));
+                ctx.CHECK(hi == s.end() || *hi == *e_hi);
+            }
+
+            while (expected.size() > 5) {
+                int v = (int) (rng() % 1000);
+                ctx.CHECK(s.del(v) == (expected.erase(v) == 1));
+            }
+            ctx.CHECK(s.current_representation() == adaptive::INLINE);
+            ctx.CHECK(s.size() == 5);
+            ctx.CHECK(to_vector(s) ==
+                      vector<int>(expected.begin(), expected.end()));
+            seen[s.current_representation()] = true;
+        }
+
+        ctx.CHECK(seen[adaptive::INLINE] && seen[adaptive::TREE] &&
+                  seen[adaptive::FROZEN]);
+    }
+    ctx.result();
+
+    ctx.DESC("AdaptiveTreeSet switches representation at its thresholds");
+    {
+        adaptive s;
+        int v = 0;
+        while (s.current_representation() == adaptive::INLINE)
+            s.add(v++);
+        ctx.CHECK(v == 33);    // 32 ints fit inline
+
+        // A change to a frozen set drops back to the tree
+        for (int i = 0; i < 2 * 33; i++)
+            s.contains(i);
+        ctx.CHECK(s.current_representation() == adaptive::FROZEN);
+
+        // Adding a value already there, or deleting a missing one, is no change
+        ctx.CHECK(!s.add(5) && !s.del(1000));
+        ctx.CHECK(s.current_representation() == adaptive::FROZEN);
+
+        auto it = s.begin();
+        ctx.CHECK(s.add(-1));
+        ctx.CHECK(s.current_representation() == adaptive::TREE);
+        ctx.CHECK(*s.begin() == -1);
+
+        // Freezing leaves existing iterators usable
+        it = s.begin();
+        for (int i = 0; i < 2 * 34; i++)
+            s.contains(i);
+        ctx.CHECK(s.current_representation() == adaptive::FROZEN);
+        int count = 0;
+        for (; it != s.end(); ++it)
+            count++;
+        ctx.CHECK(count == 34);
+
+        // The tree only shrinks back once half the inline array would do
+        for (int i = -1; i < 17; i++)
+            s.del(i);
+        ctx.CHECK(s.size() == 16);
+        ctx.CHECK(s.current_representation() == adaptive::INLINE);
+    }
+    ctx.result();
+
+    ctx.DESC("AdaptiveTreeSet equality, set algebra, copies and output");
+    {
+        adaptive tiny{4, 2, 6}, evens, thirds;
+        TreeSet<int> evens_set, thirds_set;
+        for (int i = 0; i < 600; i += 2) {
+            evens.add(i);
+            evens_set.add(i);
+        }
+        for (int i = 0; i < 600; i += 3) {
+            thirds.add(i);
+            thirds_set.add(i);
+        }
+        for (int i = 0; i < 2000; i++)
+            thirds.contains(i);
+        ctx.CHECK(thirds.current_representation() == adaptive::FROZEN);
+
+        auto same = [](const adaptive &a, const TreeSet<int> &b) {
+            return to_vector(a) == to_vector(b);
+        };
+        ctx.CHECK(same(evens.plus(thirds), evens_set.plus(thirds_set)));
+        ctx.CHECK(same(evens.intersect(thirds),
+                       evens_set.intersect(thirds_set)));
+        ctx.CHECK(same(thirds.minus(evens), thirds_set.minus(evens_set)));
+        ctx.CHECK(evens.plus(tiny) == evens);
+        ctx.CHECK(tiny.intersect(thirds) ==
+                  adaptive({6}));
+        ctx.CHECK(tiny.minus(evens).size() == 0);
+        ctx.CHECK(tiny.plus(adaptive{1}).current_representation() ==
+                  adaptive::INLINE);
+
+        adaptive copy = thirds;
+        ctx.CHECK(copy == thirds);
+        ctx.CHECK(copy.del(0) && copy != thirds);
+        ctx.CHECK(thirds.contains(0));
+        ctx.CHECK(evens != thirds);
+        ctx.CHECK(tiny == adaptive({2, 4, 6}));
+
+        AdaptiveTreeSet<double, std::greater<double>> d{1.5, 3.5, 2.5};
+        ostringstream os;
+        os << tiny << d << adaptive();
+        ctx.CHECK(os.str() == "[2,4,6][3.5,2.5,1.5][]");
+    }
+    ctx.result();
+
+    ctx.DESC("Tiny AdaptiveTreeSets do not allocate");
+    {
+        AllocCounter counter;
+        adaptive s;
+        for (int i = 0; i < 32; i++)
+            s.add(31 - i);
+        int found = 0;
+        for (int i = 0; i < 64; i++)
+            found += s.contains(i);
+        s.del(7);
+        ctx.CHECK(counter.allocs() == 0);
+        ctx.CHECK(found == 32);
+    }
+    ctx.result();
+}
+
+
+void test_similarity_join(TestContext &ctx) {
+    using join = TreeSetSimilarityJoin<int>;
+
+    // Families of near-duplicates of random base sets, plus unrelated sets
+    mt19937 rng(123);
+    vector<TreeSet<int>> sets;
+    for (int family = 0; family < 40; family++) {
+        TreeSet<int> base;
+        int size = 1 + (int) (rng() % 30);
+        while (base.size() < size)
+            base.add((int) (rng() % 400));
+
+        for (int copy = 0; copy < 6; copy++) {
+            TreeSet<int> s = base;
+            for (int change = (int) (rng() % 4); change > 0; change--) {
+                if (rng() % 2)
+                    s.add((int) (rng() % 400));
+                else
+                    s.del((int) (rng() % 400));
+            }
+            sets.push_back(s);
+        }
+    }
+    sets.push_back(TreeSet<int>());
+    sets.push_back(TreeSet<int>());
+    sets.push_back(sets[5]);
+
+    auto brute_force = [&](double threshold) {
+        vector<pair<size_t, size_t>> pairs;
+        for (size_t a = 0; a < sets.size(); a++) {
+            for (size_t b = a + 1; b < sets.size(); b++) {
+                int shared = sets[a].intersect(sets[b]).size();
+                int either = sets[a].size() + sets[b].size() - shared;
+                if (either > 0 && shared >= threshold * either - 1e-9)
+                    pairs.push_back({a, b});
+            }
+        }
+        return pairs;
+    };
+
+    ctx.DESC("Similarity join finds the same pairs as comparing every pair");
+    {
+        for (double threshold : {0.3, 0.5, 0.75, 0.9, 1.0}) {
+            vector<pair<size_t, size_t>> expected = brute_force(threshold);
+            for (int threads : {1, 3}) {
+                vector<treeset_similar_pair> found =
+                    join::join(sets, threshold, threads);
+
+                vector<pair<size_t, size_t>> pairs;
+                bool similar = true;
+                for (const treeset_similar_pair &p : found) {
+                    pairs.push_back({p.first, p.second});
+                    int shared = sets[p.first].intersect(sets[p.second]).size();
+                    double jaccard = (double) shared /
+                        (sets[p.first].size() + sets[p.second].size() - shared);
+                    similar = similar && abs(p.jaccard - jaccard) < 1e-12;
+                }
+                ctx.CHECK(pairs == expected);
+                ctx.CHECK(similar);
+            }
+            ctx.CHECK(expected.size() > 0);
+        }
+    }
+    ctx.result();
+
+    ctx.DESC("Similarity join handles identical, empty and few sets");
+    {
+        vector<treeset_similar_pair> same = join::join(sets, 1.0);
+        bool found_copy = false;
+        for (const treeset_similar_pair &p : same) {
+            if (p.first == 5 && p.second == sets.size() - 1)
+                found_copy = true;
+        }
+        ctx.CHECK(found_copy);
+
+        ctx.CHECK(join::join(vector<TreeSet<int>>(), 0.5, 4).empty());
+        ctx.CHECK(join::join(vector<TreeSet<int>>(3), 0.5).empty());
+
+        vector<TreeSet<int>> two = {{1, 2, 3, 4}, {2, 3, 4, 5}};
+        ctx.CHECK(join::join(two, 0.6).size() == 1);
+        ctx.CHECK(join::join(two, 0.6)[0].jaccard == 0.6);
+        ctx.CHECK(join::join(two, 0.61).empty());
+
+        using desc_join = TreeSetSimilarityJoin<string, std::greater<string>>;
+        vector<TreeSet<string, std::greater<string>>> words = {
+            {"a", "b", "c"}, {"x", "y"}, {"a", "b", "c", "d"}};
+        vector<treeset_similar_pair> w = desc_join::join(words, 0.7, 2);
+        ctx.CHECK(w.size() == 1 && w[0].first == 0 && w[0].second == 2);
+    }
+    ctx.result();
+}
+
+
+void test_quantile_sketch(TestContext &ctx) {
+    const int n = 5000;
+    const double tolerance = 0.03 * n;
+
+    // Exact rank and quantile answers from the values in sorted order
+    auto rank_error = [](const TreeSet<int> &s, const vector<int> &sorted) {
+        double worst = 0;
+        for (int i = 0; i <= 100; i++) {
+            int x = i * 1000 - 500;
+            int exact = (int) (lower_bound(sorted.begin(), sorted.end(), x) -
+                               sorted.begin());
+            worst = max(worst, (double) abs(s.approx_rank(x) - exact));
+        }
+        return worst;
+    };
+    auto quantile_error = [](const TreeSet<int> &s, const vector<int> &sorted) {
+        double worst = 0;
+        for (int i = 0; i <= 20; i++) {
+            double q = i / 20.0;
+            int v = s.approx_quantile(q);
+            int exact = (int) (lower_bound(sorted.begin(), sorted.end(), v) -
+                               sorted.begin());
+            worst = max(worst, abs(exact - q * sorted.size()));
+        }
+        return worst;
+    };
+
+    mt19937 rng(124);
+    vector<int> values;
+    for (int i = 0; i < n; i++)
+        values.push_back((int) (rng() % 100000));
+
+    ctx.DESC("Quantile sketch estimates ranks and quantiles as values arrive");
+    {
+        TreeSet<int> s;
+        ctx.CHECK(!s.has_sketch());
+        s.enable_sketch();
+        ctx.CHECK(s.has_sketch());
+        for (int v : values)
+            s.add(v);
+
+        vector<int> sorted;
+        for (int v : s)
+            sorted.push_back(v);
+        ctx.CHECK(rank_error(s, sorted) <= tolerance);
+        ctx.CHECK(quantile_error(s, sorted) <= tolerance);
+        ctx.CHECK(s.approx_rank(-1) == 0);
+        ctx.CHECK(s.approx_rank(100000) == s.size());
+        ctx.CHECK(s.contains(s.approx_quantile(0)));
+        ctx.CHECK(s.contains(s.approx_quantile(1)));
+
+        // A sketch enabled on a full set starts from its values
+        TreeSet<int> later;
+        for (int v : values)
+            later.add(v);
+        later.enable_sketch();
+        ctx.CHECK(rank_error(later, sorted) <= tolerance);
+    }
+    ctx.result();
+
+    ctx.DESC("Quantile sketch stays accurate through heavy deletes");
+    {
+        for (bool lazy : {false, true}) {
+            TreeSet<int> s;
+            s.set_lazy_delete(lazy);
+            s.enable_sketch();
+            for (int v : values)
+                s.add(v);
+
+            // Delete most of the low values, one at a time and in a batch
+            TreeSet<int>::WriteBatch batch;
+            for (int v : values) {
+                if (v < 50000 && v % 10 != 0) {
+                    if (v % 2)
+                        s.del(v);
+                    else
+                        batch.del(v);
+                }
+            }
+            s.apply(batch);
+
+            vector<int> sorted;
+            for (int v : s)
+                sorted.push_back(v);
+            ctx.CHECK(rank_error(s, sorted) <= 0.03 * sorted.size());
+            ctx.CHECK(quantile_error(s, sorted) <= 0.03 * sorted.size());
+        }
+    }
+    ctx.result();
+
+    ctx.DESC("Quantile sketch follows copies, clear() and decoding");
+    {
+        TreeSet<int> s{5, 1, 3};
+        s.enable_sketch();
+        TreeSet<int> copy = s;
+        ctx.CHECK(copy.has_sketch() && copy.approx_rank(4) == 2);
+        copy.add(0);
+        ctx.CHECK(copy.approx_rank(4) == 3 && s.approx_rank(4) == 2);
+
+        s.clear();
+        ctx.CHECK(s.has_sketch() && s.approx_rank(4) == 0);
+        s.add(7);
+        ctx.CHECK(s.approx_quantile(0.5) == 7);
+
+        vector<char> data = ChunkedTreeSetCodec<int>::encode(copy);
+        ctx.CHECK(ChunkedTreeSetCodec<int>::decode(data.data(), data.size(), s));
+        ctx.CHECK(s.approx_rank(4) == 3);
+
+        s.disable_sketch();
+        ctx.CHECK(!s.has_sketch() && !copy.plus(s).has_sketch());
+    }
+    ctx.result();
+
+    ctx.DESC("Quantile sketch memory does not grow with the set");
+    {
+        treeset_kll_sketch<int> small, large;
+        for (int i = 0; i < 10000; i++)
+            small.add(i);
+        for (int i = 0; i < 1000000; i++)
+            large.add((int) (rng() % 1000000));
+        ctx.CHECK(small.retained() <= 600 && large.retained() <= 700);
+        ctx.CHECK(large.count() == 1000000);
+        ctx.CHECK(abs(large.rank(500000) - 500000) <= 0.015 * 1000000);
+    }
+    ctx.result();
+
+    ctx.DESC("Bitmap sets answer ranks and quantiles exactly");
+    {
+        TreeSet<short> s{-300, -2, 7, 100, 5000};
+        ctx.CHECK(!s.has_sketch());
+        s.enable_sketch();
+        ctx.CHECK(s.has_sketch());
+        ctx.CHECK(s.approx_rank(-300) == 0 && s.approx_rank(7) == 2);
+        ctx.CHECK(s.approx_rank(101) == 4 && s.approx_rank(32767) == 5);
+        ctx.CHECK(s.approx_quantile(0) == -300);
+        ctx.CHECK(s.approx_quantile(0.5) == 7);
+        ctx.CHECK(s.approx_quantile(1) == 5000);
+
+        TreeSet<uint8_t, std::greater<uint8_t>> d{1, 2, 200};
+        ctx.CHECK(d.approx_rank(2) == 1 && d.approx_quantile(0.3) == 200);
+
+        // Ranks stay exact without a sketch; disabling only clears the flag
+        s.disable_sketch();
+        ctx.CHECK(!s.has_sketch() && s.approx_rank(7) == 2);
+    }
+    ctx.result();
+}
+
+
+void test_string_prefixes(TestContext &ctx) {
+    // Strings built to tie, and nearly tie, in their first 8 bytes: shared
+    // stems, embedded zero bytes, high bytes and short strings
+    mt19937 rng(125);
+    const string stems[] = {"", "a", "abcdefg", "abcdefgh", "abcdefgh/xyz",
+                            string("ab\0\0", 4), "\xff\xfe", "zzzzzzzzzz"};
+    auto random_string = [&]() {
+        string s = stems[rng() % 8];
+        for (int n = (int) (rng() % 4); n > 0; n--)
+            s += "\0\x01" "ab\xff"[rng() % 5];
+        return s;
+    };
+
+    ctx.DESC("String key prefixes order like the strings they come from");
+    {
+        using prefix = treeset_key_prefix<string, std::less<string>>;
+        using reversed = treeset_key_prefix<string, std::greater<string>>;
+        bool consistent = true;
+        for (int i = 0; i < 20000; i++) {
+            string a = random_string(), b = random_string();
+            if (prefix::of(a) < prefix::of(b) && !(a < b))
+                consistent = false;
+            if (reversed::of(a) < reversed::of(b) && !(a > b))
+                consistent = false;
+        }
+        ctx.CHECK(consistent);
+        ctx.CHECK(prefix::of("abcdefgh") == prefix::of("abcdefghij"));
+        ctx.CHECK(prefix::of("ab") < prefix::of("ab\x01"));
+        ctx.CHECK(prefix::of("\x7f") < prefix::of("\x80"));
+        bool views = has_key_prefix<string_view, std::less<string_view>>;
+        ctx.CHECK(views);
+    }
+    ctx.result();
+
+    ctx.DESC("TreeSet<string> with key prefixes matches std::set");
+    {
+        TreeSet<string> s;
+        TreeSet<string, std::greater<string>> d;
+        set<string> expected;
+        for (int i = 0; i < 3000; i++) {
+            string v = random_string();
+            if (rng() % 3 == 0) {
+                bool erased = expected.erase(v) == 1;
+                ctx.CHECK(s.del(v) == erased);
+                ctx.CHECK(d.del(v) == erased);
+            } else {
+                bool inserted = expected.insert(v).second;
+                ctx.CHECK(s.add(v) == inserted);
+                ctx.CHECK(d.add(v) == inserted);
+            }
+            string probe = random_string();
+            ctx.CHECK(s.contains(probe) == (expected.count(probe) == 1));
+            ctx.CHECK(d.contains(probe) == (expected.count(probe) == 1));
+        }
+
+        vector<string> values, descending;
+        for (const string &v : s)
+            values.push_back(v);
+        for (const string &v : d)
+            descending.push_back(v);
+        ctx.CHECK(values == vector<string>(expected.begin(), expected.end()));
+        ctx.CHECK(descending ==
+                  vector<string>(expected.rbegin(), expected.rend()));
+        ctx.CHECK(TreeSet<string>(s) == s);
+    }
+    ctx.result();
+}
+
+
+/*! This program is a simple test-suite for the TreeSet class. */
+int main() {
+
+    cout << "Testing the TreeSet class." << endl << endl;
+
+    TestContext ctx(cout);
+
+    test_treeset_default_ctor(ctx);
+    test_basic_add_contains_size(ctx);
+    test_basic_add_del_2(ctx);
+    test_add_del_brute_force(ctx);
+    test_random_stress(ctx);
+    test_complexity(ctx);
+
+    test_treeset_copy_ctor(ctx);
+    test_treeset_copy_assign(ctx);
+
+    test_iter_basic(ctx);
+    test_iter_brute_force(ctx);
+
+    test_initializer_lists(ctx);
+
+    test_basic_equality(ctx);
+    test_equal_brute_force(ctx);
+
+    test_basic_ostream(ctx);
+    test_basic_ostream_greater(ctx);
+    test_ostream_brute_force(ctx);
+
+    test_set_ops<std::less<int>>(ctx, "std::less");
+    test_set_ops<std::greater<int>>(ctx, "std::greater");
+
+    test_bounds(ctx);
+    test_batch_iteration(ctx);
+    test_prefix_range(ctx);
+    test_bitmap_sets(ctx);
+    test_out_of_line_values(ctx);
+    test_const_equality(ctx);
+
+    test_lazy_delete(ctx);
+
+    test_buffered_treeset(ctx);
+    test_write_batch(ctx);
+
+    test_allocation_budgets(ctx);
+
+    test_trace_replay(ctx);
+    test_probes(ctx);
+
+    test_hashcons(ctx);
+    test_soa_treeset(ctx);
+    test_chunked_serialization(ctx);
+    test_treeset_view(ctx);
+    test_adaptive_treeset(ctx);
+    test_similarity_join(ctx);
+    test_quantile_sketch(ctx);
+    test_string_prefixes(ctx);
 
     // Return 0 if everything passed, nonzero if something failed.
     return !ctx.ok();
@@ -33,31 +33,34 @@ void TestContext::desc(const string &msg, int line) {
     
     lastline = line;
     skip = true;
+    testbadlines.clear();
 }
 
 
 void TestContext::check(bool test, int line) {
-    if (!test)
+    if (!test) {
+        lock_guard<mutex> lock(badlines_mutex);
         badlines.insert(line);
+        testbadlines.insert(line);
+    }
 }
 
 
 void TestContext::result() {
     assert(lastline != 0);
     
-    // See if we haven't added any more values to the badlines collection
-    auto iter = badlines.lower_bound(lastline);
-    if (iter == badlines.end()) {
+    // See if any checks failed since the test began, including checks in
+    // helper functions defined above the test
+    lock_guard<mutex> lock(badlines_mutex);
+    if (testbadlines.empty()) {
         os << "ok" << '\n';
         passed++;
     }
     else {
         os << "ERROR\n";
         
-        while (iter != badlines.end()) {
-            os << "\tFailure detected on line " << *iter << '\n';
-            iter++;
-        }
+        for (int line : testbadlines)
+            os << "\tFailure detected on line " << line << '\n';
     }
     
     total++;
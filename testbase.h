@@ -3,6 +3,7 @@
 
 
 #include <iostream>
+#include <mutex>
 #include <set>
 #include <string>
 #include <cmath>
@@ -16,7 +17,9 @@ class TestContext {                         // displays test results
     int total;                              // total # of tests
     int lastline;                           // line # of most recent test
     set<int> badlines;                      // line #'s of failed tests
+    set<int> testbadlines;                  // ... failed in the current test
     bool skip;                              // skip a line before title?
+    mutex badlines_mutex;                   // guards failures from threads
 
 public:
     TestContext(ostream &os);               // write header to stream
@@ -24,6 +27,7 @@ public:
 
     void desc(const string &msg, int line); // write line/description
     void check(bool test, int line);        // record if a check passes
+                                            // (safe to call from threads)
 
     void result();                          // write test result
     bool ok() const;                        // true iff all tests passed
@@ -0,0 +1,607 @@
+#ifndef TREESET_BITMAP_HH
+#define TREESET_BITMAP_HH
+
+/*!
+Specialization of TreeSet (and TreeSetIter) for keys with a small domain:
+integer types of at most 16 bits, and enums whose underlying type is that
+small, ordered by std::less or std::greater. Such a set needs no tree at all;
+it is a fixed bitmap with one bit per possible key (32 bytes for 8-bit keys,
+8 KiB for 16-bit keys). add(), del() and contains() are single bit operations,
+iteration finds the next set bit with count-trailing-zeros, and plus(),
+intersect() and minus() are word-parallel OR, AND and AND-NOT loops (a
+TreeSetView operand is first read into a bitmap).
+
+The specialization has the same interface as TreeSet, with one difference: a
+bitmap holds no key objects to refer to, so its iterators' operator* returns
+each key by value rather than by reference. Since a bitmap never has
+tombstones, lazy deletion is accepted but changes nothing. This header is
+included by treeset.h; it is not meant to be included on its own.
+*/
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <type_traits>
+
+//! Keys whose every possible value gets its own bit
+template <typename T>
+concept bitmap_key =
+  (std::is_integral_v<T> && !std::is_same_v<T, bool> && sizeof(T) <= 2) ||
+  (std::is_enum_v<T> && sizeof(T) <= 2);
+
+//! Sets that are stored as bitmaps: small keys in ascending/descending order
+template <typename T, typename Compare>
+concept bitmap_key_set =
+  bitmap_key<T> &&
+  (std::is_same_v<Compare, std::less<T>> ||
+   std::is_same_v<Compare, std::greater<T>>);
+
+/*!
+Maps the keys of a bitmap set to bit positions, so that the set's order is the
+order of the positions.
+*/
+template <typename T, typename Compare>
+struct bitmap_domain {
+  using key_type = typename std::conditional_t<std::is_enum_v<T>,
+                                               std::underlying_type<T>,
+                                               std::type_identity<T>>::type;
+  using bits_type = std::make_unsigned_t<key_type>;
+
+  //! Number of possible keys, and of 64-bit words to hold one bit for each
+  static constexpr std::size_t SIZE = std::size_t{1} << (8 * sizeof(T));
+  static constexpr std::size_t WORDS = (SIZE + 63) / 64;
+
+  //! Flipping the sign bit puts signed keys in order, negatives first
+  static constexpr bits_type SIGN_FLIP = std::is_signed_v<key_type> ?
+    bits_type(bits_type(1) << (8 * sizeof(T) - 1)) : bits_type(0);
+
+  static constexpr bool DESCENDING = std::is_same_v<Compare, std::greater<T>>;
+
+  //! Returns the bit position of key.
+  static std::size_t position(T key) {
+    std::size_t pos = bits_type((bits_type) (key_type) key ^ SIGN_FLIP);
+    return DESCENDING ? SIZE - 1 - pos : pos;
+  }
+
+  //! Returns the key at bit position pos.
+  static T key_at(std::size_t pos) {
+    if (DESCENDING)
+      pos = SIZE - 1 - pos;
+    return (T) (key_type) bits_type((bits_type) pos ^ SIGN_FLIP);
+  }
+
+  /*! Returns the first position at or after pos whose bit is set in words,
+    or SIZE if there is none.
+  */
+  static std::size_t next_set(const uint64_t *words, std::size_t pos) {
+    if (pos >= SIZE)
+      return SIZE;
+
+    std::size_t w = pos / 64;
+    uint64_t bits = words[w] & (~uint64_t(0) << (pos % 64));
+    while (bits == 0) {
+      if (++w == WORDS)
+        return SIZE;
+      bits = words[w];
+    }
+
+    return w * 64 + std::countr_zero(bits);
+  }
+};
+
+/***************** Begin bitmap TreeSetIter declaration  ****************/
+
+/*! TreeSetIter for bitmap sets: the position of the current key's bit, or
+  bitmap_domain::SIZE at the end. As with the tree iterator, it is only valid
+  while the set it came from is alive and unmodified.
+*/
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+class TreeSetIter<T, Compare> {
+  using domain = bitmap_domain<T, Compare>;
+
+  const uint64_t *_words = nullptr;
+  std::size_t _pos = domain::SIZE;
+
+  //! Moves to the first key at or after position pos.
+  void seek(std::size_t pos);
+
+  //! As a friend, TreeSet can position iterators
+  friend class TreeSet<T, Compare>;
+
+public:
+  //! Default constructor makes an "end" iterator
+  TreeSetIter() { };
+
+  //! Pre-increment operator returns a ref to the iterator that was incremented.
+  TreeSetIter<T, Compare>& operator++() {
+    seek(_pos + 1);
+    return *this;
+  };
+
+  //! Post-increment operator returns a copy of the iterator before incremented.
+  TreeSetIter<T, Compare> operator++(int) {
+    TreeSetIter<T, Compare> it = *this;
+    ++(*this);
+    return it;
+  };
+
+  /*! Dereference returns (a copy of) the key the iterator is at. Unlike a
+    tree iterator's, the result is not a reference into the set.
+  */
+  T operator*() const { return domain::key_at(_pos); };
+
+  /*! Copies keys, starting with the current one, into out until it is full
+    or the set runs out, advancing the iterator past each key copied. Returns
+    how many keys were copied.
+  */
+  std::size_t next_batch(std::span<T> out);
+
+  //! Compares the positions of the iterators
+  bool operator==(const TreeSetIter<T, Compare> &rhs) const {
+    return _pos == rhs._pos;
+  };
+
+  //! Inverse of ==
+  bool operator!=(const TreeSetIter<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+};
+
+/***************** End bitmap TreeSetIter declaration  ****************/
+
+/***************** Begin bitmap TreeSet declaration  ****************/
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+class TreeSet<T, Compare> {
+  using domain = bitmap_domain<T, Compare>;
+
+  //! One bit per possible key, in the set's order
+  std::array<uint64_t, domain::WORDS> _words{};
+
+  //! Number of elements in the set
+  int _size = 0;
+
+  //! Whether enable_sketch() is in effect, as has_sketch() reports
+  bool _sketch_enabled = false;
+
+  //! Sets or clears the bit for value, returning true if it changed.
+  bool set_bit(const T &value, bool present);
+
+  //! Applies sorted ops, as TreeSet::apply_sorted() on a tree does.
+  void apply_sorted(const std::vector<std::pair<T, bool>> &ops);
+
+  //! Recounts _size after the words were computed wholesale.
+  void recount();
+
+  //! Returns an iterator to the first key at or after bit position pos.
+  TreeSetIter<T, Compare> lower_bound_at(std::size_t pos) const;
+
+  //! A bitmap operand is used as it is...
+  static const TreeSet<T, Compare>& bitmap_of(const TreeSet<T, Compare> &s) {
+    return s;
+  };
+
+  //! ...and any other sorted set (a TreeSetView) is read into a bitmap.
+  template <typename A>
+  static TreeSet<T, Compare> bitmap_of(const A &a);
+
+  /*! The set algebra behind plus(), intersect() and minus(), for any two
+    sets a and b (bitmap TreeSets or TreeSetViews), as on a tree TreeSet.
+  */
+  template <typename A, typename B>
+  static TreeSet<T, Compare> union_of(const A &a, const B &b);
+
+  template <typename A, typename B>
+  static TreeSet<T, Compare> intersection_of(const A &a, const B &b);
+
+  template <typename A, typename B>
+  static TreeSet<T, Compare> difference_of(const A &a, const B &b);
+
+public:
+  //! As a friend, TreeSetIter can read the bitmap
+  friend class TreeSetIter<T, Compare>;
+
+  //! BufferedTreeSet flushes its write buffer through apply_sorted()
+  friend class BufferedTreeSet<T, Compare>;
+
+  //! TreeSetView shares the set algebra
+  friend class TreeSetView<T, Compare>;
+
+  //! Provide "standard" name for iterator type
+  using iterator = TreeSetIter<T, Compare>;
+
+  class WriteBatch;
+
+  //! Constructor initializes an empty set.
+  TreeSet() { };
+
+  //! Initializer-list constructor
+  TreeSet(const std::initializer_list<T> &list) {
+    for (const T &value : list)
+      add(value);
+  };
+
+  //! Copy-constructor
+  TreeSet(const TreeSet<T, Compare> &other) = default;
+
+  //! Copy-assignment operator
+  TreeSet<T, Compare>& operator=(const TreeSet<T, Compare> &other) = default;
+
+  /*! Move-constructor takes other's values (and sketch flag), leaving it
+    empty, as a tree TreeSet's does
+  */
+  TreeSet(TreeSet<T, Compare> &&other) : TreeSet(other) {
+    other.clear();
+    other._sketch_enabled = false;
+  };
+
+  //! Move-assignment operator, also leaving other empty
+  TreeSet<T, Compare>& operator=(TreeSet<T, Compare> &&other);
+
+  //! Return an iterator to the first value in the TreeSet
+  TreeSetIter<T, Compare> begin() const { return lower_bound_at(0); };
+
+  //! Return an iterator "past the end" of the TreeSet.
+  TreeSetIter<T, Compare> end() const { return TreeSetIter<T, Compare>{}; };
+
+  //! Return an iterator to the first value that is not less than value.
+  TreeSetIter<T, Compare> lower_bound(const T &value) const {
+    return lower_bound_at(domain::position(value));
+  };
+
+  //! Return an iterator to the first value that is greater than value.
+  TreeSetIter<T, Compare> upper_bound(const T &value) const {
+    return lower_bound_at(domain::position(value) + 1);
+  };
+
+  /*! Copies the values in [lo, hi), in order, into out until it is full.
+    Returns how many values were copied.
+  */
+  std::size_t copy_range(const T &lo, const T &hi, std::span<T> out) const;
+
+  //! Returns true if the rhs set contains the same values as this set.
+  bool operator==(const TreeSet<T, Compare> &rhs) const {
+    return _words == rhs._words;
+  };
+
+  //! Inverse of ==
+  bool operator!=(const TreeSet<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+
+  //! Returns true if the view v holds the same values as this set.
+  bool operator==(const TreeSetView<T, Compare> &v) const;
+
+  //! Inverse of ==
+  bool operator!=(const TreeSetView<T, Compare> &v) const {
+    return !(*this == v);
+  };
+
+  //! Computes the set-union of this set and the provided set s. Returns new set.
+  TreeSet<T, Compare> plus(const TreeSet<T, Compare> &s) const;
+
+  //! Computes the set-intersection of this set & provided set s.
+  TreeSet<T, Compare> intersect(const TreeSet<T, Compare> &s) const;
+
+  //! Computes the set-difference of this set & provided set s.
+  TreeSet<T, Compare> minus(const TreeSet<T, Compare> &s) const;
+
+  //! Set-union with the values of a view
+  TreeSet<T, Compare> plus(const TreeSetView<T, Compare> &v) const {
+    return union_of(*this, v);
+  };
+
+  //! Set-intersection with the values of a view
+  TreeSet<T, Compare> intersect(const TreeSetView<T, Compare> &v) const {
+    return intersection_of(*this, v);
+  };
+
+  //! Set-difference with the values of a view
+  TreeSet<T, Compare> minus(const TreeSetView<T, Compare> &v) const {
+    return difference_of(*this, v);
+  };
+
+  //! Returns the number of elements in the set.
+  int size() const { return _size; };
+
+  //! Attempts to add a value to the set.
+  bool add(const T &value) { return set_bit(value, true); };
+
+  //! Attemps to remove value from the set.
+  bool del(const T &value) { return set_bit(value, false); };
+
+  //! Removes every value from the set.
+  void clear() {
+    _words = {};
+    _size = 0;
+  };
+
+  //! Accepted for compatibility; a bitmap already has room for every key.
+  void reserve(int) { };
+
+  //! Returns whether the value appears in the set or not.
+  bool contains(const T &value) const {
+    std::size_t pos = domain::position(value);
+    return (_words[pos / 64] >> (pos % 64)) & 1;
+  };
+
+  //! Accepted for compatibility; a bitmap has no tombstones to defer.
+  void set_lazy_delete(bool, double = 0.25) { };
+
+  //! A bitmap never has tombstones.
+  int tombstones() const { return 0; };
+
+  //! Nothing to compact in a bitmap.
+  void compact() { };
+
+  //! Applies all of the batch's adds and deletes (which cannot fail).
+  void apply(const WriteBatch &batch);
+
+  /*! Accepted for compatibility: a bitmap answers approx_rank() and
+    approx_quantile() exactly without a sketch, so this only sets the flag
+    that has_sketch() reports.
+  */
+  void enable_sketch(int = 200) { _sketch_enabled = true; };
+
+  //! Clears the flag that has_sketch() reports; there is no sketch to free.
+  void disable_sketch() { _sketch_enabled = false; };
+
+  //! Returns whether enable_sketch() was called (and not undone) on the set.
+  bool has_sketch() const { return _sketch_enabled; };
+
+  //! Returns exactly how many values are less than value.
+  int approx_rank(const T &value) const;
+
+  /*! Returns the value with floor(q * size()) values less than it (or the
+    last value, for q = 1). The set must not be empty.
+  */
+  T approx_quantile(double q) const;
+};
+
+/*!
+WriteBatch for bitmap sets: the recorded ops are simply replayed in order,
+which gives the same result as cancelling them first.
+*/
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+class TreeSet<T, Compare>::WriteBatch {
+  //! Recorded ops in order, each value paired with true (add) or false (del).
+  std::vector<std::pair<T, bool>> _ops;
+
+  //! As a friend, TreeSet can read the ops when applying the batch
+  friend class TreeSet<T, Compare>;
+
+public:
+  //! Records that value should be added to the set.
+  void add(const T &value) { _ops.emplace_back(value, true); };
+
+  //! Records that value should be removed from the set.
+  void del(const T &value) { _ops.emplace_back(value, false); };
+
+  //! Returns the number of ops recorded so far (before cancellation).
+  size_t size() const { return _ops.size(); };
+
+  //! Forgets all recorded ops.
+  void clear() { _ops.clear(); };
+};
+
+/***************** End bitmap TreeSet declaration  ****************/
+
+
+
+
+
+/***************** Begin bitmap TreeSet definition ****************/
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+void TreeSetIter<T, Compare>::seek(std::size_t pos) {
+  _pos = domain::next_set(_words, pos);
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+std::size_t TreeSetIter<T, Compare>::next_batch(std::span<T> out) {
+  std::size_t count = 0;
+
+  while (count < out.size() && _pos < domain::SIZE) {
+    out[count++] = domain::key_at(_pos);
+    seek(_pos + 1);
+  }
+
+  return count;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+TreeSet<T, Compare>& TreeSet<T, Compare>::operator=(TreeSet<T, Compare> &&other) {
+  if (this == &other) // detect and handle self-assignment
+    return *this;
+
+  *this = other;
+  other.clear();
+  other._sketch_enabled = false;
+  return *this;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+bool TreeSet<T, Compare>::set_bit(const T &value, bool present) {
+  std::size_t pos = domain::position(value);
+  uint64_t &word = _words[pos / 64];
+  uint64_t mask = uint64_t(1) << (pos % 64);
+
+  if (((word & mask) != 0) == present)
+    return false;
+
+  word ^= mask;
+  _size += present ? 1 : -1;
+  return true;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+void TreeSet<T, Compare>::recount() {
+  _size = 0;
+  for (uint64_t word : _words)
+    _size += std::popcount(word);
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+TreeSetIter<T, Compare> TreeSet<T, Compare>::lower_bound_at(std::size_t pos)
+  const {
+  TreeSetIter<T, Compare> it;
+  it._words = _words.data();
+  it.seek(pos);
+  return it;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+std::size_t TreeSet<T, Compare>::copy_range(const T &lo, const T &hi,
+                                            std::span<T> out) const {
+  std::size_t end = domain::position(hi);
+  std::size_t count = 0;
+
+  for (std::size_t pos = domain::next_set(_words.data(), domain::position(lo));
+       count < out.size() && pos < end;
+       pos = domain::next_set(_words.data(), pos + 1))
+    out[count++] = domain::key_at(pos);
+
+  return count;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::plus(const TreeSet<T, Compare> &s)
+  const {
+  TreeSet<T, Compare> result;
+  for (std::size_t w = 0; w < domain::WORDS; w++)
+    result._words[w] = _words[w] | s._words[w];
+
+  result.recount();
+  return result;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::intersect(const TreeSet<T, Compare> &s)
+  const {
+  TreeSet<T, Compare> result;
+  for (std::size_t w = 0; w < domain::WORDS; w++)
+    result._words[w] = _words[w] & s._words[w];
+
+  result.recount();
+  return result;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::minus(const TreeSet<T, Compare> &s)
+  const {
+  TreeSet<T, Compare> result;
+  for (std::size_t w = 0; w < domain::WORDS; w++)
+    result._words[w] = _words[w] & ~s._words[w];
+
+  result.recount();
+  return result;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+template <typename A> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::bitmap_of(const A &a) {
+  TreeSet<T, Compare> result;
+  for (auto it = a.begin(); it != a.end(); ++it)
+    result.set_bit(*it, true);
+  return result;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::union_of(const A &a, const B &b) {
+  return bitmap_of(a).plus(bitmap_of(b));
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::intersection_of(const A &a,
+                                                         const B &b) {
+  return bitmap_of(a).intersect(bitmap_of(b));
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::difference_of(const A &a,
+                                                       const B &b) {
+  return bitmap_of(a).minus(bitmap_of(b));
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+bool TreeSet<T, Compare>::operator==(const TreeSetView<T, Compare> &v) const {
+  if (_size != v.size())
+    return false;
+
+  for (auto it = v.begin(); it != v.end(); ++it) {
+    if (!contains(*it))
+      return false;
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+void TreeSet<T, Compare>::apply_sorted(
+  const std::vector<std::pair<T, bool>> &ops) {
+  for (const auto &op : ops)
+    set_bit(op.first, op.second);
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+void TreeSet<T, Compare>::apply(const WriteBatch &batch) {
+  apply_sorted(batch._ops);
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+int TreeSet<T, Compare>::approx_rank(const T &value) const {
+  std::size_t pos = domain::position(value);
+  int rank = 0;
+  for (std::size_t w = 0; w < pos / 64; w++)
+    rank += std::popcount(_words[w]);
+
+  uint64_t below = (uint64_t(1) << (pos % 64)) - 1;
+  if (pos % 64 != 0)
+    rank += std::popcount(_words[pos / 64] & below);
+  return rank;
+}
+
+template <typename T, typename Compare>
+  requires bitmap_key_set<T, Compare> inline
+T TreeSet<T, Compare>::approx_quantile(double q) const {
+  assert(_size > 0);
+  int rank = std::min((int) (std::clamp(q, 0.0, 1.0) * _size), _size - 1);
+
+  // Skip whole words, then clear the low bits of the one holding the value
+  std::size_t w = 0;
+  while (std::popcount(_words[w]) <= rank)
+    rank -= std::popcount(_words[w++]);
+
+  uint64_t bits = _words[w];
+  for (; rank > 0; rank--)
+    bits &= bits - 1;
+  return domain::key_at(w * 64 + std::countr_zero(bits));
+}
+
+/***************** End bitmap TreeSet definition ****************/
+
+#endif
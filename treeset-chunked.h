@@ -0,0 +1,365 @@
+#ifndef TREESET_CHUNKED_HH
+#define TREESET_CHUNKED_HH
+
+#include "treeset.h"
+
+#include <bit>
+#include <cstdint>
+#include <cstring>
+#include <exception>
+#include <iostream>
+#include <iterator>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/*!
+The chunked format stores the values of a TreeSet in sorted order, cut into
+chunks of a fixed number of values, with an index of every chunk up front, so
+that separate threads can encode and decode separate chunks. It has a header,
+then the chunk index, then the values:
+
+  header   8-byte magic, uint32 key size, uint32 number of chunks,
+           uint64 number of values
+  index    per chunk: its first value, uint64 byte offset of the chunk from
+           the start of the values, uint64 number of values in the chunk
+  values   the raw bytes of every value, in set order
+
+As in traces, values and integers are stored in native byte order, so a file
+is only portable between machines of the same endianness.
+*/
+namespace treeset_chunked {
+
+  //! Magic string at the start of every chunked file
+  const char MAGIC[8] = {'T', 'S', 'C', 'H', 'U', 'N', 'K', '1'};
+
+  //! Bytes in the header
+  const std::size_t HEADER_SIZE = sizeof(MAGIC) + 4 + 4 + 8;
+
+  //! Default number of values per chunk
+  const std::size_t DEFAULT_CHUNK_VALUES = 1 << 16;
+}
+
+/*!
+ChunkedTreeSetCodec reads and writes TreeSets in the chunked format, using as
+many threads as it is given. Encoding splits the tree near the root into
+pieces that threads walk independently; decoding builds each chunk into its own
+balanced subtree and joins the subtrees under the chunks' first values, which
+keeps the result within the scapegoat depth bound without rebalancing it.
+Values are stored as raw bytes, so T must be trivially copyable.
+*/
+template <typename T, typename Compare = std::less<T>>
+class ChunkedTreeSetCodec {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "chunked values are stored as raw bytes");
+  static_assert(!bitmap_key_set<T, Compare>,
+                "bitmap sets have no tree to split");
+
+  using set_type = TreeSet<T, Compare>;
+  using node = typename set_type::node;
+  using sp_node = typename set_type::sp_node;
+
+  //! Bytes in one chunk index entry
+  static constexpr std::size_t INDEX_ENTRY_SIZE = sizeof(T) + 8 + 8;
+
+  /*! A piece of the tree for one encoding thread: a whole subtree, or a
+    single node between two subtrees.
+  */
+  struct piece {
+    const node *n;
+    bool whole_subtree;
+    std::vector<T> values;      //!< live values in the piece, in order
+    std::size_t rank = 0;       //!< live values in the pieces before it
+  };
+
+  //! One decoded chunk: its first value as a node, and the rest as a subtree
+  struct decoded_chunk {
+    sp_node first;
+    sp_node rest;
+    bool ok = false;
+  };
+
+  /*! Runs f(i) for every i in [0, count), spread over up to threads threads.
+    If f throws, the exception is rethrown here once every thread has stopped.
+  */
+  template <typename F>
+  static void parallel_for(std::size_t count, int threads, F f);
+
+  //! Appends the pieces of subtree n to out, in order, splitting to depth.
+  static void split(const node *n, int depth, std::vector<piece> &out);
+
+  //! Copies x into out at offset, as raw bytes
+  template <typename U>
+  static void put(char *out, std::size_t offset, const U &x) {
+    std::memcpy(out + offset, &x, sizeof(U));
+  };
+
+  //! Reads an x from data at offset, as raw bytes
+  template <typename U>
+  static U get(const char *data, std::size_t offset) {
+    U x;
+    std::memcpy(&x, data + offset, sizeof(U));
+    return x;
+  };
+
+  /*! Joins the decoded chunks [lo, hi) into one balanced tree: the rest of
+    chunk lo, then for each later chunk its first value and its rest.
+  */
+  static sp_node join(std::vector<decoded_chunk> &chunks, std::size_t lo,
+                      std::size_t hi);
+
+public:
+  /*! Returns the contents of s in the chunked format, with chunk_values
+    values per chunk, encoded by up to threads threads.
+  */
+  static std::vector<char> encode(
+    const set_type &s, int threads = 1,
+    std::size_t chunk_values = treeset_chunked::DEFAULT_CHUNK_VALUES);
+
+  /*! Makes s hold the values encoded in the size bytes at data, decoding with
+    up to threads threads. Returns false, leaving s unchanged, if the data is
+    not a well-formed chunked encoding of a set of T in the order of Compare.
+  */
+  static bool decode(const char *data, std::size_t size, set_type &s,
+                     int threads = 1);
+
+  //! Writes s to out in the chunked format, as encode()
+  static void write(
+    std::ostream &out, const set_type &s, int threads = 1,
+    std::size_t chunk_values = treeset_chunked::DEFAULT_CHUNK_VALUES) {
+    std::vector<char> data = encode(s, threads, chunk_values);
+    out.write(data.data(), data.size());
+  };
+
+  //! Reads the rest of in into s, as decode()
+  static bool read(std::istream &in, set_type &s, int threads = 1) {
+    std::vector<char> data{std::istreambuf_iterator<char>(in),
+                           std::istreambuf_iterator<char>()};
+    return decode(data.data(), data.size(), s, threads);
+  };
+};
+
+template <typename T, typename Compare>
+template <typename F> inline
+void ChunkedTreeSetCodec<T, Compare>::parallel_for(std::size_t count,
+                                                   int threads, F f) {
+  std::size_t workers = std::min<std::size_t>(std::max(threads, 1), count);
+  if (workers <= 1) {
+    for (std::size_t i = 0; i < count; i++)
+      f(i);
+    return;
+  }
+
+  // An exception escaping a thread would call std::terminate, so each worker
+  // keeps its own to rethrow after the join
+  std::vector<std::exception_ptr> errors(workers);
+  std::vector<std::thread> pool;
+  try {
+    for (std::size_t w = 0; w < workers; w++) {
+      pool.emplace_back([&, w]() {
+        try {
+          for (std::size_t i = w; i < count; i += workers)
+            f(i);
+        } catch (...) {
+          errors[w] = std::current_exception();
+        }
+      });
+    }
+  } catch (...) {
+    for (std::thread &t : pool)
+      t.join();
+    throw;
+  }
+
+  for (std::thread &t : pool)
+    t.join();
+
+  for (const std::exception_ptr &error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+template <typename T, typename Compare> inline
+void ChunkedTreeSetCodec<T, Compare>::split(const node *n, int depth,
+                                            std::vector<piece> &out) {
+  if (n == nullptr)
+    return;
+
+  if (depth == 0) {
+    out.push_back({n, true});
+    return;
+  }
+
+  split(n->left.get(), depth - 1, out);
+  out.push_back({n, false});
+  split(n->right.get(), depth - 1, out);
+}
+
+template <typename T, typename Compare> inline
+ChunkedTreeSetCodec<T, Compare>::sp_node
+ChunkedTreeSetCodec<T, Compare>::join(std::vector<decoded_chunk> &chunks,
+                                      std::size_t lo, std::size_t hi) {
+  if (hi - lo == 1)
+    return std::move(chunks[lo].rest);
+
+  std::size_t mid = lo + (hi - lo) / 2;
+  sp_node n = std::move(chunks[mid].first);
+  n->left = join(chunks, lo, mid);
+  n->right = join(chunks, mid, hi);
+  return n;
+}
+
+template <typename T, typename Compare> inline
+std::vector<char> ChunkedTreeSetCodec<T, Compare>::encode(
+  const set_type &s, int threads, std::size_t chunk_values) {
+  using namespace treeset_chunked;
+
+  // Several pieces per thread, since subtrees differ in size
+  std::vector<piece> pieces;
+  int depth = (int) std::bit_width((unsigned) std::max(threads, 1) * 4);
+  split(s._root.get(), depth, pieces);
+
+  // Walk the pieces once, collecting their values; copying them into place
+  // afterwards is cheap next to the cache misses of the walk.
+  parallel_for(pieces.size(), threads, [&](std::size_t i) {
+    piece &p = pieces[i];
+    if (!p.whole_subtree) {
+      if (!p.n->deleted)
+        p.values.push_back(p.n->value());
+      return;
+    }
+
+    for (TreeSetIter<T, Compare> it{p.n}; it != s.end(); ++it)
+      p.values.push_back(*it);
+  });
+
+  std::size_t num_values = 0;
+  for (piece &p : pieces) {
+    p.rank = num_values;
+    num_values += p.values.size();
+  }
+
+  chunk_values = std::max<std::size_t>(chunk_values, 1);
+  std::size_t num_chunks = (num_values + chunk_values - 1) / chunk_values;
+  std::size_t values_start = HEADER_SIZE + num_chunks * INDEX_ENTRY_SIZE;
+
+  std::vector<char> data(values_start + num_values * sizeof(T));
+  char *out = data.data();
+
+  std::memcpy(out, MAGIC, sizeof(MAGIC));
+  put(out, sizeof(MAGIC), (uint32_t) sizeof(T));
+  put(out, sizeof(MAGIC) + 4, (uint32_t) num_chunks);
+  put(out, sizeof(MAGIC) + 8, (uint64_t) num_values);
+
+  char *values = out + values_start;
+  parallel_for(pieces.size(), threads, [&](std::size_t i) {
+    const piece &p = pieces[i];
+    if (!p.values.empty()) {
+      std::memcpy(values + p.rank * sizeof(T), p.values.data(),
+                  p.values.size() * sizeof(T));
+    }
+  });
+
+  for (std::size_t c = 0; c < num_chunks; c++) {
+    std::size_t entry = HEADER_SIZE + c * INDEX_ENTRY_SIZE;
+    std::size_t offset = c * chunk_values * sizeof(T);
+
+    std::memcpy(out + entry, values + offset, sizeof(T));
+    put(out, entry + sizeof(T), (uint64_t) offset);
+    put(out, entry + sizeof(T) + 8,
+        (uint64_t) std::min(chunk_values, num_values - c * chunk_values));
+  }
+
+  return data;
+}
+
+template <typename T, typename Compare> inline
+bool ChunkedTreeSetCodec<T, Compare>::decode(const char *data,
+                                             std::size_t size, set_type &s,
+                                             int threads) {
+  using namespace treeset_chunked;
+
+  if (size < HEADER_SIZE || std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0 ||
+      get<uint32_t>(data, sizeof(MAGIC)) != sizeof(T))
+    return false;
+
+  std::size_t num_chunks = get<uint32_t>(data, sizeof(MAGIC) + 4);
+  uint64_t num_values = get<uint64_t>(data, sizeof(MAGIC) + 8);
+
+  // Sizes are checked by division so that huge counts cannot overflow
+  std::size_t values_start = HEADER_SIZE + num_chunks * INDEX_ENTRY_SIZE;
+  if (num_chunks > (size - HEADER_SIZE) / INDEX_ENTRY_SIZE ||
+      num_values != (size - values_start) / sizeof(T) ||
+      (size - values_start) % sizeof(T) != 0 ||
+      num_values > (uint64_t) std::numeric_limits<int>::max() ||
+      (num_values > 0) != (num_chunks > 0))
+    return false;
+
+  // The chunks must tile the values in order, each starting with its first
+  const char *values = data + values_start;
+  std::vector<std::size_t> starts, counts;
+  uint64_t expected_offset = 0;
+  for (std::size_t c = 0; c < num_chunks; c++) {
+    std::size_t entry = HEADER_SIZE + c * INDEX_ENTRY_SIZE;
+    uint64_t offset = get<uint64_t>(data, entry + sizeof(T));
+    uint64_t count = get<uint64_t>(data, entry + sizeof(T) + 8);
+
+    if (offset != expected_offset || count == 0 ||
+        count > num_values - offset / sizeof(T) ||
+        std::memcmp(data + entry, values + offset, sizeof(T)) != 0)
+      return false;
+
+    starts.push_back(offset / sizeof(T));
+    counts.push_back(count);
+    expected_offset = offset + count * sizeof(T);
+  }
+  if (expected_offset != num_values * sizeof(T))
+    return false;
+
+  Compare cmp;
+  std::vector<decoded_chunk> chunks(num_chunks);
+  parallel_for(num_chunks, threads, [&](std::size_t c) {
+    std::size_t start = starts[c];
+    std::vector<sp_node> nodes;
+    nodes.reserve(counts[c]);
+
+    for (std::size_t i = 0; i < counts[c]; i++) {
+      T value = get<T>(values, (start + i) * sizeof(T));
+      if (!nodes.empty() && !cmp(nodes.back()->value(), value))
+        return;                     // not strictly increasing
+      nodes.push_back(std::make_shared<node>(value));
+    }
+
+    // The first chunk has no separator; the others give up their first value
+    std::size_t skip = c == 0 ? 0 : 1;
+    if (skip)
+      chunks[c].first = nodes[0];
+    chunks[c].rest = set_type::build_balanced(nodes, (int) skip,
+                                              (int) nodes.size());
+    chunks[c].ok = true;
+  });
+
+  for (std::size_t c = 0; c < num_chunks; c++) {
+    if (!chunks[c].ok)
+      return false;
+
+    // Each chunk must start after the last value of the one before it
+    if (c > 0) {
+      T prev_last = get<T>(values, (starts[c] - 1) * sizeof(T));
+      if (!cmp(prev_last, chunks[c].first->value()))
+        return false;
+    }
+  }
+
+  s._root = num_chunks == 0 ? nullptr : join(chunks, 0, num_chunks);
+  s._size = (int) num_values;
+  s._tombstones = 0;
+  s._max_nodes = (int) num_values;
+  if (s._sketch)
+    s.update_sketch([&] { s.rebuild_sketch(); });
+  assert(s.sanity_check(s._root));
+  return true;
+}
+
+#endif
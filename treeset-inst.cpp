@@ -0,0 +1,16 @@
+#include "treeset.h"
+
+#include <string>
+
+/*
+ * Explicit instantiations of TreeSet for libtreeset.a.  Translation units
+ * built with -DTREESET_EXTERN_TEMPLATES skip compiling these combinations
+ * themselves and link against the code generated here instead.  The list of
+ * combinations lives in treeset.h (TREESET_PRECOMPILED).
+ */
+
+#define TREESET_INSTANTIATE(T, Compare)     \
+    template class TreeSet<T, Compare>;     \
+    template class TreeSetIter<T, Compare>;
+
+TREESET_PRECOMPILED(TREESET_INSTANTIATE)
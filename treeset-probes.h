@@ -0,0 +1,53 @@
+#ifndef TREESET_PROBES_HH
+#define TREESET_PROBES_HH
+
+/*!
+Static tracepoints on TreeSet's hot paths, for profiling a running program
+without rebuilding it (e.g. to see the distribution of descent depths, or how
+often the tree is rebalanced).
+
+Build with -DTREESET_USDT to compile the probes into SystemTap/USDT probe
+points (provider "treeset"), using <sys/sdt.h> where it is available. A probe
+point is a single nop until a tracer such as bpftrace, perf or stap attaches to
+it:
+
+    bpftrace -e 'usdt:./app:treeset:add { @depth = hist(arg0); }'
+
+Without TREESET_USDT (or without <sys/sdt.h>) every probe compiles away to
+nothing; its arguments are not evaluated.
+
+Defining TREESET_PROBE_HOOK(name, ...) before including treeset.h routes every
+probe to that macro instead, with the probe name as a string; the tests use
+this to check that probes fire with the right arguments.
+
+The probes, and their arguments:
+
+    add(depth, size)                    after add(); nodes on the search path
+    del(depth, size)                    after del(); likewise
+    contains(depth, found)              after contains(); likewise
+    rebalance(nodes, size)              subtree of nodes rebuilt balanced
+    batch_entry(ops, size)              apply_sorted() starting a bulk update
+    batch_return(added, size)           ... and finishing it
+    plus_entry(size, other_size)        set algebra entry ...
+    plus_return(result_size)            ... and exit, likewise for
+                                        intersect_* and minus_*
+*/
+
+#if defined(TREESET_PROBE_HOOK)
+
+#define TREESET_PROBE(name, ...) TREESET_PROBE_HOOK(#name, __VA_ARGS__)
+
+#elif defined(TREESET_USDT) && __has_include(<sys/sdt.h>)
+
+#include <sys/sdt.h>
+#define TREESET_PROBE(name, ...) STAP_PROBEV(treeset, name, __VA_ARGS__)
+
+#else
+
+// Mentions the arguments (so computing them is not "unused") without
+// evaluating them.
+#define TREESET_PROBE(name, ...) ((void) sizeof((__VA_ARGS__, 0)))
+
+#endif
+
+#endif
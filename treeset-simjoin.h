@@ -0,0 +1,314 @@
+#ifndef TREESET_SIMJOIN_HH
+#define TREESET_SIMJOIN_HH
+
+#include "treeset.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <span>
+#include <thread>
+#include <vector>
+
+//! A pair of sets found by TreeSetSimilarityJoin
+struct treeset_similar_pair {
+  //! Positions of the two sets in the input, with first < second
+  std::size_t first, second;
+
+  //! Jaccard similarity of the two sets: |intersection| / |union|
+  double jaccard;
+};
+
+/*!
+TreeSetSimilarityJoin finds every pair among a collection of TreeSets whose
+Jaccard similarity is at least a threshold t, without comparing every pair.
+
+It numbers the distinct values of all the sets from the rarest to the most
+common, and rewrites each set as a sorted list of those numbers. Two sets
+with similarity t must then share one of their rarest few values: a set of
+size n need only be looked up by its first n - ceil(t n) + 1 values (the
+prefix filter), and can only match sets of size at least t n (the length
+filter). An inverted index from each value to the sets that have it in their
+(shorter, indexing) prefix yields candidate pairs, and a merge walk over the
+two sorted lists verifies each one, giving up as soon as the values left
+cannot reach the overlap needed.
+Sets are looked up in parallel by up to the given number of threads. Empty
+sets have no similarity to anything and are never reported.
+*/
+template <typename T, typename Compare = std::less<T>>
+class TreeSetSimilarityJoin {
+  using set_type = TreeSet<T, Compare>;
+
+  //! Slack for rounding when turning similarities into value counts
+  static constexpr double EPSILON = 1e-9;
+
+  //! ceil(x), but not rounding up values a rounding error above an integer
+  static std::size_t ceil_count(double x) {
+    return (std::size_t) std::max(0.0, std::ceil(x - EPSILON));
+  };
+
+  /*! The sets as lists of value numbers, rarest first, ordered by size (and
+    then by position in the input).
+  */
+  struct records {
+    //! Position in the input of each record's set
+    std::vector<std::size_t> set;
+
+    //! Record r's values are values[start[r]] ... values[start[r + 1] - 1]
+    std::vector<std::size_t> start;
+    std::vector<std::uint32_t> values;
+
+    std::size_t size(std::size_t r) const { return start[r + 1] - start[r]; };
+
+    const std::uint32_t *begin(std::size_t r) const {
+      return values.data() + start[r];
+    };
+  };
+
+  /*! Maps every value in the sets to a number, rarest values first, and
+    returns the sets as records. Sets num_values to the number of distinct
+    values.
+  */
+  static records make_records(std::span<const set_type> sets, int threads,
+                              std::size_t &num_values);
+
+  /*! Returns how many values two records of sizes a and b must share to be
+    at least threshold similar.
+  */
+  static std::size_t min_overlap(std::size_t a, std::size_t b,
+                                 double threshold) {
+    return ceil_count(threshold / (1 + threshold) * (a + b));
+  };
+
+  /*! Counts the values records x and y share, stopping early (with a count
+    below needed) once they can no longer share needed values.
+  */
+  static std::size_t overlap(const records &recs, std::size_t x, std::size_t y,
+                             std::size_t needed);
+
+public:
+  /*! Returns every pair of sets whose Jaccard similarity is at least
+    threshold, which must be in (0, 1], ordered by first then second.
+    Sets are looked up by up to threads threads.
+  */
+  static std::vector<treeset_similar_pair> join(
+    std::span<const set_type> sets, double threshold, int threads = 1);
+};
+
+template <typename T, typename Compare> inline
+TreeSetSimilarityJoin<T, Compare>::records
+TreeSetSimilarityJoin<T, Compare>::make_records(std::span<const set_type> sets,
+                                                int threads,
+                                                std::size_t &num_values) {
+  Compare cmp;
+  auto same = [&](const T &a, const T &b) {
+    return !cmp(a, b) && !cmp(b, a);
+  };
+
+  // The distinct values, in set order, and how many sets have each
+  std::vector<T> all;
+  for (const set_type &s : sets) {
+    for (auto it = s.begin(); it != s.end(); ++it)
+      all.push_back(*it);
+  }
+  std::sort(all.begin(), all.end(), cmp);
+
+  std::vector<T> distinct;
+  std::vector<std::size_t> frequency;
+  for (std::size_t i = 0; i < all.size(); i++) {
+    if (i == 0 || !same(all[i - 1], all[i])) {
+      distinct.push_back(all[i]);
+      frequency.push_back(0);
+    }
+    frequency.back()++;
+  }
+  std::vector<T>().swap(all);
+  num_values = distinct.size();
+
+  // Number the values from the rarest up
+  std::vector<std::uint32_t> by_frequency(distinct.size());
+  for (std::size_t i = 0; i < by_frequency.size(); i++)
+    by_frequency[i] = (std::uint32_t) i;
+  std::stable_sort(by_frequency.begin(), by_frequency.end(),
+                   [&](std::uint32_t a, std::uint32_t b) {
+                     return frequency[a] < frequency[b];
+                   });
+  std::vector<std::uint32_t> number(distinct.size());
+  for (std::size_t i = 0; i < by_frequency.size(); i++)
+    number[by_frequency[i]] = (std::uint32_t) i;
+
+  // Records go in order of size, leaving out empty sets
+  records recs;
+  for (std::size_t i = 0; i < sets.size(); i++) {
+    if (sets[i].size() > 0)
+      recs.set.push_back(i);
+  }
+  std::stable_sort(recs.set.begin(), recs.set.end(),
+                   [&](std::size_t a, std::size_t b) {
+                     return sets[a].size() < sets[b].size();
+                   });
+
+  recs.start.push_back(0);
+  for (std::size_t i : recs.set)
+    recs.start.push_back(recs.start.back() + sets[i].size());
+  recs.values.resize(recs.start.back());
+
+  // Each thread fills in a share of the records
+  std::size_t workers = std::min<std::size_t>(std::max(threads, 1),
+                                              std::max<std::size_t>(
+                                                recs.set.size(), 1));
+  auto fill = [&](std::size_t w) {
+    for (std::size_t r = w; r < recs.set.size(); r += workers) {
+      const set_type &s = sets[recs.set[r]];
+      std::uint32_t *out = recs.values.data() + recs.start[r];
+
+      // The set's values come in set order, so each search starts at the last
+      auto pos = distinct.begin();
+      for (auto it = s.begin(); it != s.end(); ++it) {
+        pos = std::lower_bound(pos, distinct.end(), *it, cmp);
+        *out++ = number[pos - distinct.begin()];
+      }
+      std::sort(recs.values.data() + recs.start[r], out);
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (std::size_t w = 1; w < workers; w++)
+    pool.emplace_back(fill, w);
+  fill(0);
+  for (std::thread &t : pool)
+    t.join();
+
+  return recs;
+}
+
+template <typename T, typename Compare> inline
+std::size_t TreeSetSimilarityJoin<T, Compare>::overlap(const records &recs,
+                                                       std::size_t x,
+                                                       std::size_t y,
+                                                       std::size_t needed) {
+  const std::uint32_t *a = recs.begin(x), *a_end = a + recs.size(x);
+  const std::uint32_t *b = recs.begin(y), *b_end = b + recs.size(y);
+  std::size_t shared = 0;
+
+  while (a != a_end && b != b_end) {
+    std::size_t left = std::min(a_end - a, b_end - b);
+    if (shared + left < needed)
+      break;
+
+    if (*a < *b) {
+      ++a;
+    } else if (*b < *a) {
+      ++b;
+    } else {
+      shared++;
+      ++a;
+      ++b;
+    }
+  }
+
+  return shared;
+}
+
+template <typename T, typename Compare> inline
+std::vector<treeset_similar_pair> TreeSetSimilarityJoin<T, Compare>::join(
+  std::span<const set_type> sets, double threshold, int threads) {
+  assert(threshold > 0 && threshold <= 1);
+
+  std::size_t num_values;
+  records recs = make_records(sets, threads, num_values);
+  std::size_t num_records = recs.set.size();
+
+  // A record y only needs indexing under its first index_prefix values: a
+  // larger record x similar to it shares one of them with x's probe prefix
+  auto index_prefix = [&](std::size_t n) {
+    return std::min(n, n - ceil_count(2 * threshold / (1 + threshold) * n) + 1);
+  };
+  auto probe_prefix = [&](std::size_t n) {
+    return std::min(n, n - ceil_count(threshold * n) + 1);
+  };
+
+  // The inverted index, with the records for value v, in record order, at
+  // postings[list_start[v]] ... postings[list_start[v + 1] - 1]
+  std::vector<std::size_t> list_start(num_values + 1, 0);
+  for (std::size_t r = 0; r < num_records; r++) {
+    const std::uint32_t *v = recs.begin(r);
+    for (std::size_t i = 0; i < index_prefix(recs.size(r)); i++)
+      list_start[v[i] + 1]++;
+  }
+  for (std::size_t v = 0; v < num_values; v++)
+    list_start[v + 1] += list_start[v];
+
+  std::vector<std::uint32_t> postings(list_start.back());
+  std::vector<std::size_t> fill = list_start;
+  for (std::size_t r = 0; r < num_records; r++) {
+    const std::uint32_t *v = recs.begin(r);
+    for (std::size_t i = 0; i < index_prefix(recs.size(r)); i++)
+      postings[fill[v[i]]++] = (std::uint32_t) r;
+  }
+
+  // Each thread looks up a share of the records against the smaller ones
+  std::size_t workers = std::min<std::size_t>(std::max(threads, 1),
+                                              std::max<std::size_t>(
+                                                num_records, 1));
+  std::vector<std::vector<treeset_similar_pair>> found(workers);
+
+  auto probe = [&](std::size_t w) {
+    std::vector<std::uint32_t> hits(num_records, 0);
+    std::vector<std::uint32_t> candidates;
+
+    for (std::size_t x = w; x < num_records; x += workers) {
+      std::size_t size = recs.size(x);
+      std::size_t min_size = ceil_count(threshold * size);
+      const std::uint32_t *v = recs.begin(x);
+
+      for (std::size_t i = 0; i < probe_prefix(size); i++) {
+        const std::uint32_t *first = postings.data() + list_start[v[i]];
+        const std::uint32_t *last = postings.data() + list_start[v[i] + 1];
+
+        // Skip the records too small to match, then take those before x
+        first = std::partition_point(first, last, [&](std::uint32_t y) {
+          return recs.size(y) < min_size;
+        });
+        for (; first != last && *first < x; ++first) {
+          if (hits[*first]++ == 0)
+            candidates.push_back(*first);
+        }
+      }
+
+      for (std::uint32_t y : candidates) {
+        hits[y] = 0;
+
+        std::size_t needed = min_overlap(size, recs.size(y), threshold);
+        std::size_t shared = overlap(recs, x, y, needed);
+        if (shared < needed)
+          continue;
+
+        std::size_t a = recs.set[x], b = recs.set[y];
+        found[w].push_back({std::min(a, b), std::max(a, b),
+                            (double) shared / (size + recs.size(y) - shared)});
+      }
+      candidates.clear();
+    }
+  };
+
+  std::vector<std::thread> pool;
+  for (std::size_t w = 1; w < workers; w++)
+    pool.emplace_back(probe, w);
+  probe(0);
+  for (std::thread &t : pool)
+    t.join();
+
+  std::vector<treeset_similar_pair> pairs;
+  for (const auto &part : found)
+    pairs.insert(pairs.end(), part.begin(), part.end());
+  std::sort(pairs.begin(), pairs.end(),
+            [](const treeset_similar_pair &a, const treeset_similar_pair &b) {
+              return a.first != b.first ? a.first < b.first
+                                        : a.second < b.second;
+            });
+  return pairs;
+}
+
+#endif
@@ -0,0 +1,234 @@
+#ifndef TREESET_SKETCH_HH
+#define TREESET_SKETCH_HH
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <functional>
+#include <utility>
+#include <vector>
+
+/*!
+treeset_kll_sketch summarizes a stream of values in a KLL sketch (Karnin,
+Lang and Liberty, "Optimal Quantile Approximation in Streams"), from which the
+rank of any value in the stream can be estimated. It is a stack of compactors:
+values in compactor h each stand for 2^h values of the stream. When a compactor
+fills up, it is sorted and every other value (starting from a random one of the
+first two) moves up a level, where it counts twice as much; the rest are
+dropped. Compactors get smaller going down, by 2/3 per level from k at the top,
+so the sketch holds about 3k values however long the stream is, and estimated
+ranks are within about 1.7 / k of the stream length with 99% confidence.
+The coin flips come from a seeded generator, so a sketch is repeatable.
+*/
+template <typename T, typename Compare = std::less<T>>
+class treeset_kll_sketch {
+  //! Compactors, from the lowest (weight 1) up
+  std::vector<std::vector<T>> _levels;
+
+  //! Number of values added
+  std::uint64_t _count = 0;
+
+  //! Capacity of the top compactor
+  int _k;
+
+  //! State of the xorshift generator that flips the compaction coins
+  std::uint64_t _coin;
+
+  //! Comparator that orders the values
+  Compare _cmp;
+
+  //! Returns how many values compactor h holds before it is compacted.
+  std::size_t capacity(std::size_t h) const {
+    double scale = std::pow(2.0 / 3.0, (double) (_levels.size() - 1 - h));
+    return std::max<std::size_t>(2, (std::size_t) std::ceil(_k * scale));
+  };
+
+  //! Returns a pseudo-random bit.
+  bool flip() {
+    _coin ^= _coin << 13;
+    _coin ^= _coin >> 7;
+    _coin ^= _coin << 17;
+    return _coin & 1;
+  };
+
+  //! Compacts every compactor that is full, from the bottom up.
+  void compress();
+
+public:
+  //! An empty sketch whose top compactor holds k values.
+  explicit treeset_kll_sketch(int k = 200, std::uint64_t seed = 1)
+    : _levels(1), _k(std::max(k, 2)), _coin(seed | 1) { };
+
+  //! Adds value to the stream.
+  void add(const T &value) {
+    _levels[0].push_back(value);
+    _count++;
+    if (_levels[0].size() >= capacity(0))
+      compress();
+  };
+
+  //! Returns the number of values added.
+  std::uint64_t count() const { return _count; };
+
+  //! Returns the number of values the sketch holds.
+  std::size_t retained() const;
+
+  //! Returns the estimated number of values added that are less than value.
+  double rank(const T &value) const;
+
+  //! Calls f(value, weight) for each value the sketch holds.
+  template <typename F>
+  void for_each(F f) const {
+    for (std::size_t h = 0; h < _levels.size(); h++) {
+      for (const T &v : _levels[h])
+        f(v, (std::uint64_t) 1 << h);
+    }
+  };
+
+  //! Forgets every value added.
+  void clear() {
+    _levels.assign(1, std::vector<T>());
+    _count = 0;
+  };
+};
+
+/*!
+treeset_quantile_sketch estimates ranks and quantiles of a set that values are
+both added to and deleted from, as TreeSet's optional sketch. KLL sketches
+only take insertions, so it keeps one of the values added and one of the
+values deleted, and estimates ranks as the difference. Its error is relative
+to adds plus deletes, so the owner should rebuild it once deletes() is about
+the size of the set.
+*/
+template <typename T, typename Compare = std::less<T>>
+class treeset_quantile_sketch {
+  treeset_kll_sketch<T, Compare> _added, _deleted;
+
+  //! Comparator that orders the values
+  Compare _cmp;
+
+public:
+  //! An empty sketch; see treeset_kll_sketch for k.
+  explicit treeset_quantile_sketch(int k = 200)
+    : _added(k, 0x9e3779b97f4a7c15), _deleted(k, 0xbf58476d1ce4e5b9) { };
+
+  //! Records that value joined the set.
+  void add(const T &value) { _added.add(value); };
+
+  //! Records that value left the set.
+  void del(const T &value) { _deleted.add(value); };
+
+  //! Returns the number of deletes recorded.
+  std::uint64_t deletes() const { return _deleted.count(); };
+
+  //! Returns the number of values the sketch holds.
+  std::size_t retained() const {
+    return _added.retained() + _deleted.retained();
+  };
+
+  //! Returns the estimated number of values in the set less than value.
+  double rank(const T &value) const {
+    return _added.rank(value) - _deleted.rank(value);
+  };
+
+  /*! Returns a value whose estimated rank is about q times the set's size.
+    The set must not be empty.
+  */
+  T quantile(double q) const;
+
+  //! Forgets every add and delete.
+  void clear() {
+    _added.clear();
+    _deleted.clear();
+  };
+};
+
+/***************** Begin treeset_kll_sketch definition ****************/
+
+template <typename T, typename Compare> inline
+void treeset_kll_sketch<T, Compare>::compress() {
+  for (std::size_t h = 0; h < _levels.size(); h++) {
+    if (_levels[h].size() < capacity(h))
+      continue;
+
+    if (h + 1 == _levels.size())
+      _levels.emplace_back();
+
+    std::vector<T> &level = _levels[h];
+    std::vector<T> &above = _levels[h + 1];
+    std::sort(level.begin(), level.end(), _cmp);
+
+    // With an odd count, the largest value stays behind at this level
+    std::size_t pairs = level.size() / 2;
+    std::size_t offset = flip() ? 1 : 0;
+    for (std::size_t i = 0; i < pairs; i++)
+      above.push_back(std::move(level[2 * i + offset]));
+
+    if (level.size() % 2 == 1)
+      std::swap(level.front(), level.back());
+    level.resize(level.size() % 2);
+  }
+}
+
+template <typename T, typename Compare> inline
+std::size_t treeset_kll_sketch<T, Compare>::retained() const {
+  std::size_t n = 0;
+  for (const std::vector<T> &level : _levels)
+    n += level.size();
+  return n;
+}
+
+template <typename T, typename Compare> inline
+double treeset_kll_sketch<T, Compare>::rank(const T &value) const {
+  double r = 0;
+  for_each([&](const T &v, std::uint64_t weight) {
+    if (_cmp(v, value))
+      r += (double) weight;
+  });
+  return r;
+}
+
+/***************** End treeset_kll_sketch definition ****************/
+
+/***************** Begin treeset_quantile_sketch definition ****************/
+
+template <typename T, typename Compare> inline
+T treeset_quantile_sketch<T, Compare>::quantile(double q) const {
+  // Every value held, weighted +1 per add and -1 per delete it stands for
+  std::vector<std::pair<const T *, double>> weighted;
+  _added.for_each([&](const T &v, std::uint64_t weight) {
+    weighted.push_back({&v, (double) weight});
+  });
+  _deleted.for_each([&](const T &v, std::uint64_t weight) {
+    weighted.push_back({&v, -(double) weight});
+  });
+
+  // Deletes sort before adds of an equal value, so an add is only taken once
+  // its value's deletes are counted
+  std::sort(weighted.begin(), weighted.end(),
+            [&](const std::pair<const T *, double> &a,
+                const std::pair<const T *, double> &b) {
+              if (_cmp(*a.first, *b.first) || _cmp(*b.first, *a.first))
+                return _cmp(*a.first, *b.first);
+              return a.second < b.second;
+            });
+
+  double target = std::clamp(q, 0.0, 1.0) *
+    ((double) _added.count() - (double) _deleted.count());
+  double below = 0;
+  const T *last = nullptr;
+  for (const auto &[value, weight] : weighted) {
+    if (weight > 0) {
+      last = value;
+      if (below + weight > target)
+        return *value;
+    }
+    below += weight;
+  }
+
+  return *last;
+}
+
+/***************** End treeset_quantile_sketch definition ****************/
+
+#endif
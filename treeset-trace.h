@@ -0,0 +1,246 @@
+#ifndef TREESET_TRACE_HH
+#define TREESET_TRACE_HH
+
+#include "treeset.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <type_traits>
+#include <vector>
+
+/*!
+A trace is a compact binary log of the operations performed on a set, so a
+workload seen in production can be replayed offline against other TreeSet
+configurations. It starts with an 8-byte magic string and one byte giving the
+size of a key, followed by one record per operation: a single op byte and the
+raw bytes of the key (two keys for a range). Keys are stored in native byte
+order, so a trace is only portable between machines of the same endianness.
+*/
+namespace treeset_trace {
+
+  //! Magic string at the start of every trace
+  const char MAGIC[8] = {'T', 'S', 'T', 'R', 'A', 'C', 'E', '1'};
+
+  //! Operations that can appear in a trace; the values are the op bytes.
+  enum op : uint8_t {
+    ADD = 'a',
+    DEL = 'd',
+    CONTAINS = 'c',
+    RANGE = 'r'     //!< visit every value in [key, hi)
+  };
+
+  //! One traced operation. hi is only meaningful for RANGE.
+  template <typename T>
+  struct record {
+    op kind;
+    T key;
+    T hi;
+  };
+}
+
+/*!
+TraceWriter appends operation records for keys of type T to an output stream.
+Keys are written as raw bytes, so T must be trivially copyable (integers,
+enums, plain structs of those).
+*/
+template <typename T>
+class TraceWriter {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "traced keys are stored as raw bytes");
+
+  std::ostream &_out;
+
+  //! Writes the raw bytes of one key
+  void write_key(const T &key) {
+    _out.write(reinterpret_cast<const char *>(&key), sizeof(T));
+  };
+
+public:
+  //! Constructor writes the trace header to out
+  TraceWriter(std::ostream &out) : _out(out) {
+    _out.write(treeset_trace::MAGIC, sizeof(treeset_trace::MAGIC));
+    _out.put((char) sizeof(T));
+  };
+
+  //! Records a single-key operation
+  void write(treeset_trace::op kind, const T &key) {
+    _out.put((char) kind);
+    write_key(key);
+  };
+
+  //! Records a range operation over [lo, hi)
+  void write_range(const T &lo, const T &hi) {
+    _out.put((char) treeset_trace::RANGE);
+    write_key(lo);
+    write_key(hi);
+  };
+};
+
+/*!
+TraceReader reads back the records written by a TraceWriter<T>. A stream with
+a bad header, or with keys of a different size, reads as an empty trace and
+reports !ok().
+*/
+template <typename T>
+class TraceReader {
+  static_assert(std::is_trivially_copyable_v<T>,
+                "traced keys are stored as raw bytes");
+
+  std::istream &_in;
+  bool _ok;
+
+  //! Reads the raw bytes of one key, returning false at end of stream
+  bool read_key(T &key) {
+    return (bool) _in.read(reinterpret_cast<char *>(&key), sizeof(T));
+  };
+
+public:
+  //! Constructor reads and checks the trace header
+  TraceReader(std::istream &in) : _in(in) {
+    char magic[sizeof(treeset_trace::MAGIC)];
+    char key_size = 0;
+    _ok = _in.read(magic, sizeof(magic)) && _in.get(key_size) &&
+          memcmp(magic, treeset_trace::MAGIC, sizeof(magic)) == 0 &&
+          key_size == (char) sizeof(T);
+  };
+
+  //! Returns true if the header was valid for keys of type T
+  bool ok() const { return _ok; };
+
+  /*! Reads the next record into r. Returns false at the end of the trace (a
+    truncated final record is dropped), or at an unknown op byte.
+  */
+  bool next(treeset_trace::record<T> &r) {
+    char kind;
+    if (!_ok || !_in.get(kind))
+      return false;
+
+    r.kind = (treeset_trace::op) kind;
+    if (r.kind != treeset_trace::ADD && r.kind != treeset_trace::DEL &&
+        r.kind != treeset_trace::CONTAINS && r.kind != treeset_trace::RANGE)
+      return false;
+    if (!read_key(r.key))
+      return false;
+
+    if (r.kind == treeset_trace::RANGE)
+      return read_key(r.hi);
+
+    return true;
+  };
+
+  //! Reads all remaining records into memory.
+  std::vector<treeset_trace::record<T>> read_all() {
+    std::vector<treeset_trace::record<T>> records;
+    treeset_trace::record<T> r;
+    while (next(r))
+      records.push_back(r);
+    return records;
+  };
+};
+
+/*!
+RecordingTreeSet is an opt-in wrapper around a TreeSet that behaves exactly
+like the set it wraps, and additionally logs every add, del, contains and range
+operation to a TraceWriter while recording is switched on. Reads that go
+straight to the wrapped set through set() are not recorded.
+*/
+template <typename T, typename Compare = std::less<T>>
+class RecordingTreeSet {
+  TreeSet<T, Compare> _set;
+
+  //! Where operations are logged, or nullptr while recording is off
+  TraceWriter<T> *_trace = nullptr;
+
+  //! Comparator used for the items in the set
+  Compare _cmp;
+
+public:
+  //! Constructor wraps an empty set, with recording off
+  RecordingTreeSet() { };
+
+  //! Starts logging operations to trace, or stops logging if it is nullptr.
+  void record_to(TraceWriter<T> *trace) { _trace = trace; };
+
+  //! Adds value to the set, as TreeSet::add()
+  bool add(const T &value) {
+    if (_trace)
+      _trace->write(treeset_trace::ADD, value);
+    return _set.add(value);
+  };
+
+  //! Removes value from the set, as TreeSet::del()
+  bool del(const T &value) {
+    if (_trace)
+      _trace->write(treeset_trace::DEL, value);
+    return _set.del(value);
+  };
+
+  //! Returns whether the value appears in the set, as TreeSet::contains()
+  bool contains(const T &value) const {
+    if (_trace)
+      _trace->write(treeset_trace::CONTAINS, value);
+    return _set.contains(value);
+  };
+
+  /*! Calls f on every value in [lo, hi) in order, and returns the number of
+    values visited.
+  */
+  template <typename F>
+  int for_range(const T &lo, const T &hi, F f) const {
+    if (_trace)
+      _trace->write_range(lo, hi);
+
+    int visited = 0;
+    for (auto it = _set.lower_bound(lo); it != _set.end() && _cmp(*it, hi);
+         ++it, ++visited)
+      f(*it);
+    return visited;
+  };
+
+  //! Returns the number of elements in the set.
+  int size() const { return _set.size(); };
+
+  //! Returns the wrapped set, for reads that should not be recorded.
+  const TreeSet<T, Compare>& set() const { return _set; };
+};
+
+/*!
+Re-executes the traced operations against set, which can be a TreeSet or
+anything with the same add(), del(), contains() and lower_bound() interface.
+Returns a checksum of the results (lookups that hit plus values visited by
+ranges), which must be the same for every set a trace is replayed against.
+*/
+template <typename Set, typename T, typename Compare = std::less<T>>
+uint64_t replay_trace(const std::vector<treeset_trace::record<T>> &records,
+                      Set &set) {
+  Compare cmp;
+  uint64_t checksum = 0;
+
+  for (const treeset_trace::record<T> &r : records) {
+    switch (r.kind) {
+    case treeset_trace::ADD:
+      set.add(r.key);
+      break;
+
+    case treeset_trace::DEL:
+      set.del(r.key);
+      break;
+
+    case treeset_trace::CONTAINS:
+      checksum += set.contains(r.key);
+      break;
+
+    case treeset_trace::RANGE:
+      for (auto it = set.lower_bound(r.key); it != set.end() && cmp(*it, r.hi);
+           ++it)
+        checksum++;
+      break;
+    }
+  }
+
+  return checksum;
+}
+
+#endif
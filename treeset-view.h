@@ -0,0 +1,203 @@
+#ifndef TREESET_VIEW_HH
+#define TREESET_VIEW_HH
+
+#include "treeset.h"
+
+#include <algorithm>
+#include <cassert>
+#include <iostream>
+#include <span>
+
+/*!
+TreeSetView gives the read-only TreeSet interface to values that already sit
+in a sorted, duplicate-free array owned by someone else, such as a buffer read
+from a file or received over RPC. It holds only a std::span, so building one,
+copying one and querying one never copies or allocates; lookups are binary
+searches over the array. Set algebra between a view and a TreeSet (in either
+order) or another view merges straight from the array and returns an owning
+TreeSet.
+The values must stay alive and unchanged for as long as the view is used, and
+must be strictly increasing in the order of Compare (checked by assert()).
+This header is included by treeset.h.
+*/
+template <typename T, typename Compare = std::less<T>>
+class TreeSetView {
+  std::span<const T> _values;
+
+  //! Comparator that orders the values
+  Compare _cmp;
+
+  //! Returns whether the values are strictly increasing under _cmp.
+  bool sanity_check() const;
+
+public:
+  //! Iterators are plain pointers into the viewed array
+  using iterator = typename std::span<const T>::iterator;
+
+  //! An empty view
+  TreeSetView() { };
+
+  //! A view of values, which must be sorted and free of duplicates.
+  TreeSetView(std::span<const T> values) : _values(values) {
+    assert(sanity_check());
+  };
+
+  //! Returns the viewed values
+  std::span<const T> values() const { return _values; };
+
+  //! Return an iterator to the first value in the view
+  iterator begin() const { return _values.begin(); };
+
+  //! Return an iterator "past the end" of the view
+  iterator end() const { return _values.end(); };
+
+  //! Return an iterator to the first value that is not less than value.
+  iterator lower_bound(const T &value) const {
+    return std::lower_bound(begin(), end(), value, _cmp);
+  };
+
+  //! Return an iterator to the first value that is greater than value.
+  iterator upper_bound(const T &value) const {
+    return std::upper_bound(begin(), end(), value, _cmp);
+  };
+
+  /*! Copies the values in [lo, hi), in order, into out until it is full.
+    Returns how many values were copied, as TreeSet::copy_range().
+  */
+  std::size_t copy_range(const T &lo, const T &hi, std::span<T> out) const;
+
+  /*! For views of tuples in ascending lexicographic order, returns the
+    sub-view of values whose leading columns equal prefix (the last of which
+    may be a column_range), as TreeSet::prefix_range().
+  */
+  template <typename... Prefix>
+  TreeSetView<T, Compare> prefix_range(const Prefix &... prefix) const;
+
+  //! Returns the number of values in the view.
+  int size() const { return (int) _values.size(); };
+
+  //! Returns whether the value appears in the view or not.
+  bool contains(const T &value) const {
+    iterator it = lower_bound(value);
+    return it != end() && !_cmp(value, *it);
+  };
+
+  //! Returns true if the rhs view holds the same values as this view.
+  bool operator==(const TreeSetView<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const TreeSetView<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  };
+
+  //! Returns true if the set s holds the same values as this view.
+  bool operator==(const TreeSet<T, Compare> &s) const { return s == *this; };
+
+  //! Inverse of ==
+  bool operator!=(const TreeSet<T, Compare> &s) const { return s != *this; };
+
+  //! Computes the set-union of this view and the set s, as a new set.
+  TreeSet<T, Compare> plus(const TreeSet<T, Compare> &s) const {
+    return TreeSet<T, Compare>::union_of(*this, s);
+  };
+
+  //! Computes the set-intersection of this view and the set s.
+  TreeSet<T, Compare> intersect(const TreeSet<T, Compare> &s) const {
+    return TreeSet<T, Compare>::intersection_of(*this, s);
+  };
+
+  //! Computes the set-difference of this view and the set s.
+  TreeSet<T, Compare> minus(const TreeSet<T, Compare> &s) const {
+    return TreeSet<T, Compare>::difference_of(*this, s);
+  };
+
+  //! Computes the set-union of this view and the view v, as a new set.
+  TreeSet<T, Compare> plus(const TreeSetView<T, Compare> &v) const {
+    return TreeSet<T, Compare>::union_of(*this, v);
+  };
+
+  //! Computes the set-intersection of this view and the view v.
+  TreeSet<T, Compare> intersect(const TreeSetView<T, Compare> &v) const {
+    return TreeSet<T, Compare>::intersection_of(*this, v);
+  };
+
+  //! Computes the set-difference of this view and the view v.
+  TreeSet<T, Compare> minus(const TreeSetView<T, Compare> &v) const {
+    return TreeSet<T, Compare>::difference_of(*this, v);
+  };
+};
+
+template <typename T, typename Compare> inline
+bool TreeSetView<T, Compare>::sanity_check() const {
+  auto out_of_order = [&](const T &a, const T &b) { return !_cmp(a, b); };
+
+  if (std::adjacent_find(begin(), end(), out_of_order) != end()) {
+    std::cerr << "TreeSetView values are not strictly increasing" << std::endl;
+    return false;
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare> inline
+std::size_t TreeSetView<T, Compare>::copy_range(const T &lo, const T &hi,
+                                                std::span<T> out) const {
+  iterator first = lower_bound(lo);
+  iterator last = std::lower_bound(first, end(), hi, _cmp);
+
+  std::size_t count = std::min<std::size_t>(last - first, out.size());
+  std::copy_n(first, count, out.begin());
+  return count;
+}
+
+template <typename T, typename Compare>
+template <typename... Prefix> inline
+TreeSetView<T, Compare>
+TreeSetView<T, Compare>::prefix_range(const Prefix &... prefix) const {
+  static_assert(std::is_same_v<Compare, std::less<T>> ||
+                std::is_same_v<Compare, std::less<>>,
+                "prefix_range needs values in ascending lexicographic order");
+  static_assert(sizeof...(Prefix) <= std::tuple_size_v<T>,
+                "prefix_range has more columns than the values do");
+
+  auto probe = std::forward_as_tuple(prefix...);
+  auto before = [&](const T &v) {
+    return TreeSet<T, Compare>::template compare_columns<0>(v, probe) < 0;
+  };
+  auto within = [&](const T &v) {
+    return TreeSet<T, Compare>::template compare_columns<0>(v, probe) <= 0;
+  };
+
+  iterator first = std::partition_point(begin(), end(), before);
+  iterator last = std::partition_point(first, end(), within);
+
+  TreeSetView<T, Compare> range;
+  range._values = std::span<const T>(first, last);
+  return range;
+}
+
+template <typename T, typename Compare> inline
+bool TreeSetView<T, Compare>::operator==(const TreeSetView<T, Compare> &rhs)
+  const {
+  return std::equal(begin(), end(), rhs.begin(), rhs.end(),
+                    [&](const T &a, const T &b) {
+                      return !_cmp(a, b) && !_cmp(b, a);
+                    });
+}
+
+/*! Outputs the values of the view in the same format as TreeSet: "[1,2,3]" */
+template <typename T, typename Compare>
+std::ostream& operator<<(std::ostream &os, const TreeSetView<T, Compare> &v) {
+  os << "[";
+
+  for (auto it = v.begin(); it != v.end(); ++it) {
+    if (it != v.begin())
+      os << ",";
+    os << *it;
+  }
+
+  os << "]";
+  return os;
+}
+
+#endif
@@ -1,46 +1,396 @@
 #ifndef TREESET_HH
 #define TREESET_HH
 
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <memory>
+#include <memory_resource>
 #include <limits>
+#include <span>
+#include <string>
+#include <string_view>
+#include <tuple>
 #include <initializer_list>
-#include <ostream>
-#include <stack>
+#include <iostream>
+#include <vector>
 #include <cassert>
 #include <functional>
 #include <type_traits>
+#include <utility>
+
+#include "treeset-probes.h"
+#include "treeset-sketch.h"
 
 /***************** Begin TreeSet declaration  ****************/
 
 template <typename T, typename Compare = std::less<T>>
 class TreeSetIter; //! Forward declaration of class TreeSetIter
 
+template <typename T, typename Compare>
+class BufferedTreeSet; //! Forward declaration of class BufferedTreeSet
+
+template <typename T, typename Compare>
+class ChunkedTreeSetCodec; //! Forward declaration of ChunkedTreeSetCodec
+
+template <typename T, typename Compare>
+class TreeSetView; //! Forward declaration of class TreeSetView
+
+/*!
+column_range is the last argument of TreeSet::prefix_range() when the column
+after an exact prefix should fall in [lo, hi) rather than equal one value.
+*/
+template <typename C>
+struct column_range {
+  C lo;
+  C hi;
+};
+
+//! Tells column_range arguments apart from plain column values
+template <typename C>
+struct is_column_range : std::false_type { };
+
+template <typename C>
+struct is_column_range<column_range<C>> : std::true_type { };
+
+/*!
+treeset_value_layout chooses where a TreeSet keeps its values. By default,
+values up to a cache line in size live inside the tree nodes, and larger ones
+out of line in the value arena, so the nodes a search passes through stay
+small and packed together, and it only touches the values it actually
+compares. Specialize it to choose for a particular T.
+*/
+template <typename T>
+struct treeset_value_layout {
+  static constexpr bool out_of_line = sizeof(T) > 64;
+};
+
+/*! Returns the arena that out-of-line values are allocated from: pools of
+  same-sized blocks carved from large chunks, apart from the tree nodes. It is
+  never destroyed, so sets that outlive main() can still free their values.
+*/
+inline std::pmr::memory_resource &treeset_value_arena() {
+  static std::pmr::memory_resource *arena =
+    new std::pmr::synchronized_pool_resource;
+  return *arena;
+}
+
+//! Deleter for values allocated in the value arena
+template <typename T>
+struct treeset_arena_delete {
+  void operator()(const T *value) const {
+    value->~T();
+    treeset_value_arena().deallocate(const_cast<T *>(value), sizeof(T),
+                                     alignof(T));
+  }
+};
+
+/*!
+treeset_node_pool recycles the memory of one TreeSet's nodes. Each slot holds a
+node together with its shared_ptr control block. Slots are carved from slabs
+that grow geometrically, or from one block of the size given to reserve(),
+and freed slots go on a free list for the next node rather than back to the
+heap. A set that is emptied and refilled to a similar size therefore stops
+allocating once its slabs are big enough.
+A set can let go of its pool before its last nodes are freed (a move-assigned
+set drops its pool along with its old tree), so the pool counts its live slots
+plus the set that owns it, and deletes itself when the count drops to zero.
+Like a TreeSet, a pool must only be modified by one thread at a time; moving a
+set hands its pool over with its tree, so the pool never has two owners.
+*/
+class treeset_node_pool {
+  struct free_slot {
+    free_slot *next;
+  };
+
+  //! Size of every slot, known from the first allocation (0 until then)
+  std::size_t _slot_size = 0;
+
+  //! Slots in all slabs, and the capacity asked for by reserve()
+  std::size_t _capacity = 0;
+  std::size_t _reserved = 0;
+
+  //! Freed slots, and the untouched rest of the newest slab
+  free_slot *_free = nullptr;
+  char *_fresh = nullptr;
+  char *_fresh_end = nullptr;
+
+  //! Slabs, chained through a header at the front of each
+  struct slab_header {
+    slab_header *next;
+  };
+  slab_header *_slabs = nullptr;
+
+  //! Bytes at the front of a slab before its first slot
+  static constexpr std::size_t HEADER_SIZE = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+
+  //! Live slots plus owning sets
+  long _refs = 1;
+
+  //! Adds a slab of count slots, putting any fresh slots left on the free list.
+  void add_slab(std::size_t count) {
+    while (_fresh != _fresh_end) {
+      deallocate_slot(_fresh);
+      _fresh += _slot_size;
+    }
+
+    char *slab = static_cast<char *>(
+      ::operator new(HEADER_SIZE + count * _slot_size));
+    _slabs = new (slab) slab_header{_slabs};
+    _fresh = slab + HEADER_SIZE;
+    _fresh_end = _fresh + count * _slot_size;
+    _capacity += count;
+  };
+
+  void deallocate_slot(void *p) {
+    _free = new (p) free_slot{_free};
+  };
+
+  ~treeset_node_pool() {
+    while (_slabs != nullptr) {
+      slab_header *next = _slabs->next;
+      ::operator delete(_slabs);
+      _slabs = next;
+    }
+  };
+
+public:
+  //! Returns memory for one object of size bytes, counting it as live.
+  void *allocate(std::size_t size) {
+    if (_slot_size == 0) {
+      // Slots keep the alignment that operator new guarantees
+      std::size_t align = __STDCPP_DEFAULT_NEW_ALIGNMENT__;
+      _slot_size = (std::max(size, sizeof(free_slot)) + align - 1) /
+                   align * align;
+      reserve(_reserved);
+    }
+    if (size > _slot_size)
+      return ::operator new(size);
+
+    _refs++;
+    if (_free != nullptr) {
+      void *p = _free;
+      _free = _free->next;
+      return p;
+    }
+
+    if (_fresh == _fresh_end)
+      add_slab(std::max<std::size_t>(_capacity, 16));
+
+    void *p = _fresh;
+    _fresh += _slot_size;
+    return p;
+  };
+
+  //! Returns memory from allocate() to the pool.
+  void deallocate(void *p, std::size_t size) {
+    if (size > _slot_size) {
+      ::operator delete(p);
+      return;
+    }
+
+    deallocate_slot(p);
+    release();
+  };
+
+  /*! Makes room for count slots in all, in one new slab. If no slot has been
+    allocated yet, the slab waits for the first allocation, which tells the
+    pool how big a slot is.
+  */
+  void reserve(std::size_t count) {
+    if (_slot_size == 0)
+      _reserved = std::max(_reserved, count);
+    else if (count > _capacity)
+      add_slab(count - _capacity);
+  };
+
+  //! Drops one reference, deleting the pool after the last.
+  void release() {
+    if (--_refs == 0)
+      delete this;
+  };
+};
+
+//! unique_ptr deleter for the owning set's reference to its node pool
+struct treeset_node_pool_release {
+  void operator()(treeset_node_pool *pool) const { pool->release(); }
+};
+
+//! Allocator that puts TreeSet nodes (and their control blocks) in a pool
+template <typename U>
+struct treeset_node_allocator {
+  using value_type = U;
+
+  treeset_node_pool *pool;
+
+  treeset_node_allocator(treeset_node_pool *pool) : pool(pool) { }
+
+  template <typename V>
+  treeset_node_allocator(const treeset_node_allocator<V> &other)
+    : pool(other.pool) { }
+
+  U *allocate(std::size_t n) {
+    if (n != 1 || alignof(U) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      return std::allocator<U>().allocate(n);
+    return static_cast<U *>(pool->allocate(sizeof(U)));
+  }
+
+  void deallocate(U *p, std::size_t n) {
+    if (n != 1 || alignof(U) > __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+      std::allocator<U>().deallocate(p, n);
+    else
+      pool->deallocate(p, sizeof(U));
+  }
+
+  template <typename V>
+  bool operator==(const treeset_node_allocator<V> &other) const {
+    return pool == other.pool;
+  }
+};
+
+/*!
+treeset_key_prefix can be specialized to give TreeSet a compact prefix of each
+value's key, which is kept in the tree nodes and compared first while
+searching. A specialization defines the prefix type (ordered by operator<) and
+a static function type of(const T &value), such that of(a) < of(b) implies
+Compare{}(a, b). Values with equal prefixes are compared in full.
+*/
+template <typename T, typename Compare>
+struct treeset_key_prefix { };
+
+//! True if treeset_key_prefix has been specialized for T and Compare
+template <typename T, typename Compare>
+concept has_key_prefix = requires (const T &value) {
+  treeset_key_prefix<T, Compare>::of(value);
+};
+
+//! The key prefix TreeSet keeps in its nodes: an empty struct if there is none
+template <typename T, typename Compare>
+struct treeset_prefix_type {
+  struct type { };
+};
+
+template <typename T, typename Compare>
+  requires has_key_prefix<T, Compare>
+struct treeset_prefix_type<T, Compare> {
+  using type = decltype(treeset_key_prefix<T, Compare>::of(
+                          std::declval<const T &>()));
+};
+
+/*!
+The abbreviated key of a string: its first 8 bytes packed big-endian into an
+integer, zero-padded if it is shorter. Strings compare as unsigned bytes, so
+a smaller abbreviation means a smaller string; equal ones (shared first 8
+bytes, or zero padding against real zero bytes) say nothing.
+*/
+struct treeset_string_prefix {
+  static std::uint64_t of(std::string_view s) {
+    std::uint64_t packed = 0;
+    std::memcpy(&packed, s.data(), std::min<std::size_t>(s.size(), 8));
+    if constexpr (std::endian::native == std::endian::little)
+      packed = __builtin_bswap64(packed);
+    return packed;
+  };
+};
+
+/*! Strings have a built-in key prefix, so a descent compares the integers in
+  the nodes and reads a string's characters only when the first 8 bytes tie.
+*/
+template <>
+struct treeset_key_prefix<std::string, std::less<std::string>>
+  : treeset_string_prefix { };
+
+template <>
+struct treeset_key_prefix<std::string, std::less<>>
+  : treeset_string_prefix { };
+
+template <>
+struct treeset_key_prefix<std::string_view, std::less<std::string_view>>
+  : treeset_string_prefix { };
+
+//! Descending strings order their abbreviations the other way round
+template <>
+struct treeset_key_prefix<std::string, std::greater<std::string>> {
+  static std::uint64_t of(const std::string &s) {
+    return ~treeset_string_prefix::of(s);
+  };
+};
+
 /*!
 TreeSet is an ordered-set data type that internally uses a binary search tree to
-store and retrieve its values.
+store and retrieve its values. The tree is kept balanced as a scapegoat tree:
+whenever an add leaves a node deeper than log base 1/ALPHA of the node count,
+the smallest enclosing subtree that has grown lopsided is rebuilt perfectly
+balanced, so every operation takes O(log n) amortized comparisons. Values are
+only ever compared with the Compare function; two values are the same when
+neither is less than the other. Sets of keys of at most 16 bits are stored as
+bitmaps instead (see treeset-bitmap.h).
 */
 template <typename T, typename Compare = std::less<T>>
 class TreeSet {
+  //! Whether values are kept out of line (see treeset_value_layout)
+  static constexpr bool VALUES_OUT_OF_LINE =
+    treeset_value_layout<T>::out_of_line;
+
+  //! Type of the key prefix kept in each node
+  using prefix_type = typename treeset_prefix_type<T, Compare>::type;
+
   /*!
     Node is the internal (and private) tree representation used by the TreeSet.
+    The fields a search reads come first.
   */
   struct node {
-    T value;
     std::shared_ptr<node> left;
     std::shared_ptr<node> right;
 
+    //! Prefix of the value's key, if T has one (see treeset_key_prefix)
+    [[no_unique_address]] prefix_type prefix;
+
+    //! Tombstone flag set by lazy deletion. Deleted nodes are skipped by reads.
+    bool deleted = false;
+
+    //! The value itself, or a pointer to it if values are kept out of line
+    using stored_type =
+      std::conditional_t<VALUES_OUT_OF_LINE,
+                         std::unique_ptr<const T, treeset_arena_delete<T>>, T>;
+    stored_type stored;
+
+    //! Returns a copy of value, in the arena if values are kept out of line
+    static stored_type store(const T &value);
+
     //! node constructor that sets the value of the node
-    node(const T &value) : value(value) { };
+    node(const T &value);
 
     //! node Copy-Contructor to make a deep copy of the tree node
     node(const std::shared_ptr<node> &other);
 
-    //! Replaces one of the node's children with a new node (or empty smart-ptr)
-    void replace_child(const std::shared_ptr<node> &old_child,
-                       const std::shared_ptr<node> &new_child);
+    //! Returns the value held by the node
+    const T& value() const {
+      if constexpr (VALUES_OUT_OF_LINE)
+        return *stored;
+      else
+        return stored;
+    };
   };
   using sp_node = std::shared_ptr<node>;
 
+  //! Returns the key prefix of value (or nothing if T has none).
+  static prefix_type key_prefix(const T &value);
+
+  /*! Returns whether value (whose key prefix is prefix) is less than the value
+    in node n, comparing the full values only if the prefixes are equal.
+  */
+  bool less_than_node(const T &value, const prefix_type &prefix,
+                      const node *n) const;
+
+  //! Where this set's nodes are allocated and recycled; created on first use.
+  std::unique_ptr<treeset_node_pool, treeset_node_pool_release> _pool;
+
+  //! Returns a new node holding value, allocated from the node pool.
+  sp_node make_node(const T &value);
+
   //! The root node of the binary search tree.
   sp_node _root;
 
@@ -50,6 +400,46 @@ class TreeSet {
   //! Comparator used for the items in the TreeSet
   Compare _cmp;
 
+  //! Number of tombstoned (lazily deleted) nodes still linked into the tree.
+  int _tombstones = 0;
+
+  //! When true, del() only marks nodes as deleted instead of unlinking them.
+  bool _lazy_delete = false;
+
+  //! Fraction of tombstoned nodes in the tree that triggers compaction.
+  double _max_tombstone_fraction = 0.25;
+
+  /*! Weight balance of the scapegoat tree: a subtree is lopsided, and gets
+    rebuilt, when one child holds more than ALPHA of its nodes.
+  */
+  static constexpr double ALPHA = 2.0 / 3.0;
+
+  /*! Largest number of nodes (live or tombstoned) in the tree since it was
+    last rebuilt as a whole.
+  */
+  int _max_nodes = 0;
+
+  //! Optional rank/quantile sketch of the values (see enable_sketch()).
+  std::unique_ptr<treeset_quantile_sketch<T, Compare>> _sketch;
+
+  /*! Whether the sketch missed a change to the set because updating it threw.
+    A stale sketch is not read; the next update rebuilds it instead.
+  */
+  bool _sketch_stale = false;
+
+  //! Rebuilds the sketch from the values now in the set.
+  void rebuild_sketch();
+
+  /*! Records a change the set has already made in the sketch by calling
+    update(), or rebuilds the sketch if it is stale. Never throws, so the
+    change stands: if the sketch cannot allocate, it is marked stale instead.
+  */
+  template <typename Update>
+  void update_sketch(Update update) noexcept;
+
+  //! Returns a sketch rebuilt from the values, for reading a stale one.
+  treeset_quantile_sketch<T, Compare> fresh_sketch() const;
+
   /*! Verifies that the node n holds a value between minval & maxval, and then
     recursively checks the children of n with the same function, updating minval
     and/or maxval appropriately. The function prints all identified issues to cerr
@@ -66,19 +456,124 @@ class TreeSet {
   */
   bool sanity_check(const sp_node &n) const;
 
-  /*! Merge two subtrees of a binary search tree into one while maintaining the
-    binary search tree invariant. Assumes small node is left subtree and big node
-    is right subtree.
+  //! Returns how deep a node may lie before the tree must be rebalanced.
+  int depth_bound() const;
+
+  //! Returns the number of nodes (live or tombstoned) in the subtree n.
+  static int count_nodes(const node *n);
+
+  /*! Prepends the live nodes of subtree n, in order, to the list starting at
+    head (linked through the nodes' right pointers), and returns how many were
+    added. Tombstoned nodes are left out and counted in dropped.
+  */
+  static int flatten(const sp_node &n, sp_node &head, int &dropped);
+
+  /*! Links the first count nodes of the list starting at head into a perfectly
+    balanced binary search tree, advances head past them, and returns the root.
+  */
+  static sp_node build_from_list(sp_node &head, int count);
+
+  /*! Rebuilds the subtree in slot perfectly balanced, dropping its tombstones,
+    and returns its new number of nodes. Nodes are relinked rather than copied,
+    so this never allocates.
+  */
+  int rebuild(sp_node &slot);
+
+  //! Rebuilds the whole tree balanced, and restarts the count for _max_nodes.
+  void rebuild_all();
+
+  /*! Descends from slot (at the given depth) to the node target, and if
+    target is too deep, rebuilds the deepest lopsided subtree on the way back
+    up (the "scapegoat"). One rebuild always suffices after adding a single
+    node; after hanging a whole subtree, the rebuilt subtree may still reach
+    too deep, and then the search goes on up the path. Returns the number of
+    nodes under slot while still looking, or -1 once nothing is too deep.
+  */
+  int rebalance_toward(sp_node &slot, const node *target, int depth);
+
+  /*! Unlinks the node in slot from the tree. A node with two children is
+    replaced by its in-order successor, which is moved rather than copied.
+  */
+  static void unlink(sp_node &slot) noexcept;
+
+  /*! Makes this set hold the count nodes of a sorted list (as produced by
+    flatten), linked into a balanced tree.
+  */
+  void adopt_sorted_list(sp_node &head, int count);
+
+  /*! Links nodes[lo, hi) into a perfectly balanced binary search tree and
+    returns its root. Assumes nodes are in sorted order.
+  */
+  static sp_node build_balanced(const std::vector<sp_node> &nodes, int lo,
+                                int hi);
+
+  /*! Applies a batch of ops to the tree in one pass. Each op is a value paired
+    with true (add) or false (del); the ops must be sorted by value with at most
+    one op per value. The batch is split around each node's value on the way
+    down, so every node is visited at most once. The descent proceeds a level at
+    a time and prefetches the whole level before visiting it, so the batch's
+    independent cache misses overlap instead of being paid one after another.
+    Runs of adds that land in the same empty slot are hung there as a balanced
+    subtree.
+    The pass first plans every change, doing all of its allocation up front,
+    and then commits the plan with pointer swaps that cannot throw. So either
+    the whole batch is applied or (if an allocation fails) none of it is.
   */
-  sp_node merge(const sp_node &small, sp_node &big);
+  void apply_sorted(const std::vector<std::pair<T, bool>> &ops);
+
+  /*! Returns an iterator to the first value v for which below(v) is false,
+    where below must be true for every value before some point in the set's
+    order and false from there on.
+  */
+  template <typename Below>
+  TreeSetIter<T, Compare> first_not_below(Below below) const;
+
+  /*! Compares columns I and up of the tuple v with a probe of leading
+    columns (the last of which may be a column_range). Returns <0, 0 or >0 as
+    v sorts before, within or after the values matching the probe.
+  */
+  template <std::size_t I, typename Probe>
+  static int compare_columns(const T &v, const Probe &probe);
+
+  /*! The merges behind plus(), intersect() and minus(), for any two sets a
+    and b (TreeSets or TreeSetViews) in this set's order. Each walks both sets
+    once and builds the result as a balanced tree.
+  */
+  template <typename A, typename B>
+  static TreeSet<T, Compare> union_of(const A &a, const B &b);
+
+  template <typename A, typename B>
+  static TreeSet<T, Compare> intersection_of(const A &a, const B &b);
+
+  template <typename A, typename B>
+  static TreeSet<T, Compare> difference_of(const A &a, const B &b);
 
 public:
   //! As a friend, TreeSetIter has access to all private members of TreeSet
   friend class TreeSetIter<T, Compare>;
+
+  //! BufferedTreeSet flushes its write buffer through apply_sorted()
+  friend class BufferedTreeSet<T, Compare>;
+
+  //! ChunkedTreeSetCodec splits and joins subtrees to (de)serialize in parallel
+  friend class ChunkedTreeSetCodec<T, Compare>;
+
+  //! TreeSetView shares the set algebra merges and prefix_range() columns
+  friend class TreeSetView<T, Compare>;
   
   //! Provide "standard" name for iterator type
   using iterator = TreeSetIter<T, Compare>;
 
+  //! A run of values [begin(), end()) that can be used in a range-based for
+  struct value_range {
+    iterator first, last;
+
+    iterator begin() const { return first; };
+    iterator end() const { return last; };
+  };
+
+  class WriteBatch;
+
   //! Constructor initializes an empty set. Note: sp_node() creates nullptr.
   TreeSet() : _root(nullptr), _size(0), _cmp(Compare{}) { };
 
@@ -91,10 +586,10 @@ public:
   //! Copy-assignment operator
   TreeSet<T, Compare>& operator=(const TreeSet<T, Compare> &other);
 
-  //! Move-constructor
+  //! Move-constructor takes other's values (and sketch), leaving it empty
   TreeSet(TreeSet<T, Compare> &&other);
 
-  //! Move-assignment operator
+  //! Move-assignment operator, also leaving other empty
   TreeSet<T, Compare>& operator=(TreeSet<T, Compare> &&other);
 
   //! Destructor is explicity defaulted since we are using only smart pointers
@@ -106,20 +601,74 @@ public:
   //! Return an iterator "past the end" of the TreeSet. Use empty node pointer.
   TreeSetIter<T, Compare> end() const;
 
+  //! Return an iterator to the first value that is not less than value.
+  TreeSetIter<T, Compare> lower_bound(const T &value) const;
+
+  //! Return an iterator to the first value that is greater than value.
+  TreeSetIter<T, Compare> upper_bound(const T &value) const;
+
+  /*! Copies the values in [lo, hi), in order, into out until it is full.
+    Returns how many values were copied; fewer than out.size() means the
+    whole range was copied. See also TreeSetIter::next_batch().
+  */
+  std::size_t copy_range(const T &lo, const T &hi, std::span<T> out) const;
+
+  /*! For sets of tuples (or pairs) in ascending lexicographic order, returns
+    the values whose leading columns equal prefix, e.g. prefix_range(tenant)
+    on a set of (tenant, timestamp, id) tuples. The last argument can instead
+    be a column_range, as in prefix_range(tenant, column_range{t0, t1}), to
+    select values whose next column lies in [t0, t1). The prefix columns are
+    compared with the tuple's columns directly, so no sentinel tuples are
+    built, and finding the range takes O(log n) comparisons.
+  */
+  template <typename... Prefix>
+  value_range prefix_range(const Prefix &... prefix) const;
+
   //! Returns true if the rhs set contains the same values as this set.
-  bool operator==(const TreeSet<T, Compare> &rhs);
+  bool operator==(const TreeSet<T, Compare> &rhs) const;
+
+  //! Inverse of ==
+  bool operator!=(const TreeSet<T, Compare> &rhs) const {
+    return !(*this == rhs);
+  }
+
+  //! Returns true if the view v holds the same values as this set.
+  bool operator==(const TreeSetView<T, Compare> &v) const;
 
   //! Inverse of ==
-  bool operator!=(const TreeSet<T, Compare> &rhs) { return !(*this == rhs); }
+  bool operator!=(const TreeSetView<T, Compare> &v) const {
+    return !(*this == v);
+  }
 
   //! Computes the set-union of this set and the provided set s. Returns new set.
-  TreeSet<T, Compare> plus(const TreeSet<T, Compare> &s) const;
+  TreeSet<T, Compare> plus(const TreeSet<T, Compare> &s) const {
+    return union_of(*this, s);
+  };
 
   //! Computes the set-intersection of this set & provided set s. 
-  TreeSet<T, Compare> intersect(const TreeSet<T, Compare> &s) const;
+  TreeSet<T, Compare> intersect(const TreeSet<T, Compare> &s) const {
+    return intersection_of(*this, s);
+  };
 
   //! Computes the set-difference of this set & provided set s.
-  TreeSet<T, Compare> minus(const TreeSet<T, Compare> &s) const;
+  TreeSet<T, Compare> minus(const TreeSet<T, Compare> &s) const {
+    return difference_of(*this, s);
+  };
+
+  //! Set-union with the values of a view, without copying them first
+  TreeSet<T, Compare> plus(const TreeSetView<T, Compare> &v) const {
+    return union_of(*this, v);
+  };
+
+  //! Set-intersection with the values of a view
+  TreeSet<T, Compare> intersect(const TreeSetView<T, Compare> &v) const {
+    return intersection_of(*this, v);
+  };
+
+  //! Set-difference with the values of a view
+  TreeSet<T, Compare> minus(const TreeSetView<T, Compare> &v) const {
+    return difference_of(*this, v);
+  };
 
   //! Returns the number of elements in the set.
   int size() const { return _size; };
@@ -130,10 +679,103 @@ public:
   //! Attemps to remove value from the set.
   bool del(const T &value);
 
+  /*! Removes every value from the set. The nodes' memory stays in the set's
+    node pool, so adding values again allocates nothing until the set grows
+    past its earlier size.
+  */
+  void clear();
+
+  /*! Makes room in the node pool for n nodes in all, allocated as one block,
+    so that adds up to that size allocate nothing.
+  */
+  void reserve(int n);
+
+  /*! Turns lazy deletion on or off. In lazy mode, del() marks the node as a
+    tombstone instead of restructuring the tree, and the tree is compacted once
+    tombstones exceed max_tombstone_fraction of its nodes. Turning lazy mode off
+    compacts the tree right away.
+  */
+  void set_lazy_delete(bool lazy, double max_tombstone_fraction = 0.25);
+
+  //! Returns the number of tombstoned nodes waiting to be compacted away.
+  int tombstones() const { return _tombstones; };
+
+  //! Unlinks all tombstones and rebuilds the remaining nodes balanced.
+  void compact();
+
+  /*! Starts keeping an approximate sketch of the set's values, from which
+    approx_rank() and approx_quantile() answer without per-node counts. It
+    holds about 6k values whatever the size of the set, and its ranks are
+    within about 5 / k of size() with 99% confidence (see
+    treeset_quantile_sketch). add() and del() keep it up to date, and it is
+    rebuilt from the set once deletes since the last rebuild exceed size().
+    Updating the sketch never makes a change to the set throw: if it cannot
+    allocate, it is rebuilt at the next change, and until then the approx
+    functions work from a copy rebuilt on the spot.
+  */
+  void enable_sketch(int k = 200);
+
+  //! Stops keeping the sketch and frees it.
+  void disable_sketch() {
+    _sketch.reset();
+    _sketch_stale = false;
+  };
+
+  //! Returns whether the set keeps a sketch.
+  bool has_sketch() const { return _sketch != nullptr; };
+
+  //! Returns roughly how many values are less than value. Needs a sketch.
+  int approx_rank(const T &value) const;
+
+  /*! Returns a value with roughly q * size() values less than it, for q in
+    [0, 1]. Needs a sketch and a non-empty set.
+  */
+  T approx_quantile(double q) const;
+
+  /*! Applies all of the batch's adds and deletes in a single pass over the
+    tree. The batch is applied all-or-nothing: if it fails part way (because an
+    allocation throws), the set is left unchanged.
+  */
+  void apply(const WriteBatch &batch);
+
   //! Returns whether the value appears in the set or not.
   bool contains(const T &value) const;
 };
 
+/*!
+WriteBatch collects adds and deletes to be applied to a TreeSet all at once
+with TreeSet::apply(). Operations on the same value cancel out, so only the
+last one recorded for each value has any effect, just as if the operations had
+been applied one at a time in order.
+*/
+template <typename T, typename Compare>
+class TreeSet<T, Compare>::WriteBatch {
+  //! Recorded ops in order, each value paired with true (add) or false (del).
+  std::vector<std::pair<T, bool>> _ops;
+
+  //! Comparator used to sort the recorded ops
+  Compare _cmp;
+
+  //! Returns the ops sorted by value, keeping only the last op on each value.
+  std::vector<std::pair<T, bool>> sorted_ops() const;
+
+  //! As a friend, TreeSet can read the sorted ops when applying the batch
+  friend class TreeSet<T, Compare>;
+
+public:
+  //! Records that value should be added to the set.
+  void add(const T &value) { _ops.emplace_back(value, true); };
+
+  //! Records that value should be removed from the set.
+  void del(const T &value) { _ops.emplace_back(value, false); };
+
+  //! Returns the number of ops recorded so far (before cancellation).
+  size_t size() const { return _ops.size(); };
+
+  //! Forgets all recorded ops.
+  void clear() { _ops.clear(); };
+};
+
 /***************** End TreeSet declaration  ****************/
 
 
@@ -142,22 +784,79 @@ public:
 
 /***************** Begin TreeSetIter declaration & definition ****************/
 
-/*! TreeSetIter provides iterator functionality for the TreeSet
+/*! TreeSetIter provides iterator functionality for the TreeSet.
+  The iterator walks the tree through raw node pointers, so iterating never
+  touches the reference counts of the shared_ptrs that own the nodes. This keeps
+  concurrent readers of a const TreeSet from contending on the same cache lines.
+  As with the standard containers, an iterator is only valid while the TreeSet
+  it came from is alive and unmodified.
 */
 template <typename T, typename Compare>
 class TreeSetIter {
-  std::stack<typename TreeSet<T, Compare>::sp_node> _next_node_stack;
-  TreeSet<T, Compare>::sp_node _current_node;
+  using node = typename TreeSet<T, Compare>::node;
+
+  /*! Stack of nodes still waiting to be visited. The first entries live inside
+    the iterator itself, so creating and advancing iterators never allocates
+    unless the tree is unusually deep, in which case extra entries spill over
+    into a vector.
+  */
+  class node_stack {
+    static const int INLINE_CAPACITY = 32;
+
+    const node *_inline[INLINE_CAPACITY];
+    std::vector<const node *> _spill;
+    int _size = 0;
+
+  public:
+    bool empty() const { return _size == 0; };
+
+    void push(const node *n) {
+      if (_size < INLINE_CAPACITY)
+        _inline[_size] = n;
+      else
+        _spill.push_back(n);
+      _size++;
+    };
+
+    const node *top() const {
+      return _size <= INLINE_CAPACITY ? _inline[_size - 1] : _spill.back();
+    };
+
+    void pop() {
+      _size--;
+      if (_size >= INLINE_CAPACITY)
+        _spill.pop_back();
+    };
+  };
+
+  node_stack _next_node_stack;
+  const node *_current_node = nullptr;
 
   //! Inorder traversal to leftmost node, adding visited nodes to stack.
-  void inorder_traverse_to_leftmost_node(const TreeSet<T, Compare>::sp_node &n);
+  void inorder_traverse_to_leftmost_node(const node *n);
+
+  //! Pushes n and the chain of left children below it onto the stack.
+  void push_left_spine(const node *n);
+
+  /*! Moves the next node to visit from the top of the stack to current node,
+    skipping over (and descending past) any tombstoned nodes.
+  */
+  void pop_next_node();
+
+  /*! Starts loading the nodes visited after the current one into cache: the
+    current node's right subtree, and the ancestor waiting on the stack.
+  */
+  void prefetch_upcoming() const;
+
+  //! As a friend, TreeSet can position iterators for lower_bound/upper_bound
+  friend class TreeSet<T, Compare>;
 
 public:
   //! Default constructor
   TreeSetIter() { };
 
   //! Constructor
-  TreeSetIter(const TreeSet<T, Compare>::sp_node &root_node) {
+  TreeSetIter(const node *root_node) {
     inorder_traverse_to_leftmost_node(root_node);
   }
   
@@ -168,7 +867,15 @@ public:
   TreeSetIter<T, Compare> operator++(int);
 
   //! Dereference returns value of node being pointed to by iterator
-  T operator*();
+  const T& operator*() const;
+
+  /*! Copies values, starting with the current one, into out until it is full
+    or the set runs out, advancing the iterator past each value copied.
+    Returns how many values were copied. Upcoming nodes are prefetched while
+    values are copied, so filling large buffers is faster than stepping with
+    operator++.
+  */
+  std::size_t next_batch(std::span<T> out);
 
   //! Compares pointers of the tree nodes
   bool operator==(const TreeSetIter<T, Compare> &rhs) const;
@@ -181,27 +888,49 @@ public:
 
 template <typename T, typename Compare> inline
 void TreeSetIter<T, Compare>::inorder_traverse_to_leftmost_node(
-const TreeSet<T, Compare>::sp_node &from_node) {
-  // copy node shared_ptr to use for traversing the tree
-  typename TreeSet<T, Compare>::sp_node n = from_node;
-  
+const node *n) {
+  push_left_spine(n);
+  pop_next_node();
+}
+
+template <typename T, typename Compare> inline
+void TreeSetIter<T, Compare>::push_left_spine(const node *n) {
   while (n != nullptr) {
     _next_node_stack.push(n);
-    n = n->left;
+    n = n->left.get();
   }
+}
 
-  if (!_next_node_stack.empty()) {
-    _current_node = _next_node_stack.top();
+template <typename T, typename Compare> inline
+void TreeSetIter<T, Compare>::pop_next_node() {
+  while (!_next_node_stack.empty()) {
+    const node *n = _next_node_stack.top();
     _next_node_stack.pop();
-  } else {
-    _current_node = nullptr;
+
+    if (!n->deleted) {
+      _current_node = n;
+      return;
+    }
+
+    // n is a tombstone, so its in-order successor is next in line
+    push_left_spine(n->right.get());
   }
+
+  _current_node = nullptr;
+}
+
+template <typename T, typename Compare> inline
+void TreeSetIter<T, Compare>::prefetch_upcoming() const {
+  if (_current_node->right != nullptr)
+    __builtin_prefetch(_current_node->right.get());
+  if (!_next_node_stack.empty())
+    __builtin_prefetch(_next_node_stack.top());
 }
 
 template <typename T, typename Compare> inline
 TreeSetIter<T, Compare>& TreeSetIter<T, Compare>::operator++() {
   if (_current_node != nullptr)
-    inorder_traverse_to_leftmost_node(_current_node->right);
+    inorder_traverse_to_leftmost_node(_current_node->right.get());
 
   return *this;
 }
@@ -214,8 +943,21 @@ TreeSetIter<T, Compare> TreeSetIter<T, Compare>::operator++(int) {
 }
 
 template <typename T, typename Compare> inline
-T TreeSetIter<T, Compare>::operator*() {
-  return _current_node->value;
+const T& TreeSetIter<T, Compare>::operator*() const {
+  return _current_node->value();
+}
+
+template <typename T, typename Compare> inline
+std::size_t TreeSetIter<T, Compare>::next_batch(std::span<T> out) {
+  std::size_t count = 0;
+
+  while (count < out.size() && _current_node != nullptr) {
+    prefetch_upcoming();
+    out[count++] = _current_node->value();
+    ++(*this);
+  }
+
+  return count;
 }
 
 template <typename T, typename Compare> inline
@@ -243,9 +985,17 @@ TreeSet<T, Compare>::TreeSet(const std::initializer_list<T> &list)
 template <typename T, typename Compare> inline
 TreeSet<T, Compare>::TreeSet(const TreeSet<T, Compare> &other) {
   _size = other._size;
-  // call node copy constructor which makes a deep copy
+  _lazy_delete = other._lazy_delete;
+  _max_tombstone_fraction = other._max_tombstone_fraction;
+  _max_nodes = other._max_nodes;
+  if (other._sketch)
+    _sketch.reset(new treeset_quantile_sketch<T, Compare>(*other._sketch));
+  _sketch_stale = other._sketch_stale;
+
+  // call node copy constructor which makes a deep copy (tombstones included)
   if (other._size > 0) {
     _root = std::make_shared<node>(other._root);
+    _tombstones = other._tombstones;
   } else {
     _root = nullptr;
   }
@@ -259,12 +1009,21 @@ TreeSet<T, Compare>& TreeSet<T, Compare>::operator=(const TreeSet<T, Compare>
 
   // no need to set existing _root to nullptr. shared_ptr should cleanup itself
   _size = other._size;
-
-  // call node copy constructor which makes a deep copy
+  _lazy_delete = other._lazy_delete;
+  _max_tombstone_fraction = other._max_tombstone_fraction;
+  _max_nodes = other._max_nodes;
+  _sketch.reset(other._sketch
+                ? new treeset_quantile_sketch<T, Compare>(*other._sketch)
+                : nullptr);
+  _sketch_stale = other._sketch_stale;
+
+  // call node copy constructor which makes a deep copy (tombstones included)
   if (other.size() > 0) {
     _root = std::make_shared<node>(other._root);
+    _tombstones = other._tombstones;
   } else {
     _root = nullptr;
+    _tombstones = 0;
   }
 
   return *this;
@@ -272,8 +1031,17 @@ TreeSet<T, Compare>& TreeSet<T, Compare>::operator=(const TreeSet<T, Compare>
 
 template <typename T, typename Compare> inline
 TreeSet<T, Compare>::TreeSet(TreeSet<T, Compare> &&other)
-  : _root(other._root), _size(other._size) {
-  // no need to set other._root to nullptr. share_ptr should cleanup itself
+  : _pool(std::move(other._pool)), _root(std::move(other._root)),
+    _size(other._size), _tombstones(other._tombstones),
+    _lazy_delete(other._lazy_delete),
+    _max_tombstone_fraction(other._max_tombstone_fraction),
+    _max_nodes(other._max_nodes), _sketch(std::move(other._sketch)),
+    _sketch_stale(other._sketch_stale) {
+  // other is left empty, so the tree and its pool have a single owner
+  other._size = 0;
+  other._tombstones = 0;
+  other._max_nodes = 0;
+  other._sketch_stale = false;
 }
 
 template <typename T, typename Compare> inline
@@ -282,21 +1050,28 @@ TreeSet<T, Compare>& TreeSet<T, Compare>::operator=(TreeSet<T, Compare> &&other)
     return *this;
   
   _size = other._size;
-  
-  if (other.size() > 0) {
-    _root = other._root;
-  } else {
-    _root = nullptr;
-  }
-  
-  // no need to set other._root to nullptr. share_ptr should cleanup itself
-  
+  _lazy_delete = other._lazy_delete;
+  _max_tombstone_fraction = other._max_tombstone_fraction;
+  _max_nodes = other._max_nodes;
+  _tombstones = other._tombstones;
+  _sketch = std::move(other._sketch);
+  _sketch_stale = other._sketch_stale;
+
+  // Our old tree frees its nodes into our old pool, which lives until they
+  // are gone; other is left empty, so its tree and pool have a single owner
+  _root = std::move(other._root);
+  _pool = std::move(other._pool);
+  other._size = 0;
+  other._tombstones = 0;
+  other._max_nodes = 0;
+  other._sketch_stale = false;
+
   return *this;
 }
 
 template <typename T, typename Compare> inline
 TreeSet<T, Compare>::iterator TreeSet<T, Compare>::begin() const {
-  return TreeSetIter<T, Compare>{_root};
+  return TreeSetIter<T, Compare>{_root.get()};
 }
 
 template <typename T, typename Compare> inline
@@ -304,60 +1079,227 @@ TreeSet<T, Compare>::iterator TreeSet<T, Compare>::end() const {
   return TreeSetIter<T, Compare>{};
 }
 
-template <typename T, typename Compare> inline
-bool TreeSet<T, Compare>::operator==(const TreeSet<T, Compare> &rhs) {
-  auto this_it = begin();
-  auto rhs_it = rhs.begin();
-  
-  while (this_it != end() && rhs_it != rhs.end()) {
-    if (*this_it++ != *rhs_it++)
-      return false;
-  }
+template <typename T, typename Compare>
+template <typename Below> inline
+TreeSetIter<T, Compare> TreeSet<T, Compare>::first_not_below(Below below)
+  const {
+  TreeSetIter<T, Compare> it;
+  const node *n = _root.get();
 
-  return this_it == rhs_it; // both should equal end()
+  // Every node we step left from is still ahead of the iterator, so stack it
+  while (n != nullptr) {
+    if (below(n->value())) {
+      n = n->right.get();
+    } else {
+      it._next_node_stack.push(n);
+      n = n->left.get();
+    }
+  }
+
+  it.pop_next_node();
+  return it;
 }
 
 template <typename T, typename Compare> inline
-TreeSet<T, Compare> TreeSet<T, Compare>::plus(const TreeSet<T, Compare> &s)
+TreeSet<T, Compare>::iterator TreeSet<T, Compare>::lower_bound(const T &value)
   const {
-  TreeSet<T, Compare> new_set;
-  
-  for (auto this_it = begin(); this_it != end(); this_it++) {
-    new_set.add(*this_it);
+  return first_not_below([&](const T &v) { return _cmp(v, value); });
+}
+
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::iterator TreeSet<T, Compare>::upper_bound(const T &value)
+  const {
+  return first_not_below([&](const T &v) { return !_cmp(value, v); });
+}
+
+template <typename T, typename Compare>
+template <std::size_t I, typename Probe> inline
+int TreeSet<T, Compare>::compare_columns(const T &v, const Probe &probe) {
+  if constexpr (I == std::tuple_size_v<Probe>) {
+    return 0;
+  } else {
+    const auto &column = std::get<I>(v);
+    const auto &key = std::get<I>(probe);
+    using key_type = std::remove_cvref_t<decltype(key)>;
+
+    if constexpr (is_column_range<key_type>::value) {
+      static_assert(I + 1 == std::tuple_size_v<Probe>,
+                    "a column_range must be the last prefix_range argument");
+      if (column < key.lo)
+        return -1;
+      return column < key.hi ? 0 : 1;
+    } else {
+      if (column < key)
+        return -1;
+      if (key < column)
+        return 1;
+      return compare_columns<I + 1>(v, probe);
+    }
   }
+}
 
-  for (auto s_it = s.begin(); s_it != s.end(); s_it++) {
-    new_set.add(*s_it);
+template <typename T, typename Compare>
+template <typename... Prefix> inline
+TreeSet<T, Compare>::value_range
+TreeSet<T, Compare>::prefix_range(const Prefix &... prefix) const {
+  static_assert(std::is_same_v<Compare, std::less<T>> ||
+                std::is_same_v<Compare, std::less<>>,
+                "prefix_range needs values in ascending lexicographic order");
+  static_assert(sizeof...(Prefix) <= std::tuple_size_v<T>,
+                "prefix_range has more columns than the values do");
+
+  auto probe = std::forward_as_tuple(prefix...);
+  auto before = [&](const T &v) { return compare_columns<0>(v, probe) < 0; };
+  auto within = [&](const T &v) { return compare_columns<0>(v, probe) <= 0; };
+
+  return {first_not_below(before), first_not_below(within)};
+}
+
+template <typename T, typename Compare> inline
+std::size_t TreeSet<T, Compare>::copy_range(const T &lo, const T &hi,
+                                            std::span<T> out) const {
+  TreeSetIter<T, Compare> it = lower_bound(lo);
+  std::size_t count = 0;
+
+  while (count < out.size() && it._current_node != nullptr &&
+         _cmp(it._current_node->value(), hi)) {
+    it.prefetch_upcoming();
+    out[count++] = it._current_node->value();
+    ++it;
   }
 
-  return new_set;
+  return count;
 }
 
 template <typename T, typename Compare> inline
-TreeSet<T, Compare> TreeSet<T, Compare>::intersect(const TreeSet<T, Compare> &s)
-  const {
-  TreeSet<T, Compare> new_set;
+bool TreeSet<T, Compare>::operator==(const TreeSet<T, Compare> &rhs) const {
+  if (_size != rhs._size)
+    return false;
+
+  auto this_it = begin();
+  auto rhs_it = rhs.begin();
+  
+  while (this_it != end() && rhs_it != rhs.end()) {
+    if (_cmp(*this_it, *rhs_it) || _cmp(*rhs_it, *this_it))
+      return false;
 
-  for (auto this_it = begin(); this_it != end(); this_it++) {
-    for (auto s_it = s.begin(); s_it != s.end(); s_it++) {
-      if (*this_it == *s_it)
-        new_set.add(*this_it);
+    ++this_it;
+    ++rhs_it;
+  }
+
+  return this_it == rhs_it; // both should equal end()
+}
+
+template <typename T, typename Compare> inline
+bool TreeSet<T, Compare>::operator==(const TreeSetView<T, Compare> &v) const {
+  if (_size != v.size())
+    return false;
+
+  auto v_it = v.begin();
+  for (auto this_it = begin(); this_it != end(); ++this_it, ++v_it) {
+    if (_cmp(*this_it, *v_it) || _cmp(*v_it, *this_it))
+      return false;
+  }
+
+  return true;
+}
+
+template <typename T, typename Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::union_of(const A &a, const B &b) {
+  TREESET_PROBE(plus_entry, a.size(), b.size());
+
+  // Merge the two sorted sequences into a list of new nodes, then balance it
+  Compare cmp;
+  sp_node head;
+  sp_node *tail = &head;
+  int count = 0;
+
+  auto a_it = a.begin();
+  auto b_it = b.begin();
+  while (a_it != a.end() || b_it != b.end()) {
+    if (b_it == b.end() || (a_it != a.end() && cmp(*a_it, *b_it))) {
+      *tail = std::make_shared<node>(*a_it);
+      ++a_it;
+    } else {
+      *tail = std::make_shared<node>(*b_it);
+      if (a_it != a.end() && !cmp(*b_it, *a_it)) // in both sets
+        ++a_it;
+      ++b_it;
     }
+
+    tail = &(*tail)->right;
+    count++;
   }
 
+  TreeSet<T, Compare> new_set;
+  new_set.adopt_sorted_list(head, count);
+
+  TREESET_PROBE(plus_return, new_set._size);
   return new_set;
 }
 
-template <typename T, typename Compare> inline
-TreeSet<T, Compare> TreeSet<T, Compare>::minus(const TreeSet<T, Compare> &s)
-  const {
+template <typename T, typename Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::intersection_of(const A &a,
+                                                         const B &b) {
+  TREESET_PROBE(intersect_entry, a.size(), b.size());
+
+  Compare cmp;
+  sp_node head;
+  sp_node *tail = &head;
+  int count = 0;
+
+  auto a_it = a.begin();
+  auto b_it = b.begin();
+  while (a_it != a.end() && b_it != b.end()) {
+    if (cmp(*a_it, *b_it)) {
+      ++a_it;
+    } else if (cmp(*b_it, *a_it)) {
+      ++b_it;
+    } else { // in both sets
+      *tail = std::make_shared<node>(*a_it);
+      tail = &(*tail)->right;
+      count++;
+      ++a_it;
+      ++b_it;
+    }
+  }
+
   TreeSet<T, Compare> new_set;
+  new_set.adopt_sorted_list(head, count);
 
-  for (auto this_it = begin(); this_it != end(); this_it++) {
-    if (!s.contains(*this_it))
-      new_set.add(*this_it);
+  TREESET_PROBE(intersect_return, new_set._size);
+  return new_set;
+}
+
+template <typename T, typename Compare>
+template <typename A, typename B> inline
+TreeSet<T, Compare> TreeSet<T, Compare>::difference_of(const A &a,
+                                                       const B &b) {
+  TREESET_PROBE(minus_entry, a.size(), b.size());
+
+  Compare cmp;
+  sp_node head;
+  sp_node *tail = &head;
+  int count = 0;
+
+  auto b_it = b.begin();
+  for (auto a_it = a.begin(); a_it != a.end(); ++a_it) {
+    while (b_it != b.end() && cmp(*b_it, *a_it))
+      ++b_it;
+
+    if (b_it == b.end() || cmp(*a_it, *b_it)) { // not in b
+      *tail = std::make_shared<node>(*a_it);
+      tail = &(*tail)->right;
+      count++;
+    }
   }
 
+  TreeSet<T, Compare> new_set;
+  new_set.adopt_sorted_list(head, count);
+
+  TREESET_PROBE(minus_return, new_set._size);
   return new_set;
 }
 
@@ -365,12 +1307,13 @@ TreeSet<T, Compare> TreeSet<T, Compare>::minus(const TreeSet<T, Compare> &s)
   Stream-output operator must not output a "\n" character, or any whitespace.
   An empty set would be output as: "[]" */
 template <typename T, typename Compare>
-ostream& operator<<(ostream &os, const TreeSet<T, Compare> &s) {
+std::ostream& operator<<(std::ostream &os, const TreeSet<T, Compare> &s) {
   os << "[";
 
   typename TreeSet<T, Compare>::iterator it = s.begin();
   while (it != s.end()) {
-    os << *it++;
+    os << *it;
+    ++it;
     
     if (it != s.end())
       os << ",";
@@ -381,11 +1324,30 @@ ostream& operator<<(ostream &os, const TreeSet<T, Compare> &s) {
 }
 
 template <typename T, typename Compare> inline
-TreeSet<T, Compare>::node::node(const sp_node &other) {
-  if (other == nullptr)
-    return;
+TreeSet<T, Compare>::node::node(const T &value)
+  : prefix(key_prefix(value)), stored(store(value)) {
+}
 
-  value = other->value;
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::node::stored_type
+TreeSet<T, Compare>::node::store(const T &value) {
+  if constexpr (VALUES_OUT_OF_LINE) {
+    void *p = treeset_value_arena().allocate(sizeof(T), alignof(T));
+    try {
+      return stored_type(new (p) T(value));
+    } catch (...) {
+      treeset_value_arena().deallocate(p, sizeof(T), alignof(T));
+      throw;
+    }
+  } else {
+    return value;
+  }
+}
+
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::node::node(const sp_node &other)
+  : node(other->value()) {
+  deleted = other->deleted;
 
   if (other->left != nullptr)
     left = std::make_shared<node>(other->left);
@@ -395,12 +1357,25 @@ TreeSet<T, Compare>::node::node(const sp_node &other) {
 }
 
 template <typename T, typename Compare> inline
-void TreeSet<T, Compare>::node::replace_child(const sp_node &old_child,
-                                              const sp_node &new_child) {
-  if (left == old_child)
-    left = new_child;
+TreeSet<T, Compare>::prefix_type TreeSet<T, Compare>::key_prefix(const T &value) {
+  if constexpr (has_key_prefix<T, Compare>)
+    return treeset_key_prefix<T, Compare>::of(value);
   else
-    right = new_child;
+    return prefix_type{};
+}
+
+template <typename T, typename Compare> inline
+bool TreeSet<T, Compare>::less_than_node(const T &value,
+                                         const prefix_type &prefix,
+                                         const node *n) const {
+  if constexpr (has_key_prefix<T, Compare>) {
+    if (prefix < n->prefix)
+      return true;
+    if (n->prefix < prefix)
+      return false;
+  }
+
+  return _cmp(value, n->value());
 }
 
 template <typename T, typename Compare> inline bool
@@ -409,20 +1384,21 @@ TreeSet<T, Compare>::sanity_check(const sp_node &n,
   if (n == nullptr)
     return _cmp(minval, maxval);
 
-  if (_cmp(n->value, minval) || _cmp(maxval, n->value)) {
-    cerr << "node " << n->value << " has issues.";
-    cerr << " minval: " << minval << ", maxval: " << maxval << endl;
+  if (_cmp(n->value(), minval) || _cmp(maxval, n->value())) {
+    std::cerr << "node " << n->value() << " has issues.";
+    std::cerr << " minval: " << minval << ", maxval: " << maxval << std::endl;
   }
 
-  return sanity_check(n->left, minval, n->value) &&
-    sanity_check(n->right, n->value, maxval);
+  return sanity_check(n->left, minval, n->value()) &&
+    sanity_check(n->right, n->value(), maxval);
 }
 
 template <typename T, typename Compare> inline bool
 TreeSet<T, Compare>::sanity_check(const sp_node &n) const {
   // Only perform sanity check if T has std::numeric_limits.
   // Use this TreeSet's Compare fn to determine minval & maxval to use for check
-  if (std::numeric_limits<T>::is_specialized) {
+  // (if constexpr, so that other T need not be printable for the diagnostics)
+  if constexpr (std::numeric_limits<T>::is_specialized) {
     // Initial guess at min/max values
     T minval = std::numeric_limits<T>::min();
     T maxval = std::numeric_limits<T>::max();
@@ -440,21 +1416,168 @@ TreeSet<T, Compare>::sanity_check(const sp_node &n) const {
 }
 
 template <typename T, typename Compare> inline
-TreeSet<T, Compare>::sp_node TreeSet<T, Compare>::merge(const sp_node &small,
-                                                        sp_node &big) {
-  if (small == nullptr)
-    return big;
+int TreeSet<T, Compare>::depth_bound() const {
+  static const double log_inv_alpha = std::log(1.0 / ALPHA);
+  return (int) (std::log((double) std::max(_max_nodes, 1)) / log_inv_alpha);
+}
+
+template <typename T, typename Compare> inline
+int TreeSet<T, Compare>::count_nodes(const node *n) {
+  if (n == nullptr)
+    return 0;
+
+  return 1 + count_nodes(n->left.get()) + count_nodes(n->right.get());
+}
 
-  if (big == nullptr)
-    return small;
+template <typename T, typename Compare> inline
+int TreeSet<T, Compare>::flatten(const sp_node &n, sp_node &head,
+                                 int &dropped) {
+  if (n == nullptr)
+    return 0;
 
-  sp_node n = big;
-  while (n->left != nullptr) {
-    n = n->left;
+  sp_node keep = n; // n may be a child pointer that is about to be relinked
+  int count = flatten(keep->right, head, dropped);
+  sp_node left = std::move(keep->left);
+
+  if (keep->deleted) {
+    keep->right = nullptr;
+    dropped++;
+  } else {
+    keep->right = std::move(head);
+    head = keep;
+    count++;
   }
 
-  n->left = small;
-  return big;
+  return count + flatten(left, head, dropped);
+}
+
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::sp_node
+TreeSet<T, Compare>::build_from_list(sp_node &head, int count) {
+  if (count == 0)
+    return nullptr;
+
+  sp_node left = build_from_list(head, count / 2);
+  sp_node n = std::move(head);
+  head = std::move(n->right);
+  n->left = std::move(left);
+  n->right = build_from_list(head, count - count / 2 - 1);
+  return n;
+}
+
+template <typename T, typename Compare> inline
+int TreeSet<T, Compare>::rebuild(sp_node &slot) {
+  sp_node head;
+  int dropped = 0;
+  int count = flatten(slot, head, dropped);
+
+  slot = build_from_list(head, count);
+  _tombstones -= dropped;
+
+  TREESET_PROBE(rebalance, count, _size);
+  return count;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::rebuild_all() {
+  rebuild(_root);
+  _max_nodes = _size;
+}
+
+template <typename T, typename Compare> inline
+int TreeSet<T, Compare>::rebalance_toward(sp_node &slot, const node *target,
+                                          int depth) {
+  node *n = slot.get();
+  if (n == nullptr)
+    return -1;
+
+  if (n == target)
+    return depth > depth_bound() ? count_nodes(n) : -1;
+
+  sp_node *child, *other;
+  if (_cmp(target->value(), n->value())) {
+    child = &n->left;
+    other = &n->right;
+  } else {
+    child = &n->right;
+    other = &n->left;
+  }
+
+  int child_size = rebalance_toward(*child, target, depth + 1);
+  if (child_size < 0)
+    return -1;
+
+  int size = child_size + 1 + count_nodes(other->get());
+  if (child_size > ALPHA * size) { // n is the scapegoat
+    size = rebuild(slot);
+
+    // The deepest node of a perfectly balanced subtree of size nodes
+    int deepest = depth + (int) std::bit_width((unsigned) size) - 1;
+    if (deepest <= depth_bound())
+      return -1;
+  }
+
+  return size;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::unlink(sp_node &slot) noexcept {
+  sp_node n = std::move(slot); // keeps n alive while its children move
+
+  if (n->left == nullptr) {
+    slot = n->right;
+  } else if (n->right == nullptr) {
+    slot = n->left;
+  } else {
+    // The successor is the leftmost node of the right subtree
+    sp_node *succ_slot = &n->right;
+    while ((*succ_slot)->left != nullptr)
+      succ_slot = &(*succ_slot)->left;
+
+    sp_node succ = *succ_slot;
+    *succ_slot = succ->right;
+    succ->left = n->left;
+    succ->right = n->right;
+    slot = std::move(succ);
+  }
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::adopt_sorted_list(sp_node &head, int count) {
+  _root = build_from_list(head, count);
+  _size = count;
+  _tombstones = 0;
+  _max_nodes = count;
+}
+
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::sp_node TreeSet<T, Compare>::make_node(const T &value) {
+  if (_pool == nullptr)
+    _pool.reset(new treeset_node_pool);
+
+  return std::allocate_shared<node>(treeset_node_allocator<node>(_pool.get()),
+                                    value);
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::clear() {
+  _root = nullptr;
+  _size = 0;
+  _tombstones = 0;
+  _max_nodes = 0;
+
+  // An empty sketch is exact for an empty set, stale or not before
+  if (_sketch)
+    _sketch->clear();
+  _sketch_stale = false;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::reserve(int n) {
+  if (_pool == nullptr)
+    _pool.reset(new treeset_node_pool);
+
+  _pool->reserve(n);
 }
 
 template <typename T, typename Compare> inline
@@ -462,102 +1585,504 @@ bool TreeSet<T, Compare>::add(const T &value) {
   assert(sanity_check(_root));
 
   if (size() == 0) {
-    _root = std::make_shared<node>(value);
+    // any tombstones left in the tree are dropped along with the old _root
+    _root = make_node(value);
     _size = 1;
+    _tombstones = 0;
+    _max_nodes = 1;
+    if (_sketch)
+      update_sketch([&] { _sketch->add(value); });
 
     assert(sanity_check(_root));
 
+    TREESET_PROBE(add, 0, _size);
     return true;
   }
 
-  sp_node n = _root;
-  
-  while (n != nullptr) {
-    if (value == n->value) { // value already exists
+  // Descend with one comparison per level, remembering the last node that
+  // value was not less than: if value is already in the tree, it is that one.
+  sp_node *slot = &_root;
+  node *candidate = nullptr;
+  const prefix_type prefix = key_prefix(value);
+  int depth = 0;
+
+  while (*slot != nullptr) {
+    node *n = slot->get();
+    if (less_than_node(value, prefix, n)) {
+      slot = &n->left;
+    } else {
+      candidate = n;
+      slot = &n->right;
+    }
+
+    depth++;
+  }
+
+  if (candidate != nullptr && !_cmp(candidate->value(), value)) { // exists
+    if (!candidate->deleted) {
+      TREESET_PROBE(add, depth, _size);
       return false;
-    } else if (_cmp(value, n->value)) { // attempt add to left subtree
-      if (n->left == nullptr) {
-        n->left = std::make_shared<node>(value);
-        _size++;
-        return true;
-      } else {
-        n = n->left;
-      }
-    } else { // attempt add to right subtree
-      if (n->right == nullptr) {
-        n->right = std::make_shared<node>(value);
-        _size++;
-        return true;
-      } else {
-        n = n->right;
-      }
     }
+
+    // value was lazily deleted, so bring its node back to life
+    candidate->deleted = false;
+    _tombstones--;
+    _size++;
+    if (_sketch)
+      update_sketch([&] { _sketch->add(value); });
+    TREESET_PROBE(add, depth, _size);
+    return true;
   }
 
+  *slot = make_node(value);
+  _size++;
+  _max_nodes = std::max(_max_nodes, _size + _tombstones);
+  if (_sketch)
+    update_sketch([&] { _sketch->add(value); });
+
+  if (depth > depth_bound())
+    rebalance_toward(_root, slot->get(), 0);
+
   assert(sanity_check(_root));
 
-  return false;
+  TREESET_PROBE(add, depth, _size);
+  return true;
 }
 
 template <typename T, typename Compare> inline
 bool TreeSet<T, Compare>::contains(const T &value) const {
-  if (size() == 0)
+  if (size() == 0) {
+    TREESET_PROBE(contains, 0, false);
     return false;
+  }
 
-  sp_node n = _root;
+  // Walk raw pointers so lookups never write to the nodes' reference counts.
+  // One comparison per level: the value, if present, is the last node that it
+  // was not less than.
+  const node *n = _root.get();
+  const node *candidate = nullptr;
+  const prefix_type prefix = key_prefix(value);
+  int depth = 0;
   
   while (n != nullptr) {
-    if (value == n->value) {
-      return true;
-    } else if (_cmp(value, n->value)) {
-      n = n->left;
+    if (less_than_node(value, prefix, n)) {
+      n = n->left.get();
     } else {
-      n = n->right;
+      candidate = n;
+      n = n->right.get();
     }
+
+    depth++;
   }
 
-  return false;
+  bool found = candidate != nullptr && !candidate->deleted &&
+               !_cmp(candidate->value(), value);
+
+  TREESET_PROBE(contains, depth, found);
+  return found;
 }
 
 template <typename T, typename Compare> inline
 bool TreeSet<T, Compare>::del(const T &value) {
   assert(sanity_check(_root));
 
-  if (size() == 0)
+  if (size() == 0) {
+    TREESET_PROBE(del, 0, 0);
     return false;
+  }
 
-  sp_node n = _root;
-  sp_node parent = nullptr;
+  // Find the slot holding the last node that value was not less than, as in
+  // add(), with one comparison per level
+  sp_node *slot = &_root;
+  sp_node *candidate = nullptr;
+  const prefix_type prefix = key_prefix(value);
+  int depth = 0, candidate_depth = 0;
+
+  while (*slot != nullptr) {
+    node *n = slot->get();
+    if (less_than_node(value, prefix, n)) {
+      slot = &n->left;
+    } else {
+      candidate = slot;
+      candidate_depth = depth;
+      slot = &n->right;
+    }
 
-  while (n != nullptr) {
-    if (value == n->value) { // found value to delete
-      if (parent == nullptr) { // we need to update the _root
-        // so merge the _root's children into the new _root        
-        _root = merge(n->left, n->right);
-      } else { // no need to update the _root
-        // we are deleting n, so first merge n's children
-        sp_node merged_children = merge(n->left, n->right);
-
-        // now replace n with its merged children
-        parent->replace_child(n, merged_children);
+    depth++;
+  }
+
+  if (candidate == nullptr || (*candidate)->deleted ||
+      _cmp((*candidate)->value(), value)) { // not in the set
+    TREESET_PROBE(del, depth, _size);
+    return false;
+  }
+
+  if (_lazy_delete) { // leave a tombstone instead of restructuring
+    (*candidate)->deleted = true;
+    _tombstones++;
+    _size--;
+    if (_sketch)
+      update_sketch([&] { _sketch->del(value); });
+    TREESET_PROBE(del, candidate_depth, _size);
+
+    if (_tombstones > _max_tombstone_fraction * (_size + _tombstones))
+      compact();
+
+    return true;
+  }
+
+  unlink(*candidate);
+  _size--;
+  if (_sketch)
+    update_sketch([&] { _sketch->del(value); });
+  TREESET_PROBE(del, candidate_depth, _size);
+
+  // Once the tree has shrunk well below its size at the last rebuild, its
+  // depth bound is too loose, so rebuild it
+  if (_size + _tombstones < ALPHA * _max_nodes)
+    rebuild_all();
+
+  assert(sanity_check(_root));
+
+  return true;
+}
+
+template <typename T, typename Compare> inline
+TreeSet<T, Compare>::sp_node
+TreeSet<T, Compare>::build_balanced(const std::vector<sp_node> &nodes, int lo,
+                                    int hi) {
+  if (lo >= hi)
+    return nullptr;
+
+  int mid = lo + (hi - lo) / 2;
+  sp_node n = nodes[mid];
+  n->left = build_balanced(nodes, lo, mid);
+  n->right = build_balanced(nodes, mid + 1, hi);
+  return n;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::apply_sorted(
+const std::vector<std::pair<T, bool>> &ops) {
+  assert(sanity_check(_root));
+
+  // The ops[lo, hi) that still have to be applied to the subtree in *slot
+  struct pending {
+    sp_node *slot;
+    size_t lo, hi;
+  };
+
+  // A new subtree of added nodes to hang in an empty slot. Its leftmost
+  // node is one of its deepest, and will end up at depth deepest.
+  struct hang {
+    sp_node *slot;
+    sp_node subtree;
+    node *leftmost;
+    int deepest;
+  };
+
+  std::vector<pending> level, next_level;
+  std::vector<hang> hangs;
+  std::vector<node *> revive, bury; // nodes to untombstone / tombstone
+  std::vector<sp_node *> unlinks;   // nodes to delete eagerly, shallowest first
+  std::vector<size_t> changed;      // ops that take effect, for the sketch
+  int added = 0;
+  int depth = 0;                    // depth of the slots in level
+
+  TREESET_PROBE(batch_entry, ops.size(), _size);
+
+  // Plan: walk the tree and allocate everything the batch needs, without
+  // changing the tree itself. Anything here may throw.
+
+  if (!ops.empty())
+    level.push_back({&_root, 0, ops.size()});
+
+  while (!level.empty()) {
+    for (const pending &p : level)
+      __builtin_prefetch(p.slot->get());
+
+    next_level.clear();
+
+    for (const pending &p : level) {
+      const sp_node &n = *p.slot;
+
+      if (n == nullptr && p.hi - p.lo == 1) { // the common single-op case
+        if (ops[p.lo].second) {
+          sp_node leaf = make_node(ops[p.lo].first);
+          node *leftmost = leaf.get();
+          hangs.push_back({p.slot, std::move(leaf), leftmost, depth});
+          added++;
+          if (_sketch)
+            changed.push_back(p.lo);
+        }
+        continue;
       }
-      
-      _size--;
-      return true;
-    } else if (_cmp(value, n->value)) { // attempt delete from left subtree
-      parent = n;
-      n = n->left;
-    } else { // attempt delete from right subtree
-      parent = n;
-      n = n->right;
+
+      if (n == nullptr) { // hang all the adds here as one balanced subtree
+        std::vector<sp_node> run;
+        for (size_t i = p.lo; i < p.hi; i++) {
+          if (!ops[i].second)
+            continue;
+
+          run.push_back(make_node(ops[i].first));
+          if (_sketch)
+            changed.push_back(i);
+        }
+
+        if (run.empty())
+          continue;
+
+        added += (int) run.size();
+        sp_node subtree = build_balanced(run, 0, (int) run.size());
+
+        int deepest = depth;
+        node *leftmost = subtree.get();
+        for (; leftmost->left != nullptr; leftmost = leftmost->left.get())
+          deepest++;
+
+        hangs.push_back({p.slot, std::move(subtree), leftmost, deepest});
+        continue;
+      }
+
+      // Binary search for the first op not less than this node's value
+      size_t mid = p.lo, end = p.hi;
+      while (mid < end) {
+        size_t m = mid + (end - mid) / 2;
+        if (_cmp(ops[m].first, n->value()))
+          mid = m + 1;
+        else
+          end = m;
+      }
+
+      bool here = mid < p.hi && !_cmp(n->value(), ops[mid].first);
+      size_t right_lo = here ? mid + 1 : mid;
+
+      if (p.lo < mid)
+        next_level.push_back({&n->left, p.lo, mid});
+      if (right_lo < p.hi)
+        next_level.push_back({&n->right, right_lo, p.hi});
+
+      if (!here)
+        continue;
+
+      if (ops[mid].second) { // add
+        if (!n->deleted)
+          continue;
+        revive.push_back(n.get());
+      } else if (!n->deleted) { // del
+        if (_lazy_delete)
+          bury.push_back(n.get());
+        else
+          unlinks.push_back(p.slot);
+      } else {
+        continue;
+      }
+
+      if (_sketch)
+        changed.push_back(mid);
     }
+
+    std::swap(level, next_level);
+    depth++;
+  }
+
+  // Commit: only pointer moves and flag flips from here on, none of which
+  // can throw, so the batch lands all at once.
+
+  for (hang &h : hangs)
+    *h.slot = std::move(h.subtree);
+
+  for (node *n : revive)
+    n->deleted = false;
+
+  for (node *n : bury)
+    n->deleted = true;
+
+  // Unlink deepest nodes first, so each unlink sees its final children
+  for (auto it = unlinks.rbegin(); it != unlinks.rend(); ++it)
+    unlink(**it);
+
+  _size += added + (int) revive.size() - (int) bury.size() - (int) unlinks.size();
+  _tombstones += (int) bury.size() - (int) revive.size();
+  _max_nodes = std::max(_max_nodes, _size + _tombstones);
+
+  // The sketch sees the batch's changes; if it cannot, it goes stale rather
+  // than throwing, so the batch still lands all at once
+  if (_sketch) {
+    update_sketch([&] {
+      for (size_t i : changed) {
+        if (ops[i].second)
+          _sketch->add(ops[i].first);
+        else
+          _sketch->del(ops[i].first);
+      }
+    });
+  }
+
+  // One rebalancing check for the whole batch. Rebuilding only relinks nodes,
+  // so it cannot fail either.
+  if (_tombstones > _max_tombstone_fraction * (_size + _tombstones)) {
+    compact();
+  } else if (_size + _tombstones < ALPHA * _max_nodes) {
+    rebuild_all();
+  } else {
+    for (const hang &h : hangs) {
+      if (h.deepest > depth_bound())
+        rebalance_toward(_root, h.leftmost, 0);
+    }
+  }
+
+  TREESET_PROBE(batch_return, added, _size);
+  assert(sanity_check(_root));
+}
+
+template <typename T, typename Compare> inline
+std::vector<std::pair<T, bool>> TreeSet<T, Compare>::WriteBatch::sorted_ops()
+  const {
+  std::vector<std::pair<T, bool>> ops{_ops};
+
+  // A stable sort keeps each value's ops in the order they were recorded
+  std::stable_sort(ops.begin(), ops.end(),
+                   [this](const std::pair<T, bool> &a,
+                          const std::pair<T, bool> &b) {
+                     return _cmp(a.first, b.first);
+                   });
+
+  // Keep only the last op in each run of equal values
+  size_t kept = 0;
+  for (size_t i = 0; i < ops.size(); i++) {
+    bool last = i + 1 == ops.size() || _cmp(ops[i].first, ops[i + 1].first);
+    if (last)
+      ops[kept++] = std::move(ops[i]);
   }
 
+  ops.erase(ops.begin() + kept, ops.end());
+  return ops;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::apply(const WriteBatch &batch) {
+  apply_sorted(batch.sorted_ops());
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::compact() {
+  if (_tombstones == 0)
+    return;
+
+  // The live nodes are relinked rather than copied, so compaction never
+  // copies values or allocates.
+  rebuild_all();
+
   assert(sanity_check(_root));
+}
 
-  return false;
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::rebuild_sketch() {
+  _sketch->clear();
+  for (auto it = begin(); it != end(); ++it)
+    _sketch->add(*it);
+}
+
+template <typename T, typename Compare>
+template <typename Update> inline
+void TreeSet<T, Compare>::update_sketch(Update update) noexcept {
+  try {
+    if (_sketch_stale)
+      rebuild_sketch();
+    else
+      update();
+
+    // The sketch's error grows with deletes as well as adds, so rebuilding
+    // once deletes outnumber the values keeps it within a constant factor of
+    // size(), at an amortized cost of one sketch add per delete
+    if (_sketch->deletes() > (std::uint64_t) _size)
+      rebuild_sketch();
+    _sketch_stale = false;
+  } catch (...) {
+    // Copying a value into the sketch failed part way; the set is fine
+    _sketch_stale = true;
+  }
+}
+
+template <typename T, typename Compare> inline
+treeset_quantile_sketch<T, Compare> TreeSet<T, Compare>::fresh_sketch() const {
+  treeset_quantile_sketch<T, Compare> sketch{*_sketch};
+  sketch.clear();
+  for (auto it = begin(); it != end(); ++it)
+    sketch.add(*it);
+  return sketch;
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::enable_sketch(int k) {
+  _sketch.reset(new treeset_quantile_sketch<T, Compare>(k));
+
+  // Until the rebuild completes, the sketch is missing values
+  _sketch_stale = true;
+  rebuild_sketch();
+  _sketch_stale = false;
+}
+
+template <typename T, typename Compare> inline
+int TreeSet<T, Compare>::approx_rank(const T &value) const {
+  assert(_sketch != nullptr);
+  double rank = _sketch_stale ? fresh_sketch().rank(value)
+                              : _sketch->rank(value);
+  return (int) std::clamp(std::round(rank), 0.0, (double) _size);
+}
+
+template <typename T, typename Compare> inline
+T TreeSet<T, Compare>::approx_quantile(double q) const {
+  assert(_sketch != nullptr && _size > 0);
+  return _sketch_stale ? fresh_sketch().quantile(q) : _sketch->quantile(q);
+}
+
+template <typename T, typename Compare> inline
+void TreeSet<T, Compare>::set_lazy_delete(bool lazy,
+                                          double max_tombstone_fraction) {
+  _lazy_delete = lazy;
+  _max_tombstone_fraction = max_tombstone_fraction;
+
+  if (!lazy)
+    compact();
 }
 
 /***************** End TreeSet definition ****************/
 
+// Sets of small keys are stored as bitmaps instead
+#include "treeset-bitmap.h"
+
+// Read-only sets over sorted arrays, which TreeSet's set algebra accepts
+#include "treeset-view.h"
+
+/***************** Precompiled instantiations ****************/
+
+/*! The key/comparator combinations that libtreeset.a (treeset-inst.cpp)
+  instantiates ahead of time. X is called as X(T, Compare) for each one.
+*/
+#define TREESET_PRECOMPILED(X)                  \
+  X(int, std::less<int>)                        \
+  X(int, std::greater<int>)                     \
+  X(long, std::less<long>)                      \
+  X(std::string, std::less<std::string>)
+
+/*! Programs that link with libtreeset.a can define TREESET_EXTERN_TEMPLATES
+  (before including this header) so their translation units use its
+  instantiations of the combinations above instead of compiling their own.
+*/
+#ifdef TREESET_EXTERN_TEMPLATES
+
+#include <string>
+
+#define TREESET_EXTERN_TEMPLATE(T, Compare)        \
+  extern template class TreeSet<T, Compare>;      \
+  extern template class TreeSetIter<T, Compare>;
+
+TREESET_PRECOMPILED(TREESET_EXTERN_TEMPLATE)
+
+#undef TREESET_EXTERN_TEMPLATE
+
+#endif
+
 #endif